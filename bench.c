@@ -0,0 +1,518 @@
+//
+// Created by dustyn on 7/27/24.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include "dustyns_transport_layer.h"
+#include "connection.h"
+#include "receive_ring.h"
+#include "timer_wheel.h"
+#include "pacing.h"
+#include "netsim.h"
+#include "log.h"
+#include "checksum.h"
+#include <pthread.h>
+#include <sys/wait.h>
+
+/*
+ * Loopback benchmark for the whole stack. We are the client end of a collection: messages get packetized with packetize_data(),
+ * sent with send_packet_collection_batched() and we wait for the ACK, resending whatever gets NACKed along the way, exactly
+ * like a real peer would. Start the server in collection mode first (no -w, with its stdout somewhere cheap) and point us at it:
+ *
+ *     UnixCustomTransportLayer > /dev/null & bench -s 512,65536,1048576 -n 1000 -f csv
+ *
+ * For every message size we send warmup messages that don't count, then messages that do, and report
+ * - throughput in MB/s of payload and packets/s of everything that went out, resends included
+ * - latency from handing the message over to its last ACK, p50, p99 and p999 in microseconds
+ * - how many packets were resent, and how many of those because the timer ran out rather than on a NACK
+ * as JSON (one array, one object per size) or CSV (a header line, one row per size), so runs can be diffed between releases.
+ *
+ * A message bigger than the peer lets a collection be goes out as several collections back to back, its latency covers all of them.
+ * A collection goes out in one burst, once that is more than the server's socket buffer holds most of it is dropped and the
+ * resends time out, -p paces our sends the same way the server's -p does. The server closes when we do, so every run needs a fresh server.
+ *
+ * -I impairs what we send (see netsim_configure()), give the server the same -I to impair its side too. With -U we don't need a
+ * server or raw sockets at all, we fork one off on a stand-in socket pair (see netsim_socketpair()) and it inherits the impairments,
+ * so goodput under, say, 1%, 5% and 10% loss comes out the same every run for the same seed:
+ *
+ *     for loss in 0.01 0.05 0.1; do bench -U -I seed=1,drop=$loss -s 65536 -n 200; done
+ *
+ * The server we fork off writes what it delivers into a pipe to us instead of /dev/null, we count it and checksum it as it comes
+ * and check it against what we sent once the server is gone. A resend the server takes for new data shows up as a mismatch
+ * rather than as goodput.
+ *
+ * Usage: bench [-s size,size,...] [-n messages] [-W warmup] [-f json|csv] [-p packets_per_second] [-I impairments] [-U]
+ */
+
+#define BENCH_LOCAL_PID 500
+#define BENCH_MAX_SIZES 32
+#define BENCH_DEFAULT_MESSAGES 1000
+#define BENCH_DEFAULT_WARMUP 50
+
+typedef struct BenchClient {
+    int socket;
+    TimerWheel wheel;
+    ReceiveRing ring;
+    Connection conn;
+    Packet *packets[MAX_PACKET_COLLECTION];
+} BenchClient;
+
+/*
+ * What the forked server delivered, read off its stdout on a thread of our own so a full pipe never holds the server up.
+ */
+typedef struct BenchDelivery {
+    int fd;
+    crc32c_fn update;
+    uint64_t bytes;
+    uint32_t crc;
+} BenchDelivery;
+
+typedef struct BenchResult {
+    size_t message_size;
+    uint32_t messages;
+    double seconds;
+    uint64_t bytes;
+    uint64_t packets_sent;
+    uint64_t retransmits;
+    uint64_t timeout_retransmits;
+    uint64_t p50_us;
+    uint64_t p99_us;
+    uint64_t p999_us;
+    NetsimStats impaired;
+} BenchResult;
+
+/*
+ * Resend the sequences in these ranges that are part of the collection, and count them.
+ */
+static void bench_resend(BenchClient *client, NackRange ranges[], uint16_t num_ranges, uint16_t num_packets, BenchResult *result) {
+    for (uint16_t r = 0; r < num_ranges; r++) {
+        if (ranges[r].start >= num_packets) {
+            ranges[r].length = 0;
+        } else if (ranges[r].start + ranges[r].length > num_packets) {
+            ranges[r].length = num_packets - ranges[r].start;
+        }
+        result->retransmits += ranges[r].length;
+        result->packets_sent += ranges[r].length;
+    }
+    if (send_missing_packets(&client->conn, ranges, num_ranges, client->packets, num_packets) != SUCCESS) {
+        fprintf(stderr, "Error resending packets\n");
+    }
+}
+
+/*
+ * Everything the server has to say about the collection we just sent, until it ACKs it. If it goes quiet for a whole RTO we resend
+ * the last packet, that is what makes the server look for gaps, so a lost tail or a lost NACK gets the collection moving again.
+ * Returns ERROR if the server closed on us or stopped answering altogether.
+ */
+static uint16_t bench_wait_for_ack(BenchClient *client, uint16_t num_packets, BenchResult *result) {
+    Connection *conn = &client->conn;
+    uint32_t length;
+
+    while (true) {
+        uint16_t waited = wait_for_packets(&client->ring, client->socket, &client->wheel, &conn->retransmit_timer);
+        if (waited == TIMED_OUT) {
+            NackRange last = {.start = num_packets - 1, .length = 1};
+            result->timeout_retransmits++;
+            bench_resend(client, &last, 1, num_packets, result);
+            continue;
+        }
+        if (waited != SUCCESS) {
+            fprintf(stderr, "Server stopped answering\n");
+            return ERROR;
+        }
+
+        uint8_t acked = 0;
+        uint8_t closed = 0;
+        do {
+            Packet *packet = receive_ring_next(&client->ring, client->socket, &length);
+            if (packet == NULL) {
+                return ERROR;
+            }
+            if (length < KERNEL_IP_HEADER_SIZE + sizeof(struct iphdr) + HEADER_SIZE) {
+                continue;
+            }
+
+            struct iphdr *ip_header = packet->iov[0].iov_base;
+            Header *header = packet->iov[1].iov_base;
+            //Our own packets come back to us on a raw socket too, only what the server sent us counts
+            if (ip_header->saddr != conn->peer_ip || header->dest_process_id != conn->local_pid ||
+                !header_version_supported(header->version)) {
+                continue;
+            }
+            //A re-ACK or a late NACK for a collection we are already done with
+            if (header->status != CLOSE && header->collection != conn->send_collection - 1) {
+                continue;
+            }
+
+            switch (header->status) {
+                case NACK: {
+                    NackRange ranges[MAX_NACK_RANGES];
+                    uint16_t num_ranges = read_nack_ranges(packet, ranges, MAX_NACK_RANGES);
+                    if (num_ranges != ERROR) {
+                        bench_resend(client, ranges, num_ranges, num_packets, result);
+                    }
+                    break;
+                }
+                case RESEND:
+                case CORRUPTION: {
+                    NackRange range = {.start = (uint16_t) header->sequence, .length = 1};
+                    bench_resend(client, &range, 1, num_packets, result);
+                    break;
+                }
+                case ACKNOWLEDGE:
+                    reset_timeout(&conn->retransmit_timer);
+                    conn->peer_collection_window = header->window;
+                    acked = 1;
+                    break;
+                case CLOSE:
+                    closed = 1;
+                    break;
+                default:
+                    break;
+            }
+        } while (client->ring.cursor != client->ring.head && !acked && !closed);
+        receive_ring_release_consumed(&client->ring);
+
+        if (closed) {
+            fprintf(stderr, "Server closed the connection\n");
+            return ERROR;
+        }
+        if (acked) {
+            return SUCCESS;
+        }
+    }
+}
+
+/*
+ * One message, as many collections as it takes. Each collection's packets point into data, so they have to be back in the pool
+ * before we move on, which they are once the collection is ACKed.
+ */
+static uint16_t bench_send_message(BenchClient *client, const char *data, size_t length, BenchResult *result) {
+    Connection *conn = &client->conn;
+    uint32_t failed[MAX_PACKET_COLLECTION];
+    size_t offset = 0;
+
+    do {
+        uint16_t window = connection_collection_limit(conn);
+        size_t chunk = length - offset < (size_t) window * conn->payload_size ? length - offset : (size_t) window * conn->payload_size;
+
+        PinnedBuffer pinned;
+        pinned_buffer_init(&pinned, data + offset, chunk, NULL, NULL);
+        uint16_t num_packets = packetize_data(conn, client->packets, &pinned, MAX_PACKET_COLLECTION);
+        if (num_packets == ERROR) {
+            fprintf(stderr, "Error packetizing %zu bytes\n", chunk);
+            return ERROR;
+        }
+
+        //A packet that didn't go out is a gap like any other, the server NACKs it
+        if (send_packet_collection_batched(client->socket, &conn->destination, num_packets, client->packets, failed, SEND_BATCH_SIZE,
+                                           &conn->retransmit_timer) == ERROR) {
+            release_packet_collection(&conn->pool, client->packets, num_packets);
+            return ERROR;
+        }
+        result->packets_sent += num_packets;
+
+        uint16_t acked = bench_wait_for_ack(client, num_packets, result);
+        release_packet_collection(&conn->pool, client->packets, num_packets);
+        if (acked != SUCCESS) {
+            return ERROR;
+        }
+        offset += chunk;
+    } while (offset < length);
+
+    return SUCCESS;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t left = *(const uint64_t *) a;
+    uint64_t right = *(const uint64_t *) b;
+    return left < right ? -1 : left > right;
+}
+
+/*
+ * Nearest rank, the smallest sample that at least this fraction of the samples are no bigger than.
+ */
+static uint64_t percentile(const uint64_t sorted[], uint32_t count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    uint32_t rank = (uint32_t) ceil(fraction * count);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static uint16_t bench_run(BenchClient *client, const char *data, size_t message_size, uint32_t messages, uint32_t warmup,
+                          BenchResult *result) {
+    BenchResult discard;
+    uint64_t *latencies = malloc((messages > 0 ? messages : 1) * sizeof(uint64_t));
+    if (latencies == NULL) {
+        perror("malloc");
+        return ERROR;
+    }
+
+    memset(&discard, 0, sizeof(discard));
+    for (uint32_t i = 0; i < warmup; i++) {
+        if (bench_send_message(client, data, message_size, &discard) != SUCCESS) {
+            free(latencies);
+            return ERROR;
+        }
+    }
+
+    memset(result, 0, sizeof(BenchResult));
+    result->message_size = message_size;
+    NetsimStats before;
+    netsim_get_stats(&before);
+    uint64_t start = monotonic_us();
+    for (uint32_t i = 0; i < messages; i++) {
+        uint64_t sent_at = monotonic_us();
+        if (bench_send_message(client, data, message_size, result) != SUCCESS) {
+            free(latencies);
+            return ERROR;
+        }
+        latencies[i] = monotonic_us() - sent_at;
+        result->messages++;
+        result->bytes += message_size;
+    }
+    result->seconds = (double) (monotonic_us() - start) / 1e6;
+    netsim_get_stats(&result->impaired);
+    result->impaired.dropped -= before.dropped;
+    result->impaired.duplicated -= before.duplicated;
+    result->impaired.reordered -= before.reordered;
+    result->impaired.corrupted -= before.corrupted;
+
+    qsort(latencies, messages, sizeof(uint64_t), compare_latency);
+    result->p50_us = percentile(latencies, messages, 0.50);
+    result->p99_us = percentile(latencies, messages, 0.99);
+    result->p999_us = percentile(latencies, messages, 0.999);
+    free(latencies);
+    return SUCCESS;
+}
+
+static void *bench_drain_delivery(void *arg) {
+    BenchDelivery *delivery = arg;
+    char buffer[64 * 1024];
+    ssize_t received;
+
+    while ((received = read(delivery->fd, buffer, sizeof(buffer))) != 0) {
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            break;
+        }
+        delivery->bytes += received;
+        delivery->crc = delivery->update(delivery->crc, buffer, received);
+    }
+    return NULL;
+}
+
+/*
+ * Every message we send is the start of data, so what the server should have delivered is warmup + messages copies of it for
+ * every size we got through, in that order.
+ */
+static uint16_t bench_verify_delivery(const BenchDelivery *delivery, const char *data, const BenchResult results[], uint16_t num_results,
+                                      uint32_t warmup) {
+    uint64_t bytes = 0;
+    uint32_t crc = 0;
+
+    for (uint16_t i = 0; i < num_results; i++) {
+        for (uint32_t j = 0; j < warmup + results[i].messages; j++) {
+            crc = delivery->update(crc, data, results[i].message_size);
+        }
+        bytes += (uint64_t) (warmup + results[i].messages) * results[i].message_size;
+    }
+
+    if (delivery->bytes != bytes || delivery->crc != crc) {
+        fprintf(stderr, "Server delivered %lu bytes (crc32c %08x), we sent %lu bytes (crc32c %08x)\n", delivery->bytes, delivery->crc, bytes,
+                crc);
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+static double megabytes_per_second(const BenchResult *result) {
+    return result->seconds > 0 ? (double) result->bytes / 1e6 / result->seconds : 0;
+}
+
+static double packets_per_second(const BenchResult *result) {
+    return result->seconds > 0 ? (double) result->packets_sent / result->seconds : 0;
+}
+
+static void print_json(const BenchResult results[], uint16_t num_results, FILE *stream) {
+    fprintf(stream, "[\n");
+    for (uint16_t i = 0; i < num_results; i++) {
+        const BenchResult *result = &results[i];
+        fprintf(stream,
+                "  {\"message_size\": %zu, \"messages\": %u, \"seconds\": %.6f, \"mb_per_s\": %.3f, \"packets_per_s\": %.1f, "
+                "\"p50_us\": %lu, \"p99_us\": %lu, \"p999_us\": %lu, \"packets_sent\": %lu, \"retransmits\": %lu, "
+                "\"timeout_retransmits\": %lu, \"dropped\": %lu, \"duplicated\": %lu, \"reordered\": %lu, \"corrupted\": %lu}%s\n",
+                result->message_size, result->messages, result->seconds, megabytes_per_second(result), packets_per_second(result),
+                result->p50_us, result->p99_us, result->p999_us, result->packets_sent, result->retransmits, result->timeout_retransmits,
+                result->impaired.dropped, result->impaired.duplicated, result->impaired.reordered, result->impaired.corrupted,
+                i + 1 < num_results ? "," : "");
+    }
+    fprintf(stream, "]\n");
+}
+
+static void print_csv(const BenchResult results[], uint16_t num_results, FILE *stream) {
+    fprintf(stream, "message_size,messages,seconds,mb_per_s,packets_per_s,p50_us,p99_us,p999_us,packets_sent,retransmits,timeout_retransmits,dropped,duplicated,reordered,corrupted\n");
+    for (uint16_t i = 0; i < num_results; i++) {
+        const BenchResult *result = &results[i];
+        fprintf(stream, "%zu,%u,%.6f,%.3f,%.1f,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", result->message_size, result->messages,
+                result->seconds, megabytes_per_second(result), packets_per_second(result), result->p50_us, result->p99_us, result->p999_us,
+                result->packets_sent, result->retransmits, result->timeout_retransmits, result->impaired.dropped,
+                result->impaired.duplicated, result->impaired.reordered, result->impaired.corrupted);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    size_t sizes[BENCH_MAX_SIZES] = {64, PAYLOAD_SIZE, 16 * 1024, 64 * 1024};
+    uint16_t num_sizes = 4;
+    uint32_t messages = BENCH_DEFAULT_MESSAGES;
+    uint32_t warmup = BENCH_DEFAULT_WARMUP;
+    uint8_t csv = 0;
+    uint8_t stand_in = 0;
+    pid_t server = -1;
+    BenchDelivery delivery = {.fd = -1, .update = crc32c_implementation()};
+    pthread_t drainer;
+    int option;
+
+    while ((option = getopt(argc, argv, "s:n:W:f:p:I:U")) != -1) {
+        switch (option) {
+            case 's':
+                num_sizes = 0;
+                for (char *size = strtok(optarg, ","); size != NULL && num_sizes < BENCH_MAX_SIZES; size = strtok(NULL, ",")) {
+                    sizes[num_sizes++] = strtoull(size, NULL, 10);
+                }
+                break;
+            case 'n':
+                messages = (uint32_t) atoi(optarg);
+                break;
+            case 'W':
+                warmup = (uint32_t) atoi(optarg);
+                break;
+            case 'f':
+                if (strcmp(optarg, "csv") == 0) {
+                    csv = 1;
+                } else if (strcmp(optarg, "json") != 0) {
+                    fprintf(stderr, "Unknown format %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                pacing_set_default(atof(optarg), 0);
+                break;
+            case 'I':
+                if (netsim_configure(optarg) != SUCCESS) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'U':
+                stand_in = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s size,size,...] [-n messages] [-W warmup] [-f json|csv] [-p packets_per_second] "
+                                "[-I impairments] [-U]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    size_t largest = 0;
+    for (uint16_t i = 0; i < num_sizes; i++) {
+        largest = sizes[i] > largest ? sizes[i] : largest;
+    }
+    char *data = malloc(largest > 0 ? largest : 1);
+    if (data == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < largest; i++) {
+        data[i] = (char) ('a' + i % 26);
+    }
+
+    static BenchClient client;
+    if (stand_in) {
+        int sockets[2];
+        int delivered[2];
+        if (netsim_socketpair(sockets) != SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if (pipe(delivered) == -1) {
+            perror("pipe");
+            return EXIT_FAILURE;
+        }
+        server = fork();
+        if (server < 0) {
+            perror("fork");
+            return EXIT_FAILURE;
+        }
+        if (server == 0) {
+            //The server writes out everything it receives, that goes to us to check, its comings and goings nobody needs to see
+            close(sockets[0]);
+            close(delivered[0]);
+            if (dup2(delivered[1], STDOUT_FILENO) == -1) {
+                perror("dup2");
+                exit(EXIT_FAILURE);
+            }
+            close(delivered[1]);
+            log_set_level(LOG_LEVEL_WARN);
+            netsim_reseed(1);
+            handle_client_connection(sockets[1], inet_addr("127.0.0.1"), inet_addr("127.0.0.1"), BENCH_LOCAL_PID);
+        }
+        close(sockets[1]);
+        close(delivered[1]);
+        client.socket = sockets[0];
+        delivery.fd = delivered[0];
+        if (pthread_create(&drainer, NULL, bench_drain_delivery, &delivery) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    } else if ((client.socket = socket(AF_INET, SOCK_RAW, IP_HDRINCL)) == -1) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+    if (timer_wheel_init(&client.wheel) != SUCCESS ||
+        receive_ring_init(&client.ring, RECEIVE_RING_SLOTS, RECEIVE_BATCH_SIZE, 0, PAYLOAD_SIZE) != SUCCESS ||
+        connection_init(&client.conn, client.socket, inet_addr("127.0.0.1"), BENCH_LOCAL_PID, inet_addr("127.0.0.1"), SERVER_PID,
+                        &client.wheel, DEFAULT_WINDOW_SIZE, PACKET_POOL_INITIAL_BLOCKS, collection_timeout_handler) != SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    BenchResult results[BENCH_MAX_SIZES];
+    uint16_t num_results = 0;
+    int exit_code = EXIT_SUCCESS;
+    for (uint16_t i = 0; i < num_sizes; i++) {
+        if (bench_run(&client, data, sizes[i], messages, warmup, &results[num_results]) != SUCCESS) {
+            fprintf(stderr, "Giving up at %zu byte messages\n", sizes[i]);
+            exit_code = EXIT_FAILURE;
+            break;
+        }
+        num_results++;
+    }
+
+    if (csv) {
+        print_csv(results, num_results, stdout);
+    } else {
+        print_json(results, num_results, stdout);
+    }
+
+    handle_close(&client.conn);
+    connection_release(&client.conn);
+    receive_ring_destroy(&client.ring);
+    timer_wheel_destroy(&client.wheel);
+    if (server > 0) {
+        waitpid(server, NULL, 0);
+        //The server is gone so the pipe is at EOF once we have read what is left in it
+        pthread_join(drainer, NULL);
+        close(delivery.fd);
+        if (exit_code == EXIT_SUCCESS && bench_verify_delivery(&delivery, data, results, num_results, warmup) != SUCCESS) {
+            exit_code = EXIT_FAILURE;
+        }
+    }
+    close(client.socket);
+    free(data);
+    return exit_code;
+}
@@ -0,0 +1,143 @@
+//
+// Created by dustyn on 7/21/24.
+//
+
+#include <string.h>
+#include "checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42_PATH 1
+#endif
+
+/*
+ * The payload checksum used to be every byte XORed together into 16 bits, one byte at a time. That is slow, and it is blind to a lot of
+ * real damage: two flips of the same bit anywhere in the packet cancel out, and swapping bytes around doesn't change it at all.
+ *
+ * CRC32C (the Castagnoli polynomial, same one iSCSI, ext4 and SCTP use) catches all of that, and x86 has had an instruction for it since
+ * SSE4.2 that chews through 8 bytes at a time. Where we don't have the instruction we fall back to slicing by 8, eight 256 entry tables
+ * that also let us take 8 bytes per step instead of 1. Which one we use is decided once at startup from what the CPU supports.
+ *
+ * Both give exactly the same answer, the usual ~0 in and ~0 out on top of the raw update functions is done in crc32c().
+ */
+
+#define CRC32C_POLYNOMIAL 0x82F63B78U
+
+static uint32_t crc32c_table[8][256];
+static crc32c_fn crc32c_selected = crc32c_update_slice8;
+
+/*
+ * Build the tables and pick an implementation before main() runs, so there is nothing to race on once worker threads start.
+ */
+__attribute__((constructor)) static void crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int slice = 1; slice < 8; slice++) {
+            uint32_t previous = crc32c_table[slice - 1][i];
+            crc32c_table[slice][i] = (previous >> 8) ^ crc32c_table[0][previous & 0xFF];
+        }
+    }
+
+    if (crc32c_has_sse42()) {
+        crc32c_selected = crc32c_update_sse42;
+    }
+}
+
+uint32_t xor_checksum(const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    uint16_t checksum = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        checksum ^= bytes[i];
+    }
+    return checksum;
+}
+
+uint32_t crc32c_update_slice8(uint32_t crc, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (length >= 8) {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, bytes, sizeof(low));
+        memcpy(&high, bytes + 4, sizeof(high));
+        low ^= crc;
+
+        crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF] ^
+              crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24] ^
+              crc32c_table[3][high & 0xFF] ^ crc32c_table[2][(high >> 8) & 0xFF] ^
+              crc32c_table[1][(high >> 16) & 0xFF] ^ crc32c_table[0][high >> 24];
+
+        bytes += 8;
+        length -= 8;
+    }
+#endif
+
+    while (length-- > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *bytes++) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42_PATH
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_update_sse42(uint32_t crc, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        bytes += 8;
+        length -= 8;
+    }
+    crc = (uint32_t) crc64;
+#endif
+
+    while (length >= 4) {
+        uint32_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+        bytes += 4;
+        length -= 4;
+    }
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+    }
+    return crc;
+}
+
+uint8_t crc32c_has_sse42() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") ? 1 : 0;
+}
+
+#else
+
+uint32_t crc32c_update_sse42(uint32_t crc, const void *data, size_t length) {
+    return crc32c_update_slice8(crc, data, length);
+}
+
+uint8_t crc32c_has_sse42() {
+    return 0;
+}
+
+#endif
+
+crc32c_fn crc32c_implementation() {
+    return crc32c_selected;
+}
+
+uint32_t crc32c(const void *data, size_t length) {
+    return ~crc32c_selected(~0U, data, length);
+}
@@ -0,0 +1,31 @@
+//
+// Created by dustyn on 7/21/24.
+//
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_CHECKSUM_H
+#define UNIXCUSTOMTRANSPORTLAYER_CHECKSUM_H
+
+/*
+ * Which algorithm produced Header.checksum. XOR is the original byte XOR, only kept so we can still check packets from old senders.
+ */
+#define CHECKSUM_XOR 0
+#define CHECKSUM_CRC32C 1
+#define DEFAULT_CHECKSUM_TYPE CHECKSUM_CRC32C
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const void *data, size_t length);
+
+uint32_t xor_checksum(const void *data, size_t length);
+
+uint32_t crc32c_update_slice8(uint32_t crc, const void *data, size_t length);
+
+uint32_t crc32c_update_sse42(uint32_t crc, const void *data, size_t length);
+
+uint8_t crc32c_has_sse42();
+
+crc32c_fn crc32c_implementation();
+
+uint32_t crc32c(const void *data, size_t length);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_CHECKSUM_H
@@ -0,0 +1,235 @@
+//
+// Created by dustyn on 7/21/24.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "checksum.h"
+#include "network_layer.h"
+
+/*
+ * Microbenchmark for the payload and ip header checksums. Every implementation is run over the same buffer at a few sizes, a packet
+ * payload among them, and we print how many GB/s each one gets through. Before timing anything we make sure the implementations agree
+ * with each other (and CRC32C with the standard check value), a fast wrong answer is no use to us.
+ *
+ * For the ip header we also time what sending a packet costs: building and summing the header from scratch the way it used to be done,
+ * against copying a template and patching tot_len and id with the incremental update.
+ *
+ * Usage: checksum_bench [seconds per case]
+ */
+
+#define BENCH_MAX_BUFFER (1 << 20)
+#define CRC32C_CHECK_VALUE 0xE3069283U
+
+typedef struct BenchCase {
+    const char *name;
+    uint32_t (*run)(const void *data, size_t length);
+} BenchCase;
+
+static uint32_t run_xor(const void *data, size_t length) {
+    return xor_checksum(data, length);
+}
+
+static uint32_t run_slice8(const void *data, size_t length) {
+    return ~crc32c_update_slice8(~0U, data, length);
+}
+
+static uint32_t run_sse42(const void *data, size_t length) {
+    return ~crc32c_update_sse42(~0U, data, length);
+}
+
+static uint32_t run_dispatched(const void *data, size_t length) {
+    return crc32c(data, length);
+}
+
+/*
+ * The ip checksum loop as it was before, 16 bits at a time, kept here as the baseline.
+ */
+static uint16_t old_ip_checksum(const void *data, int len) {
+    const uint16_t *buf = data;
+    uint32_t sum;
+
+    for (sum = 0; len > 1; len -= 2) {
+        sum += *buf++;
+    }
+    if (len == 1) {
+        sum += *(const unsigned char *) buf;
+    }
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum += (sum >> 16);
+    return ~sum;
+}
+
+static uint32_t run_old_ip(const void *data, size_t length) {
+    return old_ip_checksum(data, (int) length);
+}
+
+static uint32_t run_ones_scalar(const void *data, size_t length) {
+    return (uint16_t) ~ones_complement_fold(ones_complement_sum_scalar(data, length, 0));
+}
+
+static uint32_t run_ones_avx2(const void *data, size_t length) {
+    return (uint16_t) ~ones_complement_fold(ones_complement_sum_avx2(data, length, 0));
+}
+
+static double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+static double bench(const BenchCase *bench_case, const unsigned char *buffer, size_t length, double seconds) {
+    volatile uint32_t sink = 0;
+    uint64_t iterations = 0;
+    uint64_t batch = (BENCH_MAX_BUFFER / length) + 1;
+    double start = now_seconds();
+    double elapsed;
+
+    do {
+        for (uint64_t i = 0; i < batch; i++) {
+            sink ^= bench_case->run(buffer, length);
+        }
+        iterations += batch;
+        elapsed = now_seconds() - start;
+    } while (elapsed < seconds);
+
+    (void) sink;
+    return (double) iterations * (double) length / elapsed / 1e9;
+}
+
+static void print_table(const BenchCase cases[], size_t num_cases, const unsigned char *buffer, const size_t sizes[],
+                        size_t num_sizes, double seconds) {
+    printf("%-20s", "GB/s");
+    for (size_t s = 0; s < num_sizes; s++) {
+        printf("%12zu", sizes[s]);
+    }
+    printf("\n");
+
+    for (size_t c = 0; c < num_cases; c++) {
+        printf("%-20s", cases[c].name);
+        for (size_t s = 0; s < num_sizes; s++) {
+            printf("%12.2f", bench(&cases[c], buffer, sizes[s], seconds));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * Nanoseconds per header, mode 0 fills and sums the header from scratch with the old loop, mode 1 the same with the new sum,
+ * mode 2 copies a template and patches it. tot_len and id change every time like they would from packet to packet.
+ */
+static double bench_ip_header(int mode, double seconds) {
+    struct iphdr template;
+    struct iphdr header;
+    volatile uint16_t sink = 0;
+    uint64_t iterations = 0;
+    double start = now_seconds();
+    double elapsed;
+
+    fill_ip_header(&template, htonl(0x7F000001), htonl(0x7F000001));
+
+    do {
+        for (uint32_t i = 0; i < 65536; i++) {
+            if (mode == 2) {
+                fill_ip_header_from_template(&header, &template, 64 + (i & 511));
+                ip_header_set_id(&header, i);
+            } else {
+                memcpy(&header, &template, sizeof(header));
+                header.tot_len = htons(64 + (i & 511));
+                header.id = htons(i);
+                header.check = 0;
+                header.check = mode == 0 ? old_ip_checksum(&header, sizeof(header)) : checksum(&header, sizeof(header));
+            }
+            sink ^= header.check;
+        }
+        iterations += 65536;
+        elapsed = now_seconds() - start;
+    } while (elapsed < seconds);
+
+    (void) sink;
+    return elapsed * 1e9 / (double) iterations;
+}
+
+static int check_ip_checksums(const unsigned char *buffer) {
+    for (size_t length = 0; length < 4096; length++) {
+        uint32_t expected = run_old_ip(buffer + 1, length);
+        if (run_ones_scalar(buffer + 1, length) != expected || run_ones_avx2(buffer + 1, length) != expected) {
+            fprintf(stderr, "ones complement sums disagree at length %zu\n", length);
+            return 0;
+        }
+    }
+
+    struct iphdr template;
+    struct iphdr header;
+    fill_ip_header(&template, htonl(0x7F000001), htonl(0x0A000002));
+    for (uint32_t i = 0; i < 65536; i++) {
+        fill_ip_header_from_template(&header, &template, i);
+        ip_header_set_id(&header, i * 7);
+        if (compare_ip_checksum(&header) != SUCCESS) {
+            fprintf(stderr, "incremental update wrong for tot_len %u\n", i);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+    size_t sizes[] = {64, 512, 4096, BENCH_MAX_BUFFER};
+
+    unsigned char *buffer = malloc(BENCH_MAX_BUFFER);
+    if (buffer == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    srand(1);
+    for (size_t i = 0; i < BENCH_MAX_BUFFER; i++) {
+        buffer[i] = (unsigned char) rand();
+    }
+
+    if (run_slice8("123456789", 9) != CRC32C_CHECK_VALUE || run_dispatched("123456789", 9) != CRC32C_CHECK_VALUE) {
+        fprintf(stderr, "CRC32C check value mismatch\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t length = 0; length < 4096; length++) {
+        if (run_slice8(buffer + 1, length) != run_sse42(buffer + 1, length)) {
+            fprintf(stderr, "slice-by-8 and sse4.2 disagree at length %zu\n", length);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!check_ip_checksums(buffer)) {
+        return EXIT_FAILURE;
+    }
+
+    BenchCase cases[] = {
+            {"xor (old)",         run_xor},
+            {"crc32c slice-by-8", run_slice8},
+            {"crc32c sse4.2",     run_sse42},
+            {"crc32c dispatched", run_dispatched},
+    };
+
+    BenchCase ip_cases[] = {
+            {"16 bit loop (old)", run_old_ip},
+            {"ones scalar",       run_ones_scalar},
+            {"ones avx2",         run_ones_avx2},
+    };
+
+    printf("sse4.2 crc32: %s\n", crc32c_has_sse42() ? "yes" : "no (sse4.2 row is the fallback)");
+    print_table(cases, sizeof(cases) / sizeof(cases[0]), buffer, sizes, sizeof(sizes) / sizeof(sizes[0]), seconds);
+
+    size_t ip_sizes[] = {sizeof(struct iphdr), 512, 4096, BENCH_MAX_BUFFER};
+    printf("\navx2: %s\n", ones_complement_has_avx2() ? "yes" : "no (avx2 row is the fallback)");
+    print_table(ip_cases, sizeof(ip_cases) / sizeof(ip_cases[0]), buffer, ip_sizes, sizeof(ip_sizes) / sizeof(ip_sizes[0]),
+                seconds);
+
+    printf("\nns per ip header\n");
+    printf("%-32s%8.2f\n", "fill and sum, 16 bit loop (old)", bench_ip_header(0, seconds));
+    printf("%-32s%8.2f\n", "fill and sum, new sum", bench_ip_header(1, seconds));
+    printf("%-32s%8.2f\n", "template and incremental patch", bench_ip_header(2, seconds));
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,218 @@
+//
+// Created by dustyn on 7/23/24.
+//
+
+#include <math.h>
+#include <string.h>
+#include "congestion.h"
+
+/*
+ * The send window used to put window_size packets out as soon as they were queued, whatever the network made of it. That window is
+ * only flow control, it says what the receiver can hold, not what the path between us can carry, so on anything slower than loopback
+ * we would overrun a queue somewhere, lose a burst and then overrun it again with the resends.
+ *
+ * Congestion control puts a second limit on packets in flight, cwnd, that grows while ACKs come back clean and shrinks when packets
+ * go missing. Reno is the textbook AIMD: double every RTT in slow start, then one packet per RTT, halve on loss. CUBIC (RFC 8312) grows
+ * as a cubic function of the time since the last loss instead, so it gets back to where it lost quickly, creeps up carefully around
+ * that point and only then probes further, which suits long fat paths that Reno takes ages to fill.
+ */
+
+static const CongestionOps *congestion_selected = &congestion_cubic;
+
+static const CongestionOps *congestion_algorithms[] = {
+        &congestion_reno,
+        &congestion_cubic,
+};
+
+static void congestion_clamp(CongestionControl *cc) {
+    if (cc->cwnd > cc->max_cwnd) {
+        cc->cwnd = cc->max_cwnd;
+    }
+    if (cc->cwnd < LOSS_CWND) {
+        cc->cwnd = LOSS_CWND;
+    }
+}
+
+/*
+ * Slow start, one packet more for every packet ACKed, but not past ssthresh. Returns what was left over for congestion avoidance.
+ */
+static uint32_t congestion_slow_start(CongestionControl *cc, uint32_t acked) {
+    uint32_t room = cc->ssthresh - cc->cwnd;
+    uint32_t used = acked < room ? acked : room;
+    cc->cwnd += used;
+    return acked - used;
+}
+
+static void reno_init(CongestionControl *cc) {
+    cc->acked_count = 0;
+}
+
+/*
+ * Congestion avoidance counts ACKed packets and opens the window by one each time a whole window's worth has been ACKed.
+ */
+static void reno_on_ack(CongestionControl *cc, uint32_t acked, uint64_t srtt_us, uint64_t now_us) {
+    if (cc->cwnd < cc->ssthresh) {
+        acked = congestion_slow_start(cc, acked);
+    }
+    cc->acked_count += acked;
+    while (cc->acked_count >= cc->cwnd) {
+        cc->acked_count -= cc->cwnd;
+        cc->cwnd++;
+    }
+}
+
+static void reno_on_loss(CongestionControl *cc, uint64_t now_us) {
+    cc->ssthresh = cc->cwnd / 2 > MIN_CWND ? cc->cwnd / 2 : MIN_CWND;
+    cc->cwnd = cc->ssthresh;
+    cc->acked_count = 0;
+}
+
+static void reno_on_timeout(CongestionControl *cc, uint64_t now_us) {
+    reno_on_loss(cc, now_us);
+    cc->cwnd = LOSS_CWND;
+}
+
+const CongestionOps congestion_reno = {
+        .name = "reno",
+        .init = reno_init,
+        .on_ack = reno_on_ack,
+        .on_loss = reno_on_loss,
+        .on_timeout = reno_on_timeout,
+};
+
+static void cubic_init(CongestionControl *cc) {
+    cc->cwnd_fraction = 0;
+    cc->w_max = 0;
+    cc->w_est = 0;
+    cc->k = 0;
+    cc->origin = 0;
+    cc->epoch_start_us = 0;
+}
+
+/*
+ * The window the cubic curve wants t + RTT into the epoch, W(t) = C(t - K)^3 + W_max. The clock starts on the first ACK after a loss,
+ * not the loss itself, so time spent in recovery doesn't count as growth. w_est tracks what Reno would have by now, and we never
+ * do worse than that (the TCP friendly region), on short RTTs the curve is so flat that this is what actually grows the window.
+ */
+static void cubic_on_ack(CongestionControl *cc, uint32_t acked, uint64_t srtt_us, uint64_t now_us) {
+    if (cc->cwnd < cc->ssthresh) {
+        acked = congestion_slow_start(cc, acked);
+        if (acked == 0) {
+            return;
+        }
+    }
+
+    double cwnd = (double) cc->cwnd + cc->cwnd_fraction;
+
+    if (cc->epoch_start_us == 0) {
+        cc->epoch_start_us = now_us;
+        if (cwnd < cc->w_max) {
+            cc->k = cbrt((cc->w_max - cwnd) / CUBIC_C);
+            cc->origin = cc->w_max;
+        } else {
+            cc->k = 0;
+            cc->origin = cwnd;
+        }
+        cc->w_est = cwnd;
+    }
+
+    double t = (double) (now_us - cc->epoch_start_us + srtt_us) / 1e6;
+    double target = cc->origin + CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k);
+
+    cc->w_est += 3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA) * (double) acked / cwnd;
+    if (cc->w_est > target) {
+        target = cc->w_est;
+    }
+
+    //Never more than half a packet per packet ACKed, same cap as slow start's doubling spread over an RTT
+    if (target > cwnd) {
+        double step = (target - cwnd) / cwnd * (double) acked;
+        cwnd += step < (double) acked / 2 ? step : (double) acked / 2;
+    }
+
+    cc->cwnd = (uint32_t) cwnd;
+    cc->cwnd_fraction = cwnd - (double) cc->cwnd;
+}
+
+/*
+ * Losing again before getting back to the last W_max means someone else is taking bandwidth, remember a lower peak so we give
+ * them room sooner (fast convergence).
+ */
+static void cubic_on_loss(CongestionControl *cc, uint64_t now_us) {
+    double cwnd = (double) cc->cwnd + cc->cwnd_fraction;
+
+    cc->epoch_start_us = 0;
+    cc->w_max = cwnd < cc->w_max ? cwnd * (1.0 + CUBIC_BETA) / 2.0 : cwnd;
+
+    cwnd *= CUBIC_BETA;
+    cc->ssthresh = cwnd > MIN_CWND ? (uint32_t) cwnd : MIN_CWND;
+    cc->cwnd = cc->ssthresh;
+    cc->cwnd_fraction = 0;
+}
+
+static void cubic_on_timeout(CongestionControl *cc, uint64_t now_us) {
+    cubic_on_loss(cc, now_us);
+    cc->cwnd = LOSS_CWND;
+}
+
+const CongestionOps congestion_cubic = {
+        .name = "cubic",
+        .init = cubic_init,
+        .on_ack = cubic_on_ack,
+        .on_loss = cubic_on_loss,
+        .on_timeout = cubic_on_timeout,
+};
+
+/*
+ * Look an algorithm up by name, NULL if we don't have it.
+ */
+const CongestionOps *congestion_find(const char *name) {
+    for (size_t i = 0; i < sizeof(congestion_algorithms) / sizeof(congestion_algorithms[0]); i++) {
+        if (strcmp(congestion_algorithms[i]->name, name) == 0) {
+            return congestion_algorithms[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * What new connections get. Only meant to be set once at startup before any worker threads are running.
+ */
+void congestion_set_default(const CongestionOps *ops) {
+    congestion_selected = ops;
+}
+
+const CongestionOps *congestion_default() {
+    return congestion_selected;
+}
+
+void congestion_init(CongestionControl *cc, const CongestionOps *ops, uint32_t max_cwnd) {
+    memset(cc, 0, sizeof(CongestionControl));
+    cc->ops = ops != NULL ? ops : congestion_selected;
+    cc->max_cwnd = max_cwnd;
+    cc->cwnd = INITIAL_CWND;
+    cc->ssthresh = INITIAL_SSTHRESH;
+    cc->ops->init(cc);
+    congestion_clamp(cc);
+}
+
+void congestion_on_ack(CongestionControl *cc, uint32_t acked, uint64_t srtt_us, uint64_t now_us) {
+    //Nothing to learn from ACKs for a window we aren't filling, growing it anyway just sets up a burst later
+    if (cc->cwnd >= cc->max_cwnd) {
+        return;
+    }
+    cc->ops->on_ack(cc, acked, srtt_us, now_us);
+    congestion_clamp(cc);
+}
+
+void congestion_on_loss(CongestionControl *cc, uint64_t now_us) {
+    cc->loss_events++;
+    cc->ops->on_loss(cc, now_us);
+    congestion_clamp(cc);
+}
+
+void congestion_on_timeout(CongestionControl *cc, uint64_t now_us) {
+    cc->timeouts++;
+    cc->ops->on_timeout(cc, now_us);
+    congestion_clamp(cc);
+}
@@ -0,0 +1,81 @@
+//
+// Created by dustyn on 7/23/24.
+//
+#include <stdint.h>
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_CONGESTION_H
+#define UNIXCUSTOMTRANSPORTLAYER_CONGESTION_H
+
+/*
+ * Windows are counted in packets, not bytes, every data packet is the same size on the wire.
+ * RFC 6928 lets a sender start at 10 packets, and a window never goes below 2 after a loss or 1 after a timeout.
+ */
+#define INITIAL_CWND 10
+#define MIN_CWND 2
+#define LOSS_CWND 1
+#define INITIAL_SSTHRESH UINT32_MAX
+
+/*
+ * CUBIC constants from RFC 8312, C in packets per second cubed.
+ */
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+typedef struct CongestionControl CongestionControl;
+
+/*
+ * One congestion control algorithm. The send window only ever talks to it through these, so adding another is writing
+ * these four functions and putting it in the list in congestion.c.
+ *
+ * on_ack is told how many packets the cumulative ACK just covered and the smoothed RTT, on_loss is a hole showing up in the SACK
+ * bitmap (or a NACK), at most once a window, and on_timeout is the retransmit timer going off.
+ */
+typedef struct CongestionOps {
+    const char *name;
+    void (*init)(CongestionControl *cc);
+    void (*on_ack)(CongestionControl *cc, uint32_t acked, uint64_t srtt_us, uint64_t now_us);
+    void (*on_loss)(CongestionControl *cc, uint64_t now_us);
+    void (*on_timeout)(CongestionControl *cc, uint64_t now_us);
+} CongestionOps;
+
+/*
+ * Per connection state, cwnd is how many packets the network is trusted with right now and ssthresh is where slow start
+ * stops. Below that the fields belong to whichever algorithm is in ops, plus a couple of counters for the stats.
+ *
+ * max_cwnd is the flow control window, there is no point growing past what the receiver lets us have in flight anyway and a window
+ * that never gets used shouldn't keep growing.
+ */
+struct CongestionControl {
+    const CongestionOps *ops;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t max_cwnd;
+    uint32_t acked_count;
+    double cwnd_fraction;
+    double w_max;
+    double w_est;
+    double k;
+    double origin;
+    uint64_t epoch_start_us;
+    uint32_t loss_events;
+    uint32_t timeouts;
+};
+
+extern const CongestionOps congestion_reno;
+extern const CongestionOps congestion_cubic;
+
+const CongestionOps *congestion_find(const char *name);
+
+void congestion_set_default(const CongestionOps *ops);
+
+const CongestionOps *congestion_default();
+
+void congestion_init(CongestionControl *cc, const CongestionOps *ops, uint32_t max_cwnd);
+
+void congestion_on_ack(CongestionControl *cc, uint32_t acked, uint64_t srtt_us, uint64_t now_us);
+
+void congestion_on_loss(CongestionControl *cc, uint64_t now_us);
+
+void congestion_on_timeout(CongestionControl *cc, uint64_t now_us);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_CONGESTION_H
@@ -0,0 +1,662 @@
+//
+// Created by dustyn on 6/30/24.
+//
+
+#include <stdbool.h>
+#include "connection.h"
+#include "network_layer.h"
+#include "checksum.h"
+#include "trace.h"
+#include "log.h"
+
+/*
+ * Up until now a server process talked to exactly one peer. All of its state (the pool, the windows, the retransmit timer, the OOB byte)
+ * was either local to the connection handler or global, and anything addressed to a process id other than SERVER_PID got dropped.
+ * Serving another client meant forking another process with another raw socket, and every one of those raw sockets gets a copy of every
+ * datagram on the box.
+ *
+ * Now all of that state hangs off a Connection, and one raw socket can serve as many of them as we like. Every incoming datagram is routed
+ * to its connection by looking up where it came from, the source address plus the process id the peer sent it from, in a hash table.
+ * dest_process_id on its own is not enough for this, every client addresses the same server process id so two clients on one host
+ * would look identical. dest_process_id still decides whether the datagram is for us at all.
+ *
+ * The table is open addressing with linear probing. Lookups are the hot path, once per datagram, and with the keys stored inline a
+ * lookup is usually a single cache line. Removal shifts the following entries back instead of leaving tombstones, so the table never
+ * fills up with dead slots no matter how many peers come and go.
+ */
+
+static uint64_t connection_key(uint32_t peer_ip, uint16_t peer_pid) {
+    return ((uint64_t) peer_ip << 16) | peer_pid;
+}
+
+/*
+ * The murmur3 finalizer, spreads the key bits out so peers on neighbouring addresses or process ids do not all land in neighbouring slots.
+ */
+static uint32_t connection_key_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return (uint32_t) key;
+}
+
+uint32_t connection_hash(uint32_t peer_ip, uint16_t peer_pid) {
+    return connection_key_hash(connection_key(peer_ip, peer_pid));
+}
+
+/*
+ * Which of num_shards workers owns the peer that sent this header. This has to give exactly the same answer as the socket filter
+ * in worker.c, which only has 32 bit loads that read big endian, multiply, shift and mod to work with. So the address is taken in
+ * network order, the process id as its two bytes on the wire read big endian, whatever order the host put them in.
+ */
+uint16_t connection_shard(uint32_t peer_ip, const Header *header, uint16_t num_shards) {
+    if (num_shards <= 1) {
+        return 0;
+    }
+    const uint8_t *pid_bytes = (const uint8_t *) &header->source_process_id;
+    uint32_t pid = ((uint32_t) pid_bytes[0] << 8) | pid_bytes[1];
+    uint32_t hash = (ntohl(peer_ip) ^ pid) * CONNECTION_SHARD_MULTIPLIER;
+    return (uint16_t) ((hash >> 16) % num_shards);
+}
+
+/*
+ * Build the ip header, the peer's address and the control packet's message once so sends only have to fill in our own header.
+ */
+static uint16_t connection_build_templates(Connection *conn) {
+    if (fill_ip_header(&conn->ip_template, conn->local_ip, conn->peer_ip) != SUCCESS) {
+        return ERROR;
+    }
+
+    conn->destination.sin_family = AF_INET;
+    conn->destination.sin_addr.s_addr = conn->peer_ip;
+
+    ControlPacket *control = &conn->control;
+    control->ip_header = conn->ip_template;
+    control->iov[0].iov_base = &control->ip_header;
+    control->iov[0].iov_len = sizeof(struct iphdr);
+    control->iov[1].iov_base = &control->header;
+    control->iov[1].iov_len = HEADER_SIZE;
+    control->iov[2].iov_base = control->payload;
+    control->iov[2].iov_len = 0;
+    control->message.msg_name = &conn->destination;
+    control->message.msg_namelen = sizeof(struct sockaddr_in);
+    control->message.msg_iov = control->iov;
+    control->message.msg_iovlen = 2;
+    return SUCCESS;
+}
+
+/*
+ * blocked_fn for the send window, the table only needs to know that somebody is waiting on the socket
+ */
+static void connection_send_blocked(void *context) {
+    Connection *conn = context;
+    if (conn->table != NULL) {
+        conn->table->send_blocked = 1;
+    }
+}
+
+/*
+ * Set up everything a connection owns. on_timeout is what runs when its retransmit timer goes off, the context is the connection.
+ */
+uint16_t connection_init(Connection *conn, int socket, uint32_t local_ip, uint16_t local_pid, uint32_t peer_ip, uint16_t peer_pid,
+                         TimerWheel *wheel, uint16_t window_size, uint32_t pool_blocks, timer_callback on_timeout) {
+    memset(conn, 0, sizeof(Connection));
+    conn->socket = socket;
+    conn->local_ip = local_ip;
+    conn->local_pid = local_pid;
+    conn->peer_ip = peer_ip;
+    conn->peer_pid = peer_pid;
+    conn->stats_slot = -1;
+
+    if (connection_build_templates(conn) != SUCCESS) {
+        return ERROR;
+    }
+
+    conn->max_payload = path_mtu_max_payload();
+    conn->path_payload = path_mtu_payload_to(peer_ip);
+    conn->peer_max_payload = PAYLOAD_SIZE;
+    conn->payload_size = PAYLOAD_SIZE;
+
+    if (packet_pool_init(&conn->pool, pool_blocks, conn->max_payload) != SUCCESS) {
+        return ERROR;
+    }
+
+    retransmit_timer_init(&conn->retransmit_timer, wheel, on_timeout, conn);
+    timer_init(&conn->delayed_ack, connection_delayed_ack_handler, conn);
+    timer_init(&conn->idle, connection_idle_handler, conn);
+    if (receive_window_init(&conn->receive_window, window_size) != SUCCESS) {
+        packet_pool_destroy(&conn->pool);
+        return ERROR;
+    }
+    if (send_window_init(&conn->send_window, window_size, socket, &conn->destination, &conn->retransmit_timer) != SUCCESS) {
+        receive_window_destroy(&conn->receive_window, &conn->pool);
+        packet_pool_destroy(&conn->pool);
+        return ERROR;
+    }
+    conn->send_window.piggyback = &conn->receive_window;
+    conn->send_window.on_blocked = connection_send_blocked;
+    conn->send_window.blocked_context = conn;
+    conn->collection_space = MAX_PACKET_COLLECTION;
+    conn->peer_collection_window = MAX_PACKET_COLLECTION;
+    conn->version = HEADER_VERSION;
+    conn->stats_slot = stats_claim_connection(peer_ip, peer_pid);
+    return SUCCESS;
+}
+
+/*
+ * Tear down everything connection_init set up. The socket is shared so it is left alone.
+ */
+void connection_release(Connection *conn) {
+    connection_publish_stats(conn);
+    stats_release_connection(conn->stats_slot);
+    conn->stats_slot = -1;
+    send_window_destroy(&conn->send_window, &conn->pool);
+    receive_window_destroy(&conn->receive_window, &conn->pool);
+    timer_wheel_cancel(conn->retransmit_timer.wheel, &conn->retransmit_timer.timer);
+    timer_wheel_cancel(conn->retransmit_timer.wheel, &conn->delayed_ack);
+    timer_wheel_cancel(conn->retransmit_timer.wheel, &conn->idle);
+    packet_pool_destroy(&conn->pool);
+}
+
+/*
+ * Retransmit timer callback for a windowed connection. We can't free the connection from inside a timer callback, so if the send window
+ * has given up we just queue the connection up to be closed.
+ */
+void connection_timeout_handler(Timer *timer, void *context) {
+    Connection *conn = context;
+    if (send_window_handle_timeout(&conn->send_window) == ERROR) {
+        LOG_WARN("Max timeout reached");
+        trace_dump_on_error("Connection timed out");
+        connection_schedule_close(conn);
+    }
+}
+
+/*
+ * Remember that this connection got data and may owe its peer an ACK, it gets looked at once per batch no matter how many packets
+ * it got (see connection_flush_ack).
+ */
+void connection_schedule_ack(Connection *conn) {
+    if (conn->ack_pending || conn->table == NULL) {
+        return;
+    }
+    conn->ack_pending = 1;
+    conn->next_pending = conn->table->pending_acks;
+    conn->table->pending_acks = conn;
+}
+
+/*
+ * The delayed ACK timer ran out. If data going the other way already carried the ACK there is nothing to do, otherwise it is
+ * urgent now and goes out with the next flush.
+ */
+void connection_delayed_ack_handler(Timer *timer, void *context) {
+    Connection *conn = context;
+    if (receive_window_ack_owed(&conn->receive_window)) {
+        conn->receive_window.ack_now = 1;
+        connection_schedule_ack(conn);
+    }
+}
+
+/*
+ * The idle timer ran out, but it is only ever set for as long as the peer could have been quiet at the time. If we have heard from
+ * the peer since, it goes again for whatever is left, otherwise the peer is gone and the connection gets closed like any other.
+ */
+void connection_idle_handler(Timer *timer, void *context) {
+    Connection *conn = context;
+    TimerWheel *wheel = conn->retransmit_timer.wheel;
+    uint64_t idle_ms = wheel->now_ms > conn->last_heard_ms ? wheel->now_ms - conn->last_heard_ms : 0;
+
+    if (idle_ms >= CONNECTION_IDLE_TIMEOUT_MS) {
+        struct in_addr peer = {.s_addr = conn->peer_ip};
+        LOG_INFO("%s:%u idle for %lums, closing", inet_ntoa(peer), conn->peer_pid, idle_ms);
+        connection_schedule_close(conn);
+        return;
+    }
+    timer_wheel_schedule(wheel, timer, (uint32_t) (CONNECTION_IDLE_TIMEOUT_MS - idle_ms));
+}
+
+/*
+ * Decide what to do about the ACK this connection owes, once a batch has been dealt with and any data of ours has gone out.
+ * Loss, reordering or DELAYED_ACK_PACKETS worth of data gets ACKed now, a little in order data starts the delayed ACK timer instead.
+ */
+uint16_t connection_flush_ack(Connection *conn) {
+    ReceiveWindow *window = &conn->receive_window;
+    TimerWheel *wheel = conn->retransmit_timer.wheel;
+
+    if (!receive_window_ack_owed(window)) {
+        timer_wheel_cancel(wheel, &conn->delayed_ack);
+        return SUCCESS;
+    }
+
+    if (!receive_window_ack_urgent(window)) {
+        if (!conn->delayed_ack.armed) {
+            timer_wheel_schedule(wheel, &conn->delayed_ack, DELAYED_ACK_MS);
+        }
+        return SUCCESS;
+    }
+
+    timer_wheel_cancel(wheel, &conn->delayed_ack);
+    if (send_selective_ack(conn, window->expected, receive_window_sack(window)) != SUCCESS) {
+        return ERROR;
+    }
+    receive_window_acked(window);
+    return SUCCESS;
+}
+
+/*
+ * space_fn for a receive window whose data gets queued straight back out on the same connection, the way echo does it.
+ * Every packet delivered takes slots in the send queue, and it only gets them back once the peer has ACKed our copy. If the peer
+ * takes smaller packets than it sends us, one packet in is several out.
+ */
+uint16_t connection_send_space(void *context) {
+    Connection *conn = context;
+    uint16_t packet_payload = conn->payload_size < conn->pool.payload_size ? conn->payload_size : conn->pool.payload_size;
+    uint16_t packets_per_delivery = (conn->max_payload + packet_payload - 1) / packet_payload;
+    return send_window_free(&conn->send_window) / packets_per_delivery;
+}
+
+/*
+ * How many packets the next collection we send may have, what the peer's last ACK said it has room for but never more than a collection
+ * holds. A peer with no room at all still gets one packet at a time to probe with, it turns it away until it has drained and its ACK
+ * for that carries the real window again.
+ */
+uint16_t connection_collection_limit(const Connection *conn) {
+    uint16_t limit = conn->peer_collection_window < MAX_PACKET_COLLECTION ? conn->peer_collection_window : MAX_PACKET_COLLECTION;
+    return limit > 0 ? limit : 1;
+}
+
+/*
+ * Queue a copy of some data to go back to the peer, for when the data lives somewhere that is about to be reused (a receive ring slot)
+ * so it can't be pinned. It goes out on the next send_window_transmit(), carrying any ACK we owe. Data bigger than a packet the peer
+ * takes, or than a pool block holds, is split over as many packets as it needs, and they all have to fit in the send queue.
+ */
+uint16_t connection_queue_copy(Connection *conn, const char *data, size_t length) {
+
+    size_t packet_payload = conn->payload_size < conn->pool.payload_size ? conn->payload_size : conn->pool.payload_size;
+    size_t num_packets = length == 0 ? 1 : (length + packet_payload - 1) / packet_payload;
+
+    if (num_packets > send_window_free(&conn->send_window)) {
+        return ERROR;
+    }
+
+    for (size_t offset = 0, i = 0; i < num_packets; i++) {
+        size_t bytes_in_packet = length - offset > packet_payload ? packet_payload : length - offset;
+
+        Packet *packet;
+        if (allocate_packet(&conn->pool, &packet) != SUCCESS) {
+            return ERROR;
+        }
+
+        fill_ip_header_from_template(packet->iov[0].iov_base, &conn->ip_template, PACKET_LENGTH(bytes_in_packet));
+        memcpy(packet->iov[2].iov_base, data + offset, bytes_in_packet);
+        packet->iov[2].iov_len = bytes_in_packet;
+
+        Header *header = packet->iov[1].iov_base;
+        header->version = conn->version;
+        header->status = DATA;
+        header->checksum_type = DEFAULT_CHECKSUM_TYPE;
+        header->checksum = calculate_checksum(DEFAULT_CHECKSUM_TYPE, data + offset, bytes_in_packet);
+        header->msg_size = bytes_in_packet;
+        header->max_payload = conn->max_payload;
+        header->dest_process_id = conn->peer_pid;
+        header->source_process_id = conn->local_pid;
+        //One message, same as packetize_data() would have made it
+        header->sequence = i;
+        header->packet_end = num_packets - 1;
+
+        if (send_window_queue(&conn->send_window, &packet, 1) != 1) {
+            free_packet(&conn->pool, &packet);
+            return ERROR;
+        }
+        offset += bytes_in_packet;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Everything the peer tells us about itself on every packet, there is no handshake to do it once.
+ *
+ * We start out speaking the newest version we have. A peer that sends us an older one (that we can still read) only knows that
+ * much, so from then on we speak its version too. Both sides end up on the lowest version either of them has.
+ *
+ * Until we hear how big a payload the peer takes we stick to PAYLOAD_SIZE, after that payloads are as big as both it and the path allow.
+ */
+void connection_negotiate(Connection *conn, const Header *header) {
+    if (header->version < conn->version && header_version_supported(header->version)) {
+        conn->version = header->version;
+    }
+
+    if (header->max_payload != conn->peer_max_payload && header->max_payload >= PAYLOAD_SIZE) {
+        conn->peer_max_payload = header->max_payload;
+        conn->payload_size = conn->peer_max_payload < conn->path_payload ? conn->peer_max_payload : conn->path_payload;
+    }
+}
+
+void connection_schedule_close(Connection *conn) {
+    if (conn->closing || conn->table == NULL) {
+        return;
+    }
+    conn->closing = 1;
+    conn->next_closing = conn->table->closing;
+    conn->table->closing = conn;
+}
+
+void connection_get_stats(const Connection *conn, ConnectionStats *stats) {
+    const SendWindow *window = &conn->send_window;
+
+    stats->packets_sent = window->packets_sent;
+    stats->packets_retransmitted = window->packets_retransmitted;
+    stats->srtt_us = conn->retransmit_timer.rtt.srtt_us;
+    stats->rto_ms = conn->retransmit_timer.rtt.rto_ms;
+    stats->congestion = window->congestion.ops->name;
+    stats->cwnd = window->congestion.cwnd;
+    stats->ssthresh = window->congestion.ssthresh;
+    stats->loss_events = window->congestion.loss_events;
+    stats->timeouts = window->congestion.timeouts;
+}
+
+/*
+ * Copy the connection's numbers into its slot in the stats segment, if it got one.
+ */
+void connection_publish_stats(const Connection *conn) {
+    if (conn->stats_slot < 0) {
+        return;
+    }
+
+    ConnectionStats stats;
+    StatsConnection values;
+    connection_get_stats(conn, &stats);
+    memset(&values, 0, sizeof(values));
+    values.peer_ip = conn->peer_ip;
+    values.peer_pid = conn->peer_pid;
+    values.packets_sent = stats.packets_sent;
+    values.packets_retransmitted = stats.packets_retransmitted;
+    values.srtt_us = stats.srtt_us;
+    values.cwnd = stats.cwnd;
+    values.ssthresh = stats.ssthresh;
+    values.loss_events = stats.loss_events;
+    values.timeouts = stats.timeouts;
+    values.rto_ms = stats.rto_ms;
+    strncpy(values.congestion, stats.congestion, sizeof(values.congestion) - 1);
+    stats_publish_connection(conn->stats_slot, &values);
+}
+
+/*
+ * One line per connection, ssthresh shows as - while we are still in the first slow start.
+ */
+void connection_print_stats(const Connection *conn, FILE *stream) {
+    ConnectionStats stats;
+    struct in_addr peer = {.s_addr = conn->peer_ip};
+
+    connection_get_stats(conn, &stats);
+    fprintf(stream, "%s:%u sent %lu retransmitted %lu %s cwnd %u ssthresh ", inet_ntoa(peer), conn->peer_pid, stats.packets_sent,
+            stats.packets_retransmitted, stats.congestion, stats.cwnd);
+    if (stats.ssthresh == INITIAL_SSTHRESH) {
+        fprintf(stream, "-");
+    } else {
+        fprintf(stream, "%u", stats.ssthresh);
+    }
+    fprintf(stream, " losses %u timeouts %u srtt %luus rto %ums\n", stats.loss_events, stats.timeouts, stats.srtt_us, stats.rto_ms);
+}
+
+static uint16_t connection_table_alloc(ConnectionTable *table, uint32_t capacity) {
+    table->entries = calloc(capacity, sizeof(ConnectionEntry));
+    table->peer_counts = calloc(capacity, sizeof(ConnectionPeerCount));
+    if (table->entries == NULL || table->peer_counts == NULL) {
+        perror("calloc");
+        free(table->entries);
+        free(table->peer_counts);
+        return ERROR;
+    }
+    table->capacity = capacity;
+    table->count = 0;
+    return SUCCESS;
+}
+
+uint16_t connection_table_init(ConnectionTable *table, uint32_t capacity) {
+    memset(table, 0, sizeof(ConnectionTable));
+
+    if (capacity < CONNECTION_TABLE_INITIAL_CAPACITY || (capacity & (capacity - 1)) != 0) {
+        capacity = CONNECTION_TABLE_INITIAL_CAPACITY;
+    }
+    return connection_table_alloc(table, capacity);
+}
+
+/*
+ * Frees every connection still in the table along with the table itself. Sending CLOSE to anyone is up to the caller.
+ */
+void connection_table_destroy(ConnectionTable *table) {
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        Connection *conn = table->entries[i].connection;
+        if (conn != NULL) {
+            connection_release(conn);
+            free(conn);
+        }
+    }
+    free(table->entries);
+    free(table->peer_counts);
+    memset(table, 0, sizeof(ConnectionTable));
+}
+
+/*
+ * Find the slot holding key, or the empty slot where it would go.
+ */
+static uint32_t connection_table_probe(ConnectionTable *table, uint64_t key) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = connection_key_hash(key) & mask;
+
+    while (table->entries[index].connection != NULL && table->entries[index].key != key) {
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+Connection *connection_table_lookup(ConnectionTable *table, uint32_t peer_ip, uint16_t peer_pid) {
+    return table->entries[connection_table_probe(table, connection_key(peer_ip, peer_pid))].connection;
+}
+
+/*
+ * Same again for the per address counts, find the slot counting peer_ip or the empty slot where it would go.
+ */
+static uint32_t connection_table_probe_peer(ConnectionTable *table, uint32_t peer_ip) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = connection_key_hash(peer_ip) & mask;
+
+    while (table->peer_counts[index].count != 0 && table->peer_counts[index].peer_ip != peer_ip) {
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+uint32_t connection_table_peer_count(ConnectionTable *table, uint32_t peer_ip) {
+    return table->peer_counts[connection_table_probe_peer(table, peer_ip)].count;
+}
+
+static void connection_table_count_peer(ConnectionTable *table, uint32_t peer_ip) {
+    ConnectionPeerCount *peer = &table->peer_counts[connection_table_probe_peer(table, peer_ip)];
+    peer->peer_ip = peer_ip;
+    peer->count++;
+}
+
+/*
+ * The address lost a connection, once it has none left its slot is emptied with the same backward shift as connection_table_remove()
+ */
+static void connection_table_uncount_peer(ConnectionTable *table, uint32_t peer_ip) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t empty = connection_table_probe_peer(table, peer_ip);
+
+    if (table->peer_counts[empty].count == 0 || --table->peer_counts[empty].count > 0) {
+        return;
+    }
+
+    uint32_t index = empty;
+    while (true) {
+        index = (index + 1) & mask;
+        if (table->peer_counts[index].count == 0) {
+            break;
+        }
+        uint32_t home = connection_key_hash(table->peer_counts[index].peer_ip) & mask;
+        if (((index - home) & mask) >= ((index - empty) & mask)) {
+            table->peer_counts[empty] = table->peer_counts[index];
+            table->peer_counts[index].count = 0;
+            empty = index;
+        }
+    }
+}
+
+static uint16_t connection_table_grow(ConnectionTable *table) {
+    ConnectionEntry *old_entries = table->entries;
+    ConnectionPeerCount *old_peer_counts = table->peer_counts;
+    uint32_t old_capacity = table->capacity;
+
+    if (connection_table_alloc(table, old_capacity * 2) != SUCCESS) {
+        table->entries = old_entries;
+        table->peer_counts = old_peer_counts;
+        table->capacity = old_capacity;
+        return ERROR;
+    }
+
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old_entries[i].connection != NULL) {
+            table->entries[connection_table_probe(table, old_entries[i].key)] = old_entries[i];
+            table->count++;
+        }
+        if (old_peer_counts[i].count != 0) {
+            table->peer_counts[connection_table_probe_peer(table, old_peer_counts[i].peer_ip)] = old_peer_counts[i];
+        }
+    }
+    free(old_entries);
+    free(old_peer_counts);
+    return SUCCESS;
+}
+
+static uint16_t connection_table_insert(ConnectionTable *table, Connection *conn) {
+
+    //Linear probing falls apart as the table fills up, keep it at most 3/4 full
+    if ((table->count + 1) * 4 > table->capacity * 3 && connection_table_grow(table) != SUCCESS) {
+        return ERROR;
+    }
+
+    uint64_t key = connection_key(conn->peer_ip, conn->peer_pid);
+    uint32_t index = connection_table_probe(table, key);
+    if (table->entries[index].connection != NULL) {
+        return ERROR;
+    }
+
+    table->entries[index].key = key;
+    table->entries[index].connection = conn;
+    table->count++;
+    connection_table_count_peer(table, conn->peer_ip);
+    conn->table = table;
+    return SUCCESS;
+}
+
+/*
+ * Backward shift deletion. Once the slot is emptied, any entry after it in the same run that would have been placed at or before the
+ * empty slot is moved back into it, otherwise a later lookup would stop at the gap and never find it.
+ */
+static void connection_table_remove(ConnectionTable *table, Connection *conn) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t empty = connection_table_probe(table, connection_key(conn->peer_ip, conn->peer_pid));
+
+    if (table->entries[empty].connection != conn) {
+        return;
+    }
+    table->entries[empty].connection = NULL;
+    table->count--;
+    connection_table_uncount_peer(table, conn->peer_ip);
+
+    uint32_t index = empty;
+    while (true) {
+        index = (index + 1) & mask;
+        if (table->entries[index].connection == NULL) {
+            break;
+        }
+        uint32_t home = connection_key_hash(table->entries[index].key) & mask;
+        if (((index - home) & mask) >= ((index - empty) & mask)) {
+            table->entries[empty] = table->entries[index];
+            table->entries[index].connection = NULL;
+            empty = index;
+        }
+    }
+}
+
+/*
+ * A new peer showed up, give it a connection of its own and add it to the table. It is closed again once the peer has been
+ * quiet for CONNECTION_IDLE_TIMEOUT_MS, the owner keeps last_heard_ms up to date.
+ */
+Connection *connection_open(ConnectionTable *table, int socket, uint32_t local_ip, uint16_t local_pid, uint32_t peer_ip,
+                            uint16_t peer_pid, TimerWheel *wheel, uint16_t window_size) {
+
+    Connection *conn = malloc(sizeof(Connection));
+    if (conn == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    //A window's worth of blocks to start with, the pool grows past that if the peer keeps more than that on the go
+    uint32_t pool_blocks = window_size > CONNECTION_POOL_MIN_BLOCKS ? window_size : CONNECTION_POOL_MIN_BLOCKS;
+    if (connection_init(conn, socket, local_ip, local_pid, peer_ip, peer_pid, wheel, window_size, pool_blocks,
+                        connection_timeout_handler) != SUCCESS) {
+        free(conn);
+        return NULL;
+    }
+
+    if (connection_table_insert(table, conn) != SUCCESS) {
+        connection_release(conn);
+        free(conn);
+        return NULL;
+    }
+
+    conn->last_heard_ms = monotonic_ms();
+    timer_wheel_schedule(wheel, &conn->idle, CONNECTION_IDLE_TIMEOUT_MS);
+    return conn;
+}
+
+/*
+ * Take the connection out of its table and free it. It must not be sitting on the pending ACK list,
+ * closing connections are only reaped after the ACKs for the batch have gone out.
+ */
+void connection_close(Connection *conn) {
+    if (conn->table != NULL) {
+        connection_table_remove(conn->table, conn);
+    }
+    connection_release(conn);
+    free(conn);
+}
+
+Connection *connection_table_pop_pending(ConnectionTable *table) {
+    Connection *conn = table->pending_acks;
+    if (conn != NULL) {
+        table->pending_acks = conn->next_pending;
+        conn->next_pending = NULL;
+        conn->ack_pending = 0;
+    }
+    return conn;
+}
+
+/*
+ * The socket has room again. Every connection whose send window stopped on a full socket goes on the pending list, flushing it
+ * sends what it left behind. Sockets filling up should be rare enough that walking the table for them is fine.
+ */
+void connection_table_resume_blocked(ConnectionTable *table) {
+    if (!table->send_blocked) {
+        return;
+    }
+    table->send_blocked = 0;
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        Connection *conn = table->entries[i].connection;
+        if (conn != NULL && conn->send_window.blocked && !conn->closing) {
+            connection_schedule_ack(conn);
+        }
+    }
+}
+
+Connection *connection_table_pop_closing(ConnectionTable *table) {
+    Connection *conn = table->closing;
+    if (conn != NULL) {
+        table->closing = conn->next_closing;
+        conn->next_closing = NULL;
+    }
+    return conn;
+}
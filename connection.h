@@ -0,0 +1,220 @@
+//
+// Created by dustyn on 6/30/24.
+//
+#include "dustyns_transport_layer.h"
+#include "packet_pool.h"
+#include "sliding_window.h"
+#include "timer_wheel.h"
+#include "path_mtu.h"
+#include "stats.h"
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_CONNECTION_H
+#define UNIXCUSTOMTRANSPORTLAYER_CONNECTION_H
+
+/*
+ * Has to be a power of 2 so the hash can be masked into a slot
+ */
+#define CONNECTION_TABLE_INITIAL_CAPACITY 64
+/*
+ * Most peers only ever have a window's worth of packets out, so connections start with a pool that size and grow it a slab at a time.
+ * This is the least they start with however small the window.
+ */
+#define CONNECTION_POOL_MIN_BLOCKS 16
+/*
+ * Multiplier for the shard hash, the 32 bit golden ratio
+ */
+#define CONNECTION_SHARD_MULTIPLIER 0x9E3779B1U
+/*
+ * A connection the server opened gets closed once its peer has said nothing at all for this long. There is no handshake, so a peer
+ * that only ever sent us data and then died would otherwise keep its connection forever, we have nothing in flight to time out on.
+ */
+#define CONNECTION_IDLE_TIMEOUT_MS 30000
+/*
+ * How many connections one peer address can have open at once. Every process id it sends from is a new connection, so without
+ * this one host spraying made up source pids could fill the table.
+ */
+#define CONNECTION_MAX_PER_PEER_IP 64
+
+typedef struct ConnectionTable ConnectionTable;
+
+/*
+ * Control packets (ACKs, NACKs, CLOSE and the like) are mostly header, bar the OOB byte and a NACK's ranges, and they all go to the
+ * same peer. So each connection keeps one with the ip header already summed and the message already pointed at the peer, sending
+ * one is just stamping the transport header. sendmsg() has copied the packet into the kernel by the time it returns, so the same
+ * buffer is good for the next one straight away.
+ */
+typedef struct ControlPacket {
+    struct iphdr ip_header;
+    Header header;
+    char payload[PAYLOAD_SIZE];
+    struct iovec iov[3];
+    struct msghdr message;
+} ControlPacket;
+
+/*
+ * Everything that belongs to one peer. A peer is the address its packets come from plus the process id it sends from,
+ * replies go back to that process id. The retransmit timer lives on whatever timer wheel the owner gave us.
+ *
+ * next_pending and next_closing chain the connection onto the table's lists of connections that owe an ACK and connections
+ * that are done, both get worked through once the current receive batch has been handled.
+ *
+ * ip_template and destination are built once when the connection is set up, data packets copy the header from the template
+ * and everything we send to the peer uses the same sockaddr. Nothing on the send path builds a header or parses an address.
+ * The control packet and send window point into the connection itself, so a connection must not be moved once initialized.
+ *
+ * delayed_ack fires DELAYED_ACK_MS after data came in that didn't need ACKing right away, if nothing going the other way has
+ * carried the ACK by then it goes out on its own.
+ *
+ * Collection mode does flow control a collection at a time. collection_space is how many packets the next collection we get may
+ * have, it goes out on our ACKs, and peer_collection_window is the same from the peer's last ACK. Both start at MAX_PACKET_COLLECTION.
+ * peer_collection_window is kept as the peer sent it, 0 included, connection_collection_limit() is what we actually go by.
+ * If reassembly is set, received collections are streamed through it and its free slots are what we advertise instead.
+ *
+ * send_collection is the number the next collection we packetize gets, so the one we are waiting to hear about is send_collection - 1.
+ * receive_collection is the one we are taking in now, and last_collection_end where the one before it ended, we ACK that one again
+ * if the peer is still resending it (see receive_data_packets()).
+ *
+ * version is the header version everything we send the peer is built with, and payload_size how big a payload we build, the
+ * smaller of what the path takes (path_payload) and what the peer said it takes (peer_max_payload). max_payload is what we take,
+ * it goes out on everything we send. See connection_negotiate().
+ *
+ * stats_slot is the connection's slot in the stats segment, -1 if there is no segment or it was full.
+ *
+ * idle is only armed for connections a table opened (connection_open), last_heard_ms is when the owner last got anything from the
+ * peer. See connection_idle_handler().
+ */
+struct Connection {
+    uint32_t peer_ip;
+    uint16_t peer_pid;
+    uint32_t local_ip;
+    uint16_t local_pid;
+    int socket;
+    struct iphdr ip_template;
+    struct sockaddr_in destination;
+    ControlPacket control;
+    PacketPool pool;
+    ReceiveWindow receive_window;
+    SendWindow send_window;
+    RetransmitTimer retransmit_timer;
+    Timer delayed_ack;
+    Timer idle;
+    uint64_t last_heard_ms;
+    ConnectionTable *table;
+    struct Connection *next_pending;
+    struct Connection *next_closing;
+    ReassemblyRing *reassembly;
+    int32_t stats_slot;
+    uint32_t send_collection;
+    uint32_t receive_collection;
+    uint16_t last_collection_end;
+    uint16_t collection_space;
+    uint16_t peer_collection_window;
+    uint16_t max_payload;
+    uint16_t path_payload;
+    uint16_t peer_max_payload;
+    uint16_t payload_size;
+    char oob_data;
+    uint8_t version;
+    uint8_t ack_pending;
+    uint8_t closing;
+    uint8_t peer_closed;
+};
+
+/*
+ * A snapshot of how a connection's sending side is doing, for printing or handing to anything that keeps track.
+ */
+typedef struct ConnectionStats {
+    uint64_t packets_sent;
+    uint64_t packets_retransmitted;
+    uint64_t srtt_us;
+    const char *congestion;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t loss_events;
+    uint32_t timeouts;
+    uint32_t rto_ms;
+} ConnectionStats;
+
+typedef struct ConnectionEntry {
+    uint64_t key;
+    Connection *connection;
+} ConnectionEntry;
+
+/*
+ * How many connections in the table belong to one peer address, an empty slot is one with a count of 0
+ */
+typedef struct ConnectionPeerCount {
+    uint32_t peer_ip;
+    uint32_t count;
+} ConnectionPeerCount;
+
+/*
+ * Open addressing with linear probing, an empty slot is one with no connection in it.
+ * peer_counts is laid out the same way and has the same capacity, there are never more addresses than connections.
+ * send_blocked is set once any connection's send window has found the socket full, see connection_table_resume_blocked().
+ */
+struct ConnectionTable {
+    ConnectionEntry *entries;
+    ConnectionPeerCount *peer_counts;
+    uint32_t capacity;
+    uint32_t count;
+    Connection *pending_acks;
+    Connection *closing;
+    uint8_t send_blocked;
+};
+
+uint32_t connection_hash(uint32_t peer_ip, uint16_t peer_pid);
+
+uint16_t connection_shard(uint32_t peer_ip, const Header *header, uint16_t num_shards);
+
+uint16_t connection_init(Connection *conn, int socket, uint32_t local_ip, uint16_t local_pid, uint32_t peer_ip, uint16_t peer_pid,
+                         TimerWheel *wheel, uint16_t window_size, uint32_t pool_blocks, timer_callback on_timeout);
+
+void connection_release(Connection *conn);
+
+void connection_timeout_handler(Timer *timer, void *context);
+
+void connection_delayed_ack_handler(Timer *timer, void *context);
+
+void connection_idle_handler(Timer *timer, void *context);
+
+void connection_schedule_ack(Connection *conn);
+
+uint16_t connection_flush_ack(Connection *conn);
+
+uint16_t connection_queue_copy(Connection *conn, const char *data, size_t length);
+
+uint16_t connection_send_space(void *context);
+
+uint16_t connection_collection_limit(const Connection *conn);
+
+void connection_schedule_close(Connection *conn);
+
+void connection_negotiate(Connection *conn, const Header *header);
+
+void connection_get_stats(const Connection *conn, ConnectionStats *stats);
+
+void connection_publish_stats(const Connection *conn);
+
+void connection_print_stats(const Connection *conn, FILE *stream);
+
+uint16_t connection_table_init(ConnectionTable *table, uint32_t capacity);
+
+void connection_table_destroy(ConnectionTable *table);
+
+Connection *connection_table_lookup(ConnectionTable *table, uint32_t peer_ip, uint16_t peer_pid);
+
+uint32_t connection_table_peer_count(ConnectionTable *table, uint32_t peer_ip);
+
+Connection *connection_open(ConnectionTable *table, int socket, uint32_t local_ip, uint16_t local_pid, uint32_t peer_ip,
+                            uint16_t peer_pid, TimerWheel *wheel, uint16_t window_size);
+
+void connection_close(Connection *conn);
+
+Connection *connection_table_pop_pending(ConnectionTable *table);
+
+Connection *connection_table_pop_closing(ConnectionTable *table);
+
+void connection_table_resume_blocked(ConnectionTable *table);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_CONNECTION_H
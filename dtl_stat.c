@@ -0,0 +1,155 @@
+//
+// Created by dustyn on 7/29/24.
+//
+
+#include <signal.h>
+#include "stats.h"
+#include "timer_wheel.h"
+#include "congestion.h"
+
+/*
+ * dtl-stat, a look at a running server's stats segment (server -S <path>). Every interval it prints what has gone through since
+ * the last one, per second, and where every connection stands. All it does is read the mapped file, nothing here talks to the
+ * server or gets in its way.
+ *
+ * dtl-stat [-i interval_ms] [-n count] <path>
+ */
+
+#define DTL_STAT_DEFAULT_INTERVAL_MS 1000
+
+/*
+ * The upper bound in microseconds of the bucket the given fraction of samples falls in, 0 if there are none.
+ */
+static uint64_t rtt_percentile(const uint64_t samples[STATS_RTT_BUCKETS], double fraction) {
+    uint64_t total = 0;
+    for (uint32_t bucket = 0; bucket < STATS_RTT_BUCKETS; bucket++) {
+        total += samples[bucket];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t) (fraction * (double) total);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < STATS_RTT_BUCKETS; bucket++) {
+        seen += samples[bucket];
+        if (seen >= rank) {
+            return 1ULL << bucket;
+        }
+    }
+    return 1ULL << (STATS_RTT_BUCKETS - 1);
+}
+
+static void print_interval(const StatsCounters *now, const StatsCounters *before, double seconds) {
+    uint64_t rtt[STATS_RTT_BUCKETS];
+    for (uint32_t bucket = 0; bucket < STATS_RTT_BUCKETS; bucket++) {
+        rtt[bucket] = now->rtt_samples[bucket] - before->rtt_samples[bucket];
+    }
+
+    printf("in %.0f pkt/s %.2f MB/s  out %.0f pkt/s %.2f MB/s\n",
+           (double) (now->packets_in - before->packets_in) / seconds,
+           (double) (now->bytes_in - before->bytes_in) / seconds / 1e6,
+           (double) (now->packets_out - before->packets_out) / seconds,
+           (double) (now->bytes_out - before->bytes_out) / seconds / 1e6);
+    printf("retransmits %lu  checksum failures %lu  ip checksum failures %lu  duplicates %lu  timeouts %lu\n",
+           now->retransmits - before->retransmits, now->checksum_failures - before->checksum_failures,
+           now->ip_checksum_failures - before->ip_checksum_failures, now->duplicates - before->duplicates,
+           now->timeouts - before->timeouts);
+    printf("rtt p50 <%luus p99 <%luus p99.9 <%luus (totals in %lu out %lu retransmits %lu)\n", rtt_percentile(rtt, 0.5),
+           rtt_percentile(rtt, 0.99), rtt_percentile(rtt, 0.999), now->packets_in, now->packets_out, now->retransmits);
+}
+
+static void print_connections(const StatsSegment *segment) {
+    StatsConnection connection;
+    uint8_t header_printed = 0;
+
+    for (uint32_t slot = 0; slot < segment->max_connections; slot++) {
+        if (!stats_read_connection(segment, slot, &connection)) {
+            continue;
+        }
+        if (!header_printed) {
+            printf("%-21s %6s %10s %10s %-6s %6s %8s %7s %8s %10s %7s\n", "peer", "thread", "sent", "resent", "cc", "cwnd",
+                   "ssthresh", "losses", "timeouts", "srtt", "rto");
+            header_printed = 1;
+        }
+
+        struct in_addr peer = {.s_addr = connection.peer_ip};
+        char name[32];
+        snprintf(name, sizeof(name), "%s:%u", inet_ntoa(peer), connection.peer_pid);
+        connection.congestion[sizeof(connection.congestion) - 1] = '\0';
+        printf("%-21s %6u %10lu %10lu %-6s %6u ", name, connection.thread, connection.packets_sent,
+               connection.packets_retransmitted, connection.congestion, connection.cwnd);
+        if (connection.ssthresh == INITIAL_SSTHRESH) {
+            printf("%8s", "-");
+        } else {
+            printf("%8u", connection.ssthresh);
+        }
+        printf(" %7u %8u %8luus %5ums\n", connection.loss_events, connection.timeouts, connection.srtt_us, connection.rto_ms);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int option;
+    uint32_t interval_ms = DTL_STAT_DEFAULT_INTERVAL_MS;
+    long count = -1;
+
+    while ((option = getopt(argc, argv, "i:n:")) != -1) {
+        switch (option) {
+            case 'i':
+                interval_ms = (uint32_t) atoi(optarg);
+                break;
+            case 'n':
+                count = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i interval_ms] [-n count] path\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc || interval_ms == 0) {
+        fprintf(stderr, "Usage: %s [-i interval_ms] [-n count] path\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    const StatsSegment *segment = stats_map(argv[optind]);
+    if (segment == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = (pid_t) segment->pid;
+
+    StatsCounters before;
+    StatsCounters now;
+    stats_sum(segment, &before);
+    uint64_t before_us = monotonic_us();
+
+    while (count != 0) {
+        usleep(interval_ms * 1000);
+
+        stats_sum(segment, &now);
+        uint64_t now_us = monotonic_us();
+        double seconds = (double) (now_us - before_us) / 1e6;
+
+        printf("--- pid %d up %.1fs\n", pid, (double) (now_us - segment->started_us) / 1e6);
+        print_interval(&now, &before, seconds);
+        print_connections(segment);
+        fflush(stdout);
+
+        //The segment outlives the server as long as we have it mapped, so check it is still there
+        if (kill(pid, 0) < 0 && errno == ESRCH) {
+            printf("pid %d has exited\n", pid);
+            break;
+        }
+
+        before = now;
+        before_us = now_us;
+        if (count > 0) {
+            count--;
+        }
+    }
+
+    stats_unmap(segment);
+    return 0;
+}
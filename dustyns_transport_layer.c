@@ -1,7 +1,20 @@
 
 #include <stdbool.h>
+#include <assert.h>
 #include "dustyns_transport_layer.h"
 #include "network_layer.h"
+#include "packet_pool.h"
+#include "receive_ring.h"
+#include "sliding_window.h"
+#include "timer_wheel.h"
+#include "connection.h"
+#include "checksum.h"
+#include "pacing.h"
+#include "reassembly.h"
+#include "netsim.h"
+#include "stats.h"
+#include "log.h"
+#include "trace.h"
 
 
 /*
@@ -17,43 +30,16 @@
 */
 
 
-
 /*
- * Allocate a packet on the heap, being sure to allocate both io vectors inside the packet as well
- * We need to do a standard null check to ensure that allocation is not returning a null pointer
+ * Grab a packet from the connection's packet pool. The packet comes back as a single block with the
+ * ip header, our header and the payload already wired into the io vectors, headers zeroed.
+ * We still do a standard null check in case the pool could not grow.
  */
-
-uint16_t num_timeouts;
-char oob_data;
-
-uint16_t allocate_packet(Packet **packet_ptr) {
-    *packet_ptr = malloc(sizeof(Packet)); // Assign allocated memory to the pointer via dereferencing
+uint16_t allocate_packet(PacketPool *pool, Packet **packet_ptr) {
+    *packet_ptr = packet_pool_acquire(pool);
 
     if (*packet_ptr == NULL) {
-        perror("malloc");
-        return ERROR;
-    }
-    // Access and initialize the allocated memory through the dereferenced pointer
-    (*packet_ptr)->iov[0].iov_base = malloc(sizeof(struct iphdr));
-    (*packet_ptr)->iov[0].iov_len = sizeof(struct iphdr);
-    (*packet_ptr)->iov[1].iov_base = malloc(HEADER_SIZE);
-    (*packet_ptr)->iov[1].iov_len = HEADER_SIZE;
-    (*packet_ptr)->iov[2].iov_base = malloc(PAYLOAD_SIZE);
-    (*packet_ptr)->iov[2].iov_len = PAYLOAD_SIZE;
-
-    /*
-     * We're going to clear this memory space and set 0s across the board
-     * to avoid any funny business.
-     */
-    memset((*packet_ptr)->iov[0].iov_base, 0, sizeof(struct iphdr));
-    memset((*packet_ptr)->iov[1].iov_base, 0, HEADER_SIZE);
-    memset((*packet_ptr)->iov[2].iov_base, 0, PAYLOAD_SIZE);
-
-
-    if ((*packet_ptr)->iov[0].iov_base == NULL || (*packet_ptr)->iov[1].iov_base == NULL ||
-        (*packet_ptr)->iov[2].iov_base == NULL) {
-        perror("malloc");
-        free_packet(packet_ptr);
+        LOG_WARN("Packet pool exhausted");
         return ERROR;
     }
 
@@ -62,109 +48,103 @@ uint16_t allocate_packet(Packet **packet_ptr) {
 
 
 /*
- * Free packet from heap memory, check that it is not null to avoid dereferencing a null pointer, set each packet to null afterwards
+ * Give a packet back to the pool, check that it is not null to avoid dereferencing a null pointer, set the pointer to null afterwards
  * to make sure there are no double frees.
  */
-uint16_t free_packet(Packet **packet) {
+uint16_t free_packet(PacketPool *pool, Packet **packet) {
     if (packet == NULL || *packet == NULL) {
         return ERROR;
     }
 
-    // Free memory allocated for iov[0]
-    if ((*packet)->iov[0].iov_base != NULL) {
-        free((*packet)->iov[0].iov_base);
-        (*packet)->iov[0].iov_base = NULL;
-    }
-
-    // Free memory allocated for iov[1]
-    if ((*packet)->iov[1].iov_base != NULL) {
-        free((*packet)->iov[1].iov_base);
-        (*packet)->iov[1].iov_base = NULL;
-    }
+    uint16_t return_value = packet_pool_release(pool, *packet);
+    *packet = NULL; // Set pointer to NULL after releasing
+    return return_value;
+}
 
-    // Free memory allocated for iov[2]
-    if ((*packet)->iov[2].iov_base != NULL) {
-        free((*packet)->iov[2].iov_base);
-        (*packet)->iov[2].iov_base = NULL;
+/*
+ * Hand a whole collection back to the pool once we are done with it, so the blocks get reused
+ * by the next collection instead of piling up.
+ */
+void release_packet_collection(PacketPool *pool, Packet *packets[], uint16_t packet_array_len) {
+    for (int i = 0; i < packet_array_len; i++) {
+        if (packets[i] != NULL) {
+            free_packet(pool, &packets[i]);
+        }
     }
-
-    // Free memory allocated for the Packet structure
-    free(*packet);
-    *packet = NULL; // Set pointer to NULL after freeing memory
-    return SUCCESS;
 }
 
 
 /*
- * I'm making up words here I know, deal with it. this will take your data buffer and your
- * pre-allocated, initialized packet array and fill an array with packet data. We will break everything
- * down into packets of PAYLOAD_SIZE to a maximum number of packets MAX_PACKET_COLLECTION, sequence them properly,
+ * I'm making up words here I know, deal with it. this will take your pinned data buffer and your
+ * packet array and fill the array with packets. We will break everything
+ * down into packets of the connection's payload_size to a maximum number of packets MAX_PACKET_COLLECTION, sequence them properly,
  * include proper message size, provide a checksum for the data, fill in the layer 3 header.
  *
+ * Nothing gets copied, each packet's payload io vector points right into your buffer and holds a pin on it. That means
+ * you cannot touch or free the buffer until every packet has gone back to the pool, which happens once the collection is ACKed
+ * (see release_packet_collection). The length comes from the buffer rather than strlen() so binary data works fine.
+ *
+ * Every call is a new collection, it gets the next collection number (conn->send_collection).
+ *
+ * If the data needs more packets than packet_array_len we return ERROR rather than quietly cutting it short, same if it needs more than
+ * the peer said its next collection could have (connection_collection_limit()). Sending it anyway would just have it dropped at the other end.
  */
-uint16_t packetize_data(Packet *packet[], char data_buff[], uint16_t packet_array_len, uint32_t src_ip, uint32_t dest_ip,
-               uint16_t pid) {
+uint16_t packetize_data(Connection *conn, Packet *packet[], PinnedBuffer *buffer, uint16_t packet_array_len) {
 
     //Check they are not passing a packet array larger than the max
     if (packet_array_len > MAX_PACKET_COLLECTION) {
         return ERROR;
     }
-    //Init to error code so we know something went wrong if it returns with this value
-    uint16_t packets_filled = ERROR;
 
-    //Getting the length of the buffer we are going to packetize
-    size_t source_length = strlen(data_buff);
+    //Always at least one packet, even an empty message needs something to mark the end
+    size_t payload_size = conn->payload_size;
+    size_t packets_needed = buffer->length == 0 ? 1 : (buffer->length + payload_size - 1) / payload_size;
+    if (packets_needed > packet_array_len || packets_needed > connection_collection_limit(conn)) {
+        return ERROR;
+    }
 
     //This will track how many bytes we have left to packetize
-    size_t remaining_bytes = source_length;
+    size_t remaining_bytes = buffer->length;
 
     /*
      * A loop for iterating through each packet and filling the ip header,
-     * the transport header, the transport data, all the while we will set the packets_filled each time to the new number of packets filled
+     * the transport header and pointing the payload at the right slice of the buffer.
      */
 
 
-    for (int i = 0; i < packet_array_len; ++i) {
-
-        char packet_buff[PAYLOAD_SIZE];
-        allocate_packet(&packet[i]);
-        size_t bytes_copied;
+    for (size_t i = 0; i < packets_needed; ++i) {
 
-        struct iphdr ip_hdr;
-        if (fill_ip_header(&ip_hdr, src_ip, dest_ip) != SUCCESS) {
-            fprintf(stderr, "Err filling ip hdr\n");
-            exit(EXIT_FAILURE);
+        if (allocate_packet(&conn->pool, &packet[i]) != SUCCESS) {
+            release_packet_collection(&conn->pool, packet, i);
+            return ERROR;
         }
 
-
-        /*  Calculate the number of bytes to copy into this packet.
-            If the remaining bytes to copy (remaining_bytes) is greater than the size of the payload buffer (PAYLOAD_SIZE),
-            set bytes_to_copy to PAYLOAD_SIZE, indicating that a full payload buffer is copied.
-            Otherwise, set bytes_to_copy to the remaining_bytes, ensuring that only the remaining data is copied into the payload buffer.
+        /*  Calculate the number of bytes for this packet.
+            If the remaining bytes (remaining_bytes) is greater than the size of the payload (payload_size),
+            this packet carries a full payload_size, otherwise it carries whatever is left.
         */
-        size_t bytes_to_copy = remaining_bytes > PAYLOAD_SIZE ? PAYLOAD_SIZE : remaining_bytes;
-        memcpy(packet_buff, data_buff + (source_length - remaining_bytes), bytes_to_copy);
-        // segfault mania  memcpy(packet[i].iov[2].iov_base, packet_buff, bytes_to_copy);
-        packet[i]->iov[2].iov_base = packet_buff;
-        remaining_bytes -= bytes_to_copy;
-
-        Header header = {
-                DATA,
-                calculate_checksum(packet[i]->iov[2].iov_base, bytes_to_copy),
-                i,
-                bytes_to_copy,
-                pid
-        };
-
-
-        packet[i]->iov[1].iov_base = &header;
-
-
-        packets_filled = i + 1;
-
+        size_t bytes_in_packet = remaining_bytes > payload_size ? payload_size : remaining_bytes;
+        fill_ip_header_from_template(packet[i]->iov[0].iov_base, &conn->ip_template, PACKET_LENGTH(bytes_in_packet));
+        size_t offset = buffer->length - remaining_bytes;
+        packet_pin_payload(packet[i], buffer, offset, bytes_in_packet);
+        remaining_bytes -= bytes_in_packet;
+
+        Header *header = packet[i]->iov[1].iov_base;
+        header->version = conn->version;
+        header->status = DATA;
+        header->checksum_type = DEFAULT_CHECKSUM_TYPE;
+        header->checksum = calculate_checksum(DEFAULT_CHECKSUM_TYPE, buffer->data + offset, bytes_in_packet);
+        header->sequence = i;
+        header->collection = conn->send_collection;
+        header->msg_size = bytes_in_packet;
+        header->max_payload = conn->max_payload;
+        header->dest_process_id = conn->peer_pid;
+        header->source_process_id = conn->local_pid;
+        header->packet_end = packets_needed - 1;
 
     }
-    return packets_filled;
+    conn->send_collection++;
+    return packets_needed;
 
 }
 
@@ -181,8 +161,11 @@ uint16_t dump_packet_collection_payload_into_buffer(Packet *packet[], char **dat
     uint64_t buffer_space_taken = 0;
 
     for (int i = 0; i < (packet_array_len + 1); i++) {
+        if (packet[i] == NULL) {
+            continue;
+        }
         Header *head = packet[i]->iov[1].iov_base;
-        if(head->status == DATA || head->status == RESEND){
+        if(head->status == DATA || head->status == SECOND_SEND || head->status == RESEND){
             memcpy(*data_buff + buffer_space_taken, packet[i]->iov[2].iov_base,head->msg_size);
             buffer_space_taken += head->msg_size;
             if (buffer_space_taken >= (buff_size - 256)) {
@@ -196,273 +179,317 @@ uint16_t dump_packet_collection_payload_into_buffer(Packet *packet[], char **dat
 
 }
 
-
 /*
- * This will set the alarm for a packet timeout
- * A custom timer is allowed, however, the default will be
- * the value of the TIMEOUT macro. This will set an alarm
- * and if the system does not receive an ack in the given
- * timeframe, a sigalrm will be sent by the kernel to alert us
- * We can implement exponential back off as well.
- * Exponential backoff means each timeout we double the timeout
- * period. This can be useful to conserve resources and ensure any issues are resolved.
- * If not we will abort the sending of this packet set.
+ * This will arm the retransmit timer for a packet timeout. How long we wait comes from the timer's RTT estimate
+ * rather than a fixed number of seconds, so on loopback a lost packet is noticed within milliseconds.
+ * The timer lives on the connection's timer wheel, when it fires its callback decides what to resend.
  *
- * Exponential backoff is a method to ensure we are not being too
- * aggressive and allowing time for any network issues to pass
+ * Exponential backoff is handled by retransmit_timer_backoff(), every timeout in a row doubles the RTO
+ * to ensure we are not being too aggressive and allowing time for any network issues to pass.
  * This can relieve issues such as bogging the network / congestion.
+ *
+ * Returns the timeout we armed in milliseconds.
  */
-uint16_t set_packet_timeout() {
+uint16_t set_packet_timeout(RetransmitTimer *timer) {
 
+    if (timer == NULL) {
+        return ERROR;
+    }
 
-    if (num_timeouts == 0) {
-        alarm(INITIAL_TIMEOUT);
-        return INITIAL_TIMEOUT;
-    } else {
-        uint16_t timeout_value = (INITIAL_TIMEOUT);
+    timer->sent_at_us = monotonic_us();
+    timer_wheel_schedule(timer->wheel, &timer->timer, timer->rtt.rto_ms);
+    return timer->rtt.rto_ms > ERROR - 1 ? ERROR - 1 : timer->rtt.rto_ms;
+}
 
-        for (int i = 0; i < num_timeouts; ++i) {
-            timeout_value *= 2;
-        }
 
-        if (timeout_value < MAX_TIMEOUT) {
-            alarm(timeout_value);
-            return timeout_value;
-        } else {
-            return ERROR;
-        }
+/*
+ * This function resets the timer once we have received an ACK on the series of packets we just sent.
+ * If the packets went out exactly once we also get a round trip time sample out of it, if we had to time out and resend we can't
+ * tell which send the ACK belongs to so we skip the sample (Karn's algorithm).
+ */
+void reset_timeout(RetransmitTimer *timer) {
 
+    if (timer == NULL || !timer->timer.armed) {
+        return;
     }
-}
 
+    timer_wheel_cancel(timer->wheel, &timer->timer);
+
+    if (timer->num_timeouts == 0) {
+        rtt_estimator_sample(&timer->rtt, monotonic_us() - timer->sent_at_us);
+    }
+    timer->num_timeouts = 0;
+}
 
 /*
- * This function simply resets the alarm once we have received an ACK on the series of packets we just sent.
- * We will also need a signal handler to handle
- *
- *
- *
- * The alarm handler. I am not sure if I am going to keep this as is. You can't really pass args to sig handlers so I will need to think about
- * how I want to handle this as I get closer to a full implementation of my protocol.
+ * Timer callback for collection mode, the old SIGALRM handler, the context is the connection. Back off and wait again, once we are
+ * past MAX_RETRANSMITS num_timeouts says so and the connection loop gives up on the connection instead of us calling exit() from in here.
  */
-void reset_timeout() {
-    alarm(0);
+void collection_timeout_handler(Timer *timer, void *context) {
+    RetransmitTimer *retransmit_timer = &((Connection *) context)->retransmit_timer;
+    LOG_DEBUG("Packet timeout");
+    if (retransmit_timer_backoff(retransmit_timer) != SUCCESS) {
+        LOG_WARN("Max timeout reached");
+        return;
+    }
+    timer_wheel_schedule(retransmit_timer->wheel, &retransmit_timer->timer, retransmit_timer->rtt.rto_ms);
 }
 
-void sigalrm_handler() {
-    num_timeouts++;
-    uint16_t timeout = INITIAL_TIMEOUT;
-    write(1, "SIGALRM\n", 8);
-    for (int i = 0; i < num_timeouts; i++) {
-        timeout *= 2;
+/*
+ * Block until the socket has something for us, running any timers on the wheel that come due in the meantime.
+ * If we still have received packets sitting in the ring there is no need to wait at all.
+ * Returns ERROR if polling fails or, when we are waiting on a single connection's retransmit timer, that timer has given up.
+ * If that timer goes off without giving up we return TIMED_OUT so the caller can do something about it, like asking again.
+ * A server with many connections passes a NULL timer, a connection giving up is dealt with by its own timer callback.
+ */
+uint16_t wait_for_packets(ReceiveRing *ring, int socket, TimerWheel *wheel, RetransmitTimer *timer) {
+
+    if (ring->cursor != ring->head) {
+        return SUCCESS;
     }
-    if (timeout > MAX_TIMEOUT) {
-        fprintf(stderr, "Max timeout reached\n");
-        exit(EXIT_FAILURE);
-    } else {
-        set_packet_timeout();
+
+    struct pollfd fds[2];
+    fds[0].fd = socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = wheel->timer_fd;
+    fds[1].events = POLLIN;
+
+    uint16_t timeouts = timer != NULL ? timer->num_timeouts : 0;
+
+    while (true) {
+        if (timer != NULL && timer->num_timeouts > MAX_RETRANSMITS) {
+            return ERROR;
+        }
+
+        int ready = poll(fds, 2, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return ERROR;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            timer_wheel_handle_fd(wheel);
+        }
+        //The timeout comes first even if packets showed up with it, they are still there for the next call but the timeout is not
+        if (timer != NULL && timer->num_timeouts != timeouts && timer->num_timeouts <= MAX_RETRANSMITS) {
+            return TIMED_OUT;
+        }
+        if (fds[0].revents & POLLIN) {
+            return SUCCESS;
+        }
     }
 }
 
 
 /*
- * This will be our checksum function, it is going to iterate through bytes in the data and bitwise XOR them.
- * This means that if the bit matches, 0 is returned.
- * A non-zero value on verification indicates that bits have changed.
- * This is a simple way to implement a checksum in our home-grown transport layer.
- *
- * Visual Example:
- *
- * XORd checksum = 1001 0101
- * Received Data = 1011 0101
- * Result would  = 0010 0000
+ * This will be our checksum function. The header says which algorithm was used, so this just hands off to the right one in checksum.c.
+ * CRC32C is what we send with, it uses the CPU's crc32 instruction when there is one.
  *
- * The result is not 0
- * The data has changed
- *
- * Nice and simple, we like that around here
+ * The original XOR of every byte is still understood so packets from old senders can be checked. It went through a signed char
+ * before, which smeared the sign bit across the top byte of the checksum, it is done on unsigned bytes now.
  */
 
-uint16_t calculate_checksum(char data[], size_t length) {
-
-    uint16_t checksum = 0;
+uint32_t calculate_checksum(uint16_t checksum_type, const char data[], size_t length) {
 
-    for (size_t i = 0; i < length; i++) {
-        char byte = data[i];
-        checksum ^= byte;
+    switch (checksum_type) {
+        case CHECKSUM_CRC32C:
+            return crc32c(data, length);
+        case CHECKSUM_XOR:
+            return xor_checksum(data, length);
+        default:
+            return 0;
     }
-    return checksum;
 }
 
 /*
  * Here will be a function for verifying the checksum when we receive one in a client header message
- * It will return either 0 or 65535, checksum good, or checksum not good.
+ * It will return either 0 or 65535, checksum good, or checksum not good. An algorithm we don't know counts as not good.
+ * (This used to return uint8_t, which cut ERROR down to 255.)
  */
 
-uint8_t compare_checksum(char data[], size_t length, uint16_t received_checksum) {
+uint16_t compare_checksum(uint16_t checksum_type, const char data[], size_t length, uint32_t received_checksum) {
+
+    if (checksum_type != CHECKSUM_CRC32C && checksum_type != CHECKSUM_XOR) {
+        STATS_ADD(checksum_failures, 1);
+        return ERROR;
+    }
 
-    uint16_t new_checksum = calculate_checksum(data, length);
-    if ((new_checksum ^ received_checksum) != 0) {
-        return (uint8_t) ERROR;
+    uint32_t new_checksum = calculate_checksum(checksum_type, data, length);
+    if (new_checksum != received_checksum) {
+        STATS_ADD(checksum_failures, 1);
+        return ERROR;
     } else {
-        return (uint8_t) SUCCESS;
+        return SUCCESS;
     }
 }
 
 /*
- * This will inspect an array of packets and make sure that we have all the sequencing correct.
- * Also sending out RESEND messages to the other side with the packet sequence number that will need to be sent back.
+ * This will look at which sequences of the collection we have (received[sequence] is set) and make sure that we have all the sequencing correct.
+ * Anything missing goes back to the other side in a NACK, runs of missing sequences are folded into ranges so a burst of
+ * losses costs one datagram instead of one RESEND per packet, exactly when the network can least afford the extra traffic.
  */
 
-uint16_t handle_ack(int socket, Packet **packets,uint16_t num_packets, uint32_t src_ip, uint32_t dest_ip, uint16_t pid) {
+uint16_t handle_ack(Connection *conn, const uint8_t received[], uint16_t collection_end) {
 
-    bool sequence_received[MAX_PACKET_COLLECTION] = {false}; // Initialize all to false
     int last_received = -1;
     int missing_packets = 0;
-    int highest_packet_received;
-
-    // Iterate through each packet in the collection
-    for (int i = 0; i <= (num_packets); i++) {
-        Packet *packet = packets[i];
-
-        if (packet == NULL) break;
+    int highest_packet_received = 0;
 
+    /*
+     * collection_end is the last sequence of the collection, so this looks at collection_end + 1 slots. The caller has checked it
+     * against the array already, it comes off the wire in the first place.
+     */
+    assert(collection_end < MAX_PACKET_COLLECTION);
 
-        Header *header = packet->iov[1].iov_base;
-        if(header->dest_process_id != SERVER_PID){
-            fprintf(stdout,"Packet for another process\n");
-            free_packet(&packets[i]);
+    for (int i = 0; i <= collection_end; i++) {
+        if (received[i]) {
+            last_received = i;
         }
-
-        sequence_received[header->sequence] = true;
-
-        last_received = header->sequence;
-
-        highest_packet_received = last_received;
     }
+    highest_packet_received = last_received < 0 ? 0 : last_received;
 
-    // Check for missing packets and send RESEND if needed
+    // Check for missing packets, a gap that carries on from the last one just makes that range longer
+    NackRange ranges[MAX_PACKET_COLLECTION / 2 + 1];
+    uint16_t num_ranges = 0;
     for (int i = 0; i <= last_received; ++i) {
-        if (!sequence_received[i]) {
-            // Packet with sequence i is missing, send RESEND
-            send_resend(socket, i, src_ip, dest_ip, pid);
-            printf("SENDING RESEND\n");
-            fflush(stdout);
+        if (!received[i]) {
+            if (num_ranges > 0 && ranges[num_ranges - 1].start + ranges[num_ranges - 1].length == i) {
+                ranges[num_ranges - 1].length++;
+            } else {
+                ranges[num_ranges].start = i;
+                ranges[num_ranges].length = 1;
+                num_ranges++;
+            }
             missing_packets += 1;
         }
     }
     if (missing_packets > 0) {
 
+        if (send_nack(conn, ranges, num_ranges) != SUCCESS) {
+            LOG_WARN("Error sending NACK: %s", strerror(errno));
+        }
+        LOG_DEBUG("SENDING NACK, %d missing in %u ranges", missing_packets, num_ranges);
         return missing_packets;
 
     } else {
-        if (send_ack(socket, highest_packet_received, src_ip,dest_ip, pid) != SUCCESS) {
+        if (send_ack(conn, highest_packet_received) != SUCCESS) {
             return ERROR;
         }
-        fprintf(stdout,"SENT ACK\n");
-        fflush(stdout);
+        LOG_DEBUG("SENT ACK %d", highest_packet_received);
         return SUCCESS;
 
     }
 }
 
 /*
- * This function is for when a set of packets has been checked properly and an acknowledge can be sent.
- * Send the acknowledge message to the client side., return SUCCESS or ERROR depending on return value of sendmsg() call
+ * Whether we know how to read a header of this version at all.
  */
-uint16_t send_ack(int socket, uint16_t max_sequence, uint32_t src, uint32_t dest, uint16_t pid) {
-
-    Packet *packet;
-
-    allocate_packet(&packet);
+uint8_t header_version_supported(uint8_t version) {
+    return version >= HEADER_VERSION_MIN && version <= HEADER_VERSION;
+}
 
-    struct iphdr ip_hdr;
+/*
+ * Every control packet goes through these two. The ip header, the peer's address and the message were all set up with the
+ * connection (see ControlPacket), so all that is left is clearing our header and stamping who it is from and to.
+ */
+static Header *control_header(Connection *conn, uint16_t status) {
+    Header *header = &conn->control.header;
+    memset(header, 0, sizeof(Header));
+    header->version = conn->version;
+    header->max_payload = conn->max_payload;
+    header->status = status;
+    header->dest_process_id = conn->peer_pid;
+    header->source_process_id = conn->local_pid;
+    header->collection = conn->receive_collection;
+    return header;
+}
 
+static ssize_t send_control_packet(Connection *conn, size_t payload_length) {
+    ip_header_set_tot_len(&conn->control.ip_header, PACKET_LENGTH(payload_length));
+    conn->control.iov[2].iov_len = payload_length;
+    conn->control.message.msg_iovlen = payload_length > 0 ? 3 : 2;
+    ssize_t sent = netsim_sendmsg(conn->socket, &conn->control.message, 0);
+    if (sent > 0) {
+        STATS_ADD(packets_out, 1);
+        STATS_ADD(bytes_out, sent);
+        trace_record(TRACE_OUT, conn->control.iov, (int) conn->control.message.msg_iovlen, (uint32_t) sent);
+    }
+    return sent;
+}
 
+/*
+ * ACK one collection by its number. Usually that is the one we are receiving (send_ack()), but if our ACK for the last one went
+ * missing the peer keeps resending it and needs to hear again.
+ */
+static uint16_t send_collection_ack(Connection *conn, uint32_t collection, uint16_t max_sequence) {
 
     //max sequence too high putting this here to remember to investigate
 
+    Header *header = control_header(conn, ACKNOWLEDGE);
+    header->collection = collection;
+    header->sequence = max_sequence;
+    header->window = conn->reassembly != NULL ? reassembly_space(conn->reassembly) : conn->collection_space;
 
+    ssize_t bytes_sent = send_control_packet(conn, 0);
 
-    Header header = {
-            ACKNOWLEDGE,
-            0,
-            max_sequence,
-            0,
-            pid
-    };
-
-    if (fill_ip_header(&ip_hdr, src, dest) != SUCCESS) {
-        fprintf(stderr, "Err filling ip hdr\n");
-        exit(EXIT_FAILURE);
+    if (bytes_sent < 0) {
+        LOG_WARN("sendmsg: %s", strerror(errno));
+        return ERROR;
+    } else {
+        return SUCCESS;
     }
-    packet->iov[0].iov_base = &ip_hdr;
-    packet->iov[1].iov_base = &header;
 
-    struct msghdr message;
-    memset(&message, 0, sizeof(message));
-    message.msg_iov = packet->iov;
-    message.msg_iovlen = 2;
-    struct sockaddr_in destination;
-    memset(&destination, 0, sizeof(destination));
-    destination.sin_family = AF_INET;
-    destination.sin_addr.s_addr = inet_addr("127.0.0.1");
-    message.msg_name = &destination;
-    message.msg_namelen = sizeof(struct sockaddr_in);
+}
+
+/*
+ * This function is for when a set of packets has been checked properly and an acknowledge can be sent.
+ * Send the acknowledge message to the client side., return SUCCESS or ERROR depending on return value of sendmsg() call
+ */
+uint16_t send_ack(Connection *conn, uint16_t max_sequence) {
+    return send_collection_ack(conn, conn->receive_collection, max_sequence);
+}
 
-    usleep(50);
-    ssize_t bytes_sent = sendmsg(socket, &message, 0);
+/*
+ * The sliding window version of an ACK. Instead of the highest sequence we saw, it carries the next sequence we are waiting on
+ * (so everything before it is covered in one go) plus a bitmap of what has shown up out of order past that point.
+ * The sender uses the bitmap to resend only the holes instead of everything after the first loss.
+ */
+uint16_t send_selective_ack(Connection *conn, uint32_t ack, uint32_t sack_bitmap) {
 
+    Header *header = control_header(conn, ACKNOWLEDGE);
+    header->sequence = ack;
+    header->ack = ack;
+    header->window = receive_window_advertise(&conn->receive_window);
+    header->sack_bitmap = sack_bitmap;
 
+    ssize_t bytes_sent = send_control_packet(conn, 0);
 
     if (bytes_sent < 0) {
-        perror("sendmsg");
+        LOG_WARN("sendmsg: %s", strerror(errno));
         return ERROR;
     } else {
         return SUCCESS;
     }
-
 }
 
 /*
  *  This function handles sending RESEND packets which will have no body just a header with the RESEND status, and the seq number of the missing packet
  *  Returns the seq number on success and ERROR otherwise.
  */
-uint16_t send_resend(int socket, uint16_t sequence, uint32_t src_ip, uint32_t dst_ip, uint16_t pid) {
+uint16_t send_resend(Connection *conn, uint16_t sequence) {
 
-    Packet *packet;
+    Header *header = control_header(conn, RESEND);
+    header->sequence = sequence;
 
-    allocate_packet(&packet);
-
-    Header header = {
-            RESEND,
-            0,
-            sequence,
-            0,
-            pid
-    };
-    struct iphdr ip_hdr;
-    fill_ip_header(&ip_hdr, src_ip, dst_ip);
-    packet->iov[0].iov_base = &ip_hdr;
-    packet->iov[1].iov_base = &header;
-
-    struct msghdr message;
-    memset(&message, 0, sizeof(message));
-    message.msg_iov = packet->iov;
-    message.msg_iovlen = 2;
-    struct sockaddr_in destination;
-    memset(&destination, 0, sizeof(destination));
-    destination.sin_family = AF_INET;
-    destination.sin_addr.s_addr = inet_addr("127.0.0.1");
-    message.msg_name = &destination;
-    message.msg_namelen = sizeof(struct sockaddr_in);
-
-    ssize_t bytes_sent = sendmsg(socket, &message, 0);
+    ssize_t bytes_sent = send_control_packet(conn, 0);
 
     if (bytes_sent < 0) {
         return ERROR;
     } else {
-        return header.sequence;
+        return sequence;
     }
 
 }
@@ -474,125 +501,156 @@ uint16_t send_resend(int socket, uint16_t sequence, uint32_t src_ip, uint32_t ds
  * header, then the client will read the sequence and resend that packet
  */
 
-uint16_t handle_corruption(int socket, uint32_t src_ip, uint32_t dst_ip, uint16_t sequence, uint16_t pid) {
+uint16_t handle_corruption(Connection *conn, uint16_t sequence) {
 
-    Packet *packet;
+    Header *header = control_header(conn, CORRUPTION);
+    header->sequence = sequence;
 
-    allocate_packet(&packet);
+    ssize_t bytes_sent = send_control_packet(conn, 0);
+    if (bytes_sent < 0) {
+        return ERROR;
+    } else {
+        return sequence;
+    }
+}
 
-    struct iphdr ip_hdr;
+/*
+ * Tell the other side which ranges of the collection never showed up. The ranges go in the payload, MAX_NACK_RANGES to a datagram,
+ * with a checksum like any other payload since the sender acts on them. sequence is the first missing sequence so anything that only
+ * knows about RESEND still gets something sensible out of it.
+ */
+uint16_t send_nack(Connection *conn, const NackRange ranges[], uint16_t num_ranges) {
 
-    Header header = {
-            CORRUPTION,
-            0,
-            sequence,
-            0,
-            pid
-    };
+    uint16_t sent = 0;
 
-    fill_ip_header(&ip_hdr, src_ip, dst_ip);
+    while (sent < num_ranges) {
+        uint16_t remaining = num_ranges - sent;
+        uint16_t count = remaining > (uint16_t) MAX_NACK_RANGES ? (uint16_t) MAX_NACK_RANGES : remaining;
+        size_t length = count * sizeof(NackRange);
 
-    packet->iov[0].iov_base = &ip_hdr;
-    packet->iov[1].iov_base = &header;
+        Header *header = control_header(conn, NACK);
+        memcpy(conn->control.payload, &ranges[sent], length);
+        header->sequence = ranges[sent].start;
+        header->msg_size = length;
+        header->checksum_type = DEFAULT_CHECKSUM_TYPE;
+        header->checksum = calculate_checksum(DEFAULT_CHECKSUM_TYPE, conn->control.payload, length);
+
+        if (send_control_packet(conn, length) < 0) {
+            LOG_WARN("sendmsg: %s", strerror(errno));
+            return ERROR;
+        }
+        sent += count;
+    }
+    return SUCCESS;
+}
 
+/*
+ * Pull the ranges back out of a received NACK. Returns how many there were, or ERROR if the payload is damaged or isn't a whole
+ * number of ranges.
+ */
+uint16_t read_nack_ranges(const Packet *packet, NackRange ranges[], uint16_t max_ranges) {
 
-    struct msghdr message;
-    memset(&message, 0, sizeof(message));
-    message.msg_iov = packet->iov;
-    message.msg_iovlen = 2;
-    struct sockaddr_in destination;
-    memset(&destination, 0, sizeof(destination));
-    destination.sin_family = AF_INET;
-    destination.sin_addr.s_addr = inet_addr("127.0.0.1");
-    message.msg_name = &destination;
-    message.msg_namelen = sizeof(struct sockaddr_in);
+    const Header *header = packet->iov[1].iov_base;
 
-    ssize_t bytes_sent = sendmsg(socket, &message, 0);
-    if (bytes_sent < 0) {
-        free_packet(&packet);
+    if (header->msg_size % sizeof(NackRange) != 0 || header->msg_size > packet->iov[2].iov_len ||
+        compare_checksum(header->checksum_type, packet->iov[2].iov_base, header->msg_size, header->checksum) != SUCCESS) {
         return ERROR;
-    } else {
-        return header.sequence;
     }
+
+    uint16_t count = header->msg_size / sizeof(NackRange);
+    if (count > max_ranges) {
+        count = max_ranges;
+    }
+    memcpy(ranges, packet->iov[2].iov_base, count * sizeof(NackRange));
+    return count;
+}
+
+/*
+ * Collections are sent in one go from code that blocks anyway, so if a pacing rate was configured we just sleep between
+ * bursts of a bucket's worth. With no rate they go out as fast as sendmmsg() takes them, like always.
+ */
+static uint16_t send_packet_batch_paced(int socket, const struct sockaddr_in *destination, uint16_t num_packets, Packet *packets[],
+                                        uint32_t failed_packet_seq[], uint16_t batch_size) {
+
+    if (pacing_default_rate() <= 0) {
+        return send_packet_batch(socket, destination, num_packets, packets, failed_packet_seq, batch_size);
+    }
+
+    Pacer pacer;
+    pacer_init(&pacer, pacing_default_rate(), 0);
+    uint16_t burst = pacer.burst < MAX_SEND_BATCH_SIZE ? (uint16_t) pacer.burst : MAX_SEND_BATCH_SIZE;
+    uint16_t failed_packets = 0;
+
+    for (uint16_t sent = 0; sent < num_packets;) {
+        uint16_t count = num_packets - sent < burst ? num_packets - sent : burst;
+        pacer_wait(&pacer, count);
+
+        uint16_t failed = send_packet_batch(socket, destination, count, &packets[sent], &failed_packet_seq[failed_packets], batch_size);
+        if (failed == ERROR) {
+            return ERROR;
+        }
+        failed_packets += failed;
+        pacer_consume(&pacer, count);
+        sent += count;
+    }
+    return failed_packets;
 }
 
 /*
  * This function is for resending packets that were either never delivered or corrupted along the way.
- * We will just go through the array of bad seq numbers and we will resend the specified packets.
- *
+ * It takes the ranges straight out of a NACK, marks every packet they cover SECOND_SEND and sends the lot in one batch,
+ * so a burst of losses is resent with a handful of sendmmsg() calls rather than a sendmsg() per packet.
  *
- * We will need to store the sequence of missing packets inside an array as we receive them
- * if one cannot be sent return the first seq num of the packet that cannot be
- * sent.
+ * Sequences past the end of the collection are ignored. If one cannot be sent return the first seq num of the packet that cannot be
+ * sent, SUCCESS otherwise.
  */
 
-uint16_t send_missing_packets(int socket, uint16_t *sequence[], uint16_t num_packets, Packet **packet_collection, uint16_t pid) {
+uint16_t send_missing_packets(Connection *conn, const NackRange ranges[], uint16_t num_ranges, Packet *packet_collection[],
+                              uint16_t num_packets) {
 
+    Packet *batch[MAX_PACKET_COLLECTION];
+    uint32_t failed[MAX_PACKET_COLLECTION];
+    uint16_t count = 0;
 
-    for (int i = 0; i < num_packets; i++) {
-
-        Header header;
-        header = *((Header *) packet_collection[*sequence[i]]->iov[1].iov_base);
-        header.status = SECOND_SEND;
-        packet_collection[*sequence[i]]->iov[1].iov_base = &header;
-        struct msghdr message;
-        memset(&message, 0, sizeof(message));
-        struct sockaddr_in destination;
-        memset(&destination, 0, sizeof(destination));
-        destination.sin_family = AF_INET;
-        destination.sin_addr.s_addr = inet_addr("127.0.0.1");
-        message.msg_name = &destination;
-        message.msg_namelen = sizeof(struct sockaddr_in);
-        message.msg_iov = packet_collection[*sequence[i]]->iov;
-        message.msg_iovlen = 3;
-        ssize_t bytes_sent = sendmsg(socket, &message, 0);
-
-        if (bytes_sent < 0) {
-            return *sequence[i];
-        } else {
-            continue;
+    for (uint16_t r = 0; r < num_ranges; r++) {
+        for (uint32_t sequence = ranges[r].start;
+             sequence < (uint32_t) ranges[r].start + ranges[r].length && sequence < num_packets && count < MAX_PACKET_COLLECTION;
+             sequence++) {
+            Packet *packet = packet_collection[sequence];
+            if (packet == NULL) {
+                continue;
+            }
+            ((Header *) packet->iov[1].iov_base)->status = SECOND_SEND;
+            batch[count++] = packet;
         }
     }
-    return SUCCESS;
+
+    if (count == 0) {
+        return SUCCESS;
+    }
+
+    STATS_ADD(retransmits, count);
+    uint16_t failed_packets = send_packet_batch_paced(conn->socket, &conn->destination, count, batch, failed, SEND_BATCH_SIZE);
+    if (failed_packets == ERROR) {
+        return ((Header *) batch[0]->iov[1].iov_base)->sequence;
+    }
+    return failed_packets > 0 ? (uint16_t) failed[0] : SUCCESS;
 }
 
 /*
  * This function will send out of band data , which is akin to a network interrupt if you will. We will
  * allow 1 byte of OOB data to be send, could be some kind of escape or abort signal. OOB data is supposed to skip the queue
  * and come off the wire and be processed before anything else.
+ *
+ * The byte goes out as a one byte payload. It used to be written into the payload vector and then left off the message.
  */
-uint16_t send_oob_data(int socket, char oob_char, uint32_t src_ip, uint32_t dst_ip, uint16_t pid) {
+uint16_t send_oob_data(Connection *conn, char oob_char) {
 
-    Packet *packet;
-    allocate_packet(&packet);
-    struct iphdr ip_hdr;
-    Header header = {
-            OOB,
-            0,
-            0,
-            OUT_OF_BAND_DATA_SIZE,
-            pid
-    };
-
-    fill_ip_header(&ip_hdr, src_ip, dst_ip);
-
-    packet->iov[0].iov_base = &ip_hdr;
-    packet->iov[1].iov_base = &header;
-    packet->iov[2].iov_base = &oob_char;
-    packet->iov[2].iov_len = OUT_OF_BAND_DATA_SIZE;
-
-    struct msghdr message;
-    struct sockaddr_in destination;
-    memset(&destination, 0, sizeof(destination));
-    memset(&message, 0, sizeof(message));
-    destination.sin_family = AF_INET;
-    destination.sin_addr.s_addr = inet_addr("127.0.0.1");
-    message.msg_name = &destination;
-    message.msg_namelen = sizeof(struct sockaddr_in);
-    message.msg_iov = packet->iov;
-    message.msg_iovlen = 2;
+    Header *header = control_header(conn, OOB);
+    header->msg_size = OUT_OF_BAND_DATA_SIZE;
+    conn->control.payload[0] = oob_char;
 
-    ssize_t bytes_sent = sendmsg(socket, &message, 0);
+    ssize_t bytes_sent = send_control_packet(conn, OUT_OF_BAND_DATA_SIZE);
     if (bytes_sent < 0) {
         return ERROR;
 
@@ -601,43 +659,17 @@ uint16_t send_oob_data(int socket, char oob_char, uint32_t src_ip, uint32_t dst_
     }
 }
 
-
 /*
  * Function to handle sending a connection closed message to the client side of the conn.
  * This will be used to let the other side of the association know that the connection
  * is being closed so it can close the connection and clean up.
+ * It is addressed to the peer like everything else, now that the other side may be serving many connections it has to know which one is closing.
  */
-uint16_t handle_close(int socket, uint32_t src_ip, uint32_t dst_ip, uint16_t pid) {
-
-    Packet *packet;
-    allocate_packet(&packet);
-    struct iphdr ip_hdr;
-
-    Header header = {
-            CLOSE,
-            0,
-            0,
-            0,
-            ERROR
-    };
-
-
-    fill_ip_header(&ip_hdr, src_ip, dst_ip);
-
-    struct sockaddr_in dest_addr;
-    memset(&dest_addr, 0, sizeof(dest_addr));
-
-    packet->iov[0].iov_base = &ip_hdr;
-    packet->iov[1].iov_base = &header;
+uint16_t handle_close(Connection *conn) {
 
-    struct msghdr message;
-    memset(&message, 0, sizeof(message));
-    message.msg_name = &dest_addr;
-    message.msg_iov = packet->iov;
-    message.msg_iovlen = 2;
-    message.msg_namelen = sizeof(struct sockaddr_in);
+    control_header(conn, CLOSE);
 
-    ssize_t bytes_sent = sendmsg(socket, &message, 0);
+    ssize_t bytes_sent = send_control_packet(conn, 0);
     if (bytes_sent < 0) {
         return ERROR;
     } else {
@@ -645,7 +677,6 @@ uint16_t handle_close(int socket, uint32_t src_ip, uint32_t dst_ip, uint16_t pid
     }
 }
 
-
 /*
  * These two functions will swap the endianness coming on and coming off the wire.
  * The network byte order is big endian, so this is standard practice.
@@ -658,8 +689,8 @@ uint16_t handle_close(int socket, uint32_t src_ip, uint32_t dst_ip, uint16_t pid
 void get_transport_packet_wire_ready(struct iovec iov[3]) {
 
     Header *header = (Header *) iov[1].iov_base;
-    header->sequence = htons(header->sequence);
-    header->checksum = htons(header->checksum);
+    header->sequence = htonl(header->sequence);
+    header->checksum = htonl(header->checksum);
     header->msg_size = htons(header->msg_size);
 
     iov[1].iov_base = header;
@@ -671,8 +702,8 @@ void get_transport_packet_wire_ready(struct iovec iov[3]) {
 void get_transport_packet_host_ready(struct iovec iov[3]) {
 
     Header *header = (Header *) iov[1].iov_base;
-    header->sequence = ntohs(header->sequence);
-    header->checksum = ntohs(header->checksum);
+    header->sequence = ntohl(header->sequence);
+    header->checksum = ntohl(header->checksum);
     header->msg_size = ntohs(header->msg_size);
 
     iov[1].iov_base = header;
@@ -681,7 +712,7 @@ void get_transport_packet_host_ready(struct iovec iov[3]) {
 }
 
 /*
- * This function will send an array of packets 1 by one once they have been set up properly. It will log how many failed packets there were.
+ * This function will send an array of packets once they have been set up properly. It will log how many failed packets there were.
  * so we can know what to expect. We will get a resend from the otherside of the association once the packets have been rounded up and counted.
  * On send we will start a timer based on the current number of timeouts.
  *
@@ -689,58 +720,178 @@ void get_transport_packet_host_ready(struct iovec iov[3]) {
  *
  * Once this is done it will fill your failed pack seq array with the seq numbers of the packets that didn't send and you can decide what to do from
  * there.
+ *
+ * The ip headers were already filled in when the collection was packetized, so src_ip is not needed here anymore,
+ * it is kept so existing callers do not break. dest_ip is only used for the destination address.
+ */
+
+
+uint16_t send_packet_collection(int socket, uint16_t num_packets, Packet *packets[], uint32_t failed_packet_seq[PACKET_SIZE], uint16_t pid,uint32_t src_ip, uint32_t dest_ip,
+                                RetransmitTimer *timer) {
+    struct sockaddr_in destination;
+    memset(&destination, 0, sizeof(destination));
+    destination.sin_family = AF_INET;
+    destination.sin_addr.s_addr = dest_ip;
+    return send_packet_collection_batched(socket, &destination, num_packets, packets, failed_packet_seq, SEND_BATCH_SIZE, timer);
+}
+
+/*
+ * Sending one packet per sendmsg() call means one syscall per packet, for a full collection that is 1000 trips into the kernel
+ * and that is where most of our time was going. sendmmsg() takes an array of message headers and sends as many as it can in one go.
+ *
+ * We build the whole mmsghdr array once up front, every entry shares the same destination address, then flush it in chunks of batch_size.
+ * sendmmsg() returns how many messages went out, if that is short of the chunk then the next message is the one that failed.
+ * We record its sequence in failed_packet_seq, skip over it and carry on with the rest.
  */
+uint16_t send_packet_collection_batched(int socket, const struct sockaddr_in *destination, uint16_t num_packets, Packet *packets[],
+                                        uint32_t failed_packet_seq[PACKET_SIZE], uint16_t batch_size, RetransmitTimer *timer) {
+    memset(failed_packet_seq, 0, num_packets * sizeof(failed_packet_seq[0]));
+
+    uint16_t failed_packets = send_packet_batch_paced(socket, destination, num_packets, packets, failed_packet_seq, batch_size);
+
+    // Set packet timeout and return the number of failed packets
+    set_packet_timeout(timer);
+    return failed_packets;
+}
 
+/*
+ * The batching itself, without touching the timers so the sliding window can use it for whatever slice of the window it
+ * is sending. failed_packet_seq needs room for num_packets entries. The destination is the connection's, built once when it was set up.
+ */
+uint16_t send_packet_batch(int socket, const struct sockaddr_in *destination, uint16_t num_packets, Packet *packets[],
+                           uint32_t failed_packet_seq[], uint16_t batch_size) {
+    return send_packet_batch_at(socket, destination, num_packets, packets, failed_packet_seq, batch_size, NULL, NULL);
+}
 
-uint16_t send_packet_collection(int socket, uint16_t num_packets, Packet *packets[], uint16_t failed_packet_seq[PACKET_SIZE], uint16_t pid,uint32_t src_ip, uint32_t dest_ip) {
-    memset(failed_packet_seq, 0, PACKET_SIZE);
+/*
+ * Same again, but if departures_ns is given every packet carries an SCM_TXTIME with the CLOCK_MONOTONIC time it should leave at.
+ * That only means anything on a socket with SO_TXTIME turned on.
+ *
+ * A non blocking socket that is full (EAGAIN, or ENOBUFS from the device queue) is not a problem with any one packet, nothing after
+ * it would go out either. So we stop there. If attempted is given it gets how many packets we got through, sent or failed, and the
+ * rest are left for the caller to send again later. Without it they all count as failed, the way a blocking caller expects.
+ */
+uint16_t send_packet_batch_at(int socket, const struct sockaddr_in *destination, uint16_t num_packets, Packet *packets[],
+                              uint32_t failed_packet_seq[], uint16_t batch_size, const uint64_t departures_ns[],
+                              uint16_t *attempted) {
     int failed_packets = 0;
 
-    // Prepare destination address
-    struct sockaddr_in dest_addr;
-    memset(&dest_addr, 0, sizeof(dest_addr));
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_addr.s_addr = inet_addr("127.0.0.1"); // Set the destination IP address here
+    if (num_packets > MAX_PACKET_COLLECTION) {
+        return ERROR;
+    }
+
+    if (batch_size == 0) {
+        batch_size = SEND_BATCH_SIZE;
+    } else if (batch_size > MAX_SEND_BATCH_SIZE) {
+        batch_size = MAX_SEND_BATCH_SIZE;
+    }
+
+    struct mmsghdr messages[MAX_PACKET_COLLECTION];
+    memset(messages, 0, num_packets * sizeof(struct mmsghdr));
 
     for (int i = 0; i < num_packets; i++) {
-        struct msghdr msg_hdr;
-        memset(&msg_hdr, 0, sizeof(msg_hdr));
+        messages[i].msg_hdr.msg_name = (void *) destination;
+        messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        messages[i].msg_hdr.msg_iov = packets[i]->iov;
+        messages[i].msg_hdr.msg_iovlen = 3; // Number of iovs
+    }
+
+    static __thread char control[MAX_PACKET_COLLECTION][CMSG_SPACE(sizeof(uint64_t))];
+    for (int i = 0; departures_ns != NULL && i < num_packets; i++) {
+        messages[i].msg_hdr.msg_control = control[i];
+        messages[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&messages[i].msg_hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        memcpy(CMSG_DATA(cmsg), &departures_ns[i], sizeof(uint64_t));
+    }
+
+    int next = 0;
+    while (next < num_packets) {
+        unsigned int chunk = (num_packets - next) < batch_size ? (num_packets - next) : batch_size;
+
+        int sent = netsim_sendmmsg(socket, &messages[next], chunk, 0);
+
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+            break;
+        }
+
+        if (sent < 0) {
+            /*
+             * Nothing in this chunk went out, the error belongs to the first message so
+             * we mark that one and try again from the one after it.
+             */
+            LOG_WARN("sendmmsg: %s", strerror(errno));
+            sent = 0;
+        }
 
-        struct iphdr ip_hdr;
-        if (fill_ip_header(&ip_hdr, src_ip, dest_ip) != SUCCESS) {
-            fprintf(stderr, "Err filling ip hdr\n");
-            exit(EXIT_FAILURE);
+        uint64_t bytes_sent = 0;
+        for (int i = next; i < next + sent; i++) {
+            bytes_sent += messages[i].msg_len;
+            trace_record(TRACE_OUT, messages[i].msg_hdr.msg_iov, (int) messages[i].msg_hdr.msg_iovlen, messages[i].msg_len);
         }
-        // Set the destination address in the msghdr
-        msg_hdr.msg_name = &dest_addr;
-        msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
-        // Populate msghdr
-        msg_hdr.msg_iov = packets[i]->iov;
-        msg_hdr.msg_iovlen = 3; // Number of iovs
-        Header *head = packets[i]->iov[1].iov_base;
-
-        // Send the packet
-        if (sendmsg(socket, &msg_hdr, 0) == -1) {
-            perror("sendmsg");
-            failed_packets++;
+        STATS_ADD(packets_out, sent);
+        STATS_ADD(bytes_out, bytes_sent);
+
+        next += sent;
+
+        if (next < num_packets && (unsigned int) sent < chunk) {
             // Store the sequence number of the failed packet
-            failed_packet_seq[failed_packets - 1] = i;
+            Header *head = packets[next]->iov[1].iov_base;
+            failed_packet_seq[failed_packets++] = head->sequence;
+            next++;
         }
     }
 
-    // Set packet timeout and return the number of failed packets
-    set_packet_timeout();
+    if (attempted != NULL) {
+        *attempted = next;
+    } else {
+        for (; next < num_packets; next++) {
+            failed_packet_seq[failed_packets++] = ((Header *) packets[next]->iov[1].iov_base)->sequence;
+        }
+    }
     return failed_packets;
 }
 
+/*
+ * A packet of the collection has arrived intact. Its payload is copied into the connection's reassembly ring, so the application
+ * gets it now rather than once the collection is done, and all we keep is that its sequence is in so we can tell what is still missing.
+ * Returns ERROR if the ring had no room, the packet then counts as lost and gets NACKed like any other.
+ */
+static uint16_t collection_store(Connection *conn, uint8_t received[], Packet *packet) {
+    Header *head = packet->iov[1].iov_base;
+
+    if (received[head->sequence]) {
+        STATS_ADD(duplicates, 1);
+    }
+    if (reassembly_accept(conn->reassembly, head->sequence, head->packet_end, packet->iov[2].iov_base, head->msg_size) != SUCCESS) {
+        return ERROR;
+    }
+    received[head->sequence] = 1;
+    return SUCCESS;
+}
+
+/*
+ * The collection is all in and ACKed, whatever turns up for it from now on is a straggler.
+ */
+static void collection_complete(Connection *conn, uint16_t collection_end) {
+    conn->last_collection_end = collection_end;
+    conn->receive_collection++;
+}
+
 /*
  * This function will be a packet receiver. I may run this in a separate thread or process but I am not sure yet.
- *It will fill the list of packets passed to it and will also handle the different types of header status' that may come up.
+ *It will mark off the sequences it gets in received and will also handle the different types of header status' that may come up.
  * Example, should it find an ACK, the timer will be reset, should it find a corruption or a resend, it will add that packet sequence to the passed list.
  * Should it find a close, it will close the socket and return etc.
  *
- * We will handle each packet type here. If Packet type is OOB we will immediately send a sigint signal. This will exit immediately and go to our
- * interrupt handler which will be used to process the oob data separately.
+ * We will handle each packet type here. If Packet type is OOB we stash the byte on the connection and return straight away so the
+ * connection handler can deal with it before anything else, there is no more SIGINT handler and no more global for it.
  *
  * If CLOSE, we will close the socket and reset the timeout.
  *
@@ -748,187 +899,279 @@ uint16_t send_packet_collection(int socket, uint16_t num_packets, Packet *packet
  *
  * On ACK we'll return so the server can respond to packet group
  *
- * On DATA or SECOND_SEND we will verify the checksum and if good, add to the array
+ * On DATA or SECOND_SEND we will verify the checksum and if good, copy the payload into conn->reassembly and mark it received
  * if not good, send a corruption notice and continue
  *
+ * Only data for the collection we are on (conn->receive_collection) is taken. A packet from the one we just finished means the peer
+ * never got our ACK, it is resending the last packet on its timeout or filling gaps from a NACK that crossed the ACK, so it gets the
+ * ACK again. Anything the peer tells us about a collection other than the one we last sent is stale and ignored.
  *
+ * The connection has to have a reassembly ring, it is the only place the data goes. Nothing we keep points into the receive ring,
+ * so every slot is handed back before we wait for more. A collection can take as many datagrams as it likes (resends, duplicates,
+ * traffic for other processes) without running the ring out of slots.
  */
 
-uint16_t receive_data_packets(Packet *receiving_packet_list[], int socket, uint16_t *packets_to_resend, uint32_t src_ip,uint32_t dst_ip, uint16_t pid,uint16_t *status) {
-   // memset(packets_to_resend, 0, MAX_PACKET_COLLECTION);
-    int i = 0;
-   // memset(receiving_packet_list, 0, MAX_PACKET_COLLECTION);
-    struct msghdr msg;
-    struct iovec iov[3];
-
-    iov[0].iov_base = malloc(PACKET_SIZE + 20);
-    iov[0].iov_len = PACKET_SIZE + 20;
-
-    msg.msg_name = NULL;
-    msg.msg_namelen = 0;
-    msg.msg_iov = iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = malloc(128);
-    msg.msg_controllen = 128;
-    msg.msg_flags = 0;
-
-
+uint16_t receive_data_packets(Connection *conn, ReceiveRing *ring, uint8_t received[], uint16_t *packets_to_resend,
+                              uint16_t *status) {
 
+    /*
+     * Datagrams come out of the receive ring already parsed in place, the packet's io vectors point straight
+     * into the ring slot so there is nothing to allocate or copy. The slot goes back to the ring once we have looked at it.
+     */
     struct iphdr *ip_hdr;
     Header *head;
+    Packet *packet;
+    uint32_t bytes_received;
     uint16_t return_value = SUCCESS;
     int bad_packets = 0;
     int packets_received = 0;
-    ssize_t bytes_received = 1;
+    //How many gaps the NACK we sent still has open, and the last sequence of the collection they are in
+    uint16_t missing = 0;
+    uint16_t collection_end = 0;
 
+    if (conn->reassembly == NULL) {
+        return ERROR;
+    }
 
     while (true) {
-        bytes_received = recvmsg(socket, &msg, 0);
-
-        if(bytes_received == 0){
-            break;
-        }
-        if (bytes_received < 0) {
-            perror("recvmsg");
-            exit(EXIT_FAILURE);
-        }
-        if (msg.msg_iovlen > PACKET_SIZE) {
+        receive_ring_release_consumed(ring);
+        uint16_t waited = wait_for_packets(ring, conn->socket, conn->retransmit_timer.wheel, &conn->retransmit_timer);
+
+        /*
+         * Resends get lost too. If the gaps are still open a whole RTO after the NACK went out, NACK whatever is still missing,
+         * the timer backs off every time and after MAX_RETRANSMITS we give up on the connection.
+         */
+        if (waited == TIMED_OUT) {
+            if (missing > 0) {
+                return_value = handle_ack(conn, received, collection_end);
+                if (return_value == ERROR) {
+                    return ERROR;
+                }
+                if (return_value == SUCCESS) {
+                    reset_timeout(&conn->retransmit_timer);
+                    collection_complete(conn, collection_end);
+                    *status = SENT_ACK;
+                    return collection_end;
+                }
+                missing = return_value;
+            }
             continue;
         }
+        if (waited != SUCCESS) {
+            return ERROR;
+        }
+        packet = receive_ring_next(ring, conn->socket, &bytes_received);
 
+        if (packet == NULL) {
+            return ERROR;
+        }
 
-        allocate_packet(&receiving_packet_list[packets_received]);
-
-        memcpy(receiving_packet_list[packets_received]->iov[0].iov_base, (struct iphdr *) &msg.msg_iov->iov_base[20],sizeof(struct iphdr));
-        memcpy(receiving_packet_list[packets_received]->iov[1].iov_base, &msg.msg_iov->iov_base[40], HEADER_SIZE);
-        memcpy(receiving_packet_list[packets_received]->iov[2].iov_base, &msg.msg_iov->iov_base[52], PAYLOAD_SIZE);
+        if (bytes_received < KERNEL_IP_HEADER_SIZE + sizeof(struct iphdr) + HEADER_SIZE) {
+            //Too short to even hold our headers, nothing we can do with it
+            continue;
+        }
 
-        head = receiving_packet_list[packets_received]->iov[1].iov_base;
-        ip_hdr = (struct iphdr *) receiving_packet_list[packets_received]->iov[0].iov_base;
+        head = packet->iov[1].iov_base;
+        ip_hdr = (struct iphdr *) packet->iov[0].iov_base;
+        char *data = packet->iov[2].iov_base;
 
-        char buff[head->msg_size];
-        if(head->status == DATA || head->status == SECOND_SEND){
-            memset(buff,0,head->msg_size);
-            memcpy(&buff, receiving_packet_list[packets_received]->iov[2].iov_base, head->msg_size);
-            write(1,&buff,head->msg_size);
+        if (head->msg_size > packet->iov[2].iov_len) {
+            //Claims more payload than actually arrived
+            continue;
         }
 
 
 
 
-        if (ip_hdr->saddr != dst_ip) {
+        if (ip_hdr->saddr != conn->peer_ip) {
             /*
              * This is for another IP address, not ours
              */
             continue;
         }
 
-        if (head->dest_process_id != SERVER_PID) {
+        if (head->dest_process_id != conn->local_pid) {
             /*
              * This is for another process, continue the loop
              */
             continue;
         }
+        STATS_ADD(packets_in, 1);
+        STATS_ADD(bytes_in, bytes_received);
+        trace_record(TRACE_IN, packet->iov, 3, bytes_received - KERNEL_IP_HEADER_SIZE);
+
+        if (!header_version_supported(head->version)) {
+            //Laid out some way we can't read, nothing in it can be trusted
+            continue;
+        }
+        connection_negotiate(conn, head);
 
 
         if(compare_ip_checksum(ip_hdr) == -1){
-            if (send_resend(socket,head->sequence,src_ip,dst_ip, pid) != SUCCESS){
-                fprintf(stderr,"IP header corrupt, error sending resend request\n");
+            STATS_ADD(ip_checksum_failures, 1);
+            LOG_DEBUG("IP checksum mismatch, check %u", ip_hdr->check);
+            if (send_resend(conn, head->sequence) != SUCCESS){
+                LOG_WARN("IP header corrupt, error sending resend request");
             }
             continue;
         }
-        if(head->msg_size == PAYLOAD_SIZE){
-            printf("\n%d sequence\n",head->sequence);
-        }else{
-
-            printf("%d sequence\n",head->sequence);
+        LOG_TRACE("%u sequence, status %u, %u bytes", head->sequence, head->status, head->msg_size);
 
+        if ((head->status == DATA || head->status == SECOND_SEND) && head->collection != conn->receive_collection) {
+            STATS_ADD(duplicates, 1);
+            if (head->collection == conn->receive_collection - 1 &&
+                (head->status == SECOND_SEND || head->sequence == head->packet_end)) {
+                send_collection_ack(conn, head->collection, conn->last_collection_end);
+            }
+            continue;
+        }
+        if ((head->status == ACKNOWLEDGE || head->status == NACK || head->status == RESEND || head->status == CORRUPTION) &&
+            head->collection != conn->send_collection - 1) {
+            continue;
         }
-        fflush(stdout);
 
-        char data[head->msg_size];
-        memcpy(data,&buff,head->msg_size);
+        /*
+         * The header isn't covered by any checksum, so sequence and packet_end get checked before either one is used to index
+         * the collection. Once we know where the collection ends (we have NACKed it) a packet claiming some other end is not
+         * one of ours, handle_ack() only ever gets the end we recorded.
+         */
+        if ((head->status == DATA || head->status == SECOND_SEND) &&
+            (head->sequence >= MAX_PACKET_COLLECTION || head->packet_end >= MAX_PACKET_COLLECTION ||
+             (missing > 0 && head->packet_end != collection_end))) {
+            continue;
+        }
 
-        if ((head->status == DATA || head->status == SECOND_SEND) && (head->packet_end == head->sequence)){
-            if(bad_packets > 0){
+        /*
+         * The last packet of the collection, or once we have NACKed some gaps, one of the resends filling them in.
+         * handle_ack() sends one NACK covering every gap, after that we only look again once every gap has been filled,
+         * so the resends don't each set off another NACK.
+         * A packet that showed up corrupted was never stored, so it is just one more gap. We used to hold off on the last packet
+         * while there were any, but nothing ever counted them back down, so one flipped byte left the collection hanging for good.
+         */
+        if ((head->status == DATA || head->status == SECOND_SEND) && (head->packet_end == head->sequence || missing > 0)){
+            if (compare_checksum(head->checksum_type, data, head->msg_size, head->checksum) != SUCCESS) {
+                bad_packets++;
+                handle_corruption(conn, head->sequence);
                 continue;
-            } else{
-                return_value = handle_ack(socket, receiving_packet_list,packets_received, src_ip, dst_ip,pid);
-                if(return_value!= SUCCESS){
-                    return ERROR;
+            }
+            if (missing > 0) {
+                if (received[head->sequence]) {
+                    STATS_ADD(duplicates, 1);
+                    /*
+                     * The last packet again is the sender's probe, it has gone a whole RTO without hearing from us. Our NACK or
+                     * the resends it asked for went missing, so the gaps that are still open get NACKed again now. There are still
+                     * gaps, so all handle_ack() can do is NACK them and tell us how many.
+                     */
+                    if (head->sequence == collection_end) {
+                        missing = handle_ack(conn, received, collection_end);
+                        set_packet_timeout(&conn->retransmit_timer);
+                    }
+                    continue;
                 }
-                *status = SENT_ACK;
-                return packets_received;
+                if (collection_store(conn, received, packet) != SUCCESS) {
+                    continue;
+                }
+                if (--missing > 0) {
+                    continue;
+                }
+            } else if (collection_store(conn, received, packet) != SUCCESS) {
+                continue;
+            } else {
+                collection_end = head->packet_end;
             }
-        } else {
+
+            return_value = handle_ack(conn, received, collection_end);
             if (return_value == ERROR) {
                 return ERROR;
             }
+            if (return_value != SUCCESS) {
+                missing = return_value;
+                set_packet_timeout(&conn->retransmit_timer);
+                continue;
+            }
+            reset_timeout(&conn->retransmit_timer);
+            collection_complete(conn, collection_end);
+            *status = SENT_ACK;
+            return collection_end;
+        } else {
 
             switch (head->status) {
                 /*
-                 * We'll send an interrupt signal when OOB data is discovered
+                 * OOB data jumps the queue, we hand it straight back to the connection handler
                  */
                 case OOB:
-                    write(1,"OOB\n",4);
-                    oob_data = data[0];
-                    raise(SIGINT);
+                    LOG_TRACE("OOB");
+                    conn->oob_data = data[0];
                     *status = OOB;
                     break;
 
                 case CLOSE:
-                    write(1,"CLOSE\n",6);
-                    close(socket);
-                    reset_timeout();
+                    LOG_TRACE("CLOSE");
+                    reset_timeout(&conn->retransmit_timer);
                     *status = CLOSE;
                     break;
 
                 case CORRUPTION :
-                    write(1,"CORRUPTION\n",11);
-                    packets_to_resend[++bad_packets] = head->sequence;
-                    bad_packets++;
+                    LOG_TRACE("CORRUPTION %u", head->sequence);
+                    if (bad_packets < MAX_PACKET_COLLECTION) {
+                        packets_to_resend[bad_packets++] = head->sequence;
+                    }
                     break;
 
 
                 case RESEND :
-                    write(1,"RESENDREQ\n",10);
-                    packets_to_resend[++bad_packets] = head->sequence;
-                    bad_packets++;
+                    LOG_TRACE("RESEND request %u", head->sequence);
+                    if (bad_packets < MAX_PACKET_COLLECTION) {
+                        packets_to_resend[bad_packets++] = head->sequence;
+                    }
                     break;
 
+                /*
+                 * Every sequence the ranges cover goes on the resend list, send_missing_packets() can take the ranges as they are
+                 * if you would rather have them that way, see read_nack_ranges()
+                 */
+                case NACK : {
+                    LOG_TRACE("NACK");
+                    NackRange ranges[MAX_NACK_RANGES];
+                    uint16_t num_ranges = read_nack_ranges(packet, ranges, MAX_NACK_RANGES);
+                    if (num_ranges == ERROR) {
+                        break;
+                    }
+                    for (uint16_t r = 0; r < num_ranges; r++) {
+                        for (uint32_t i = 0; i < ranges[r].length && bad_packets < MAX_PACKET_COLLECTION; i++) {
+                            packets_to_resend[bad_packets++] = ranges[r].start + i;
+                        }
+                    }
+                    break;
+                }
+
 
                 case ACKNOWLEDGE:
-                    write(1,"ACK\n",4);
-                    reset_timeout();
+                    LOG_TRACE("ACK");
+                    reset_timeout(&conn->retransmit_timer);
+                    conn->peer_collection_window = head->window;
                     *status = RECEIVED_ACK;
                     break;
 
 
                 case SECOND_SEND :
-                    write(1,"RESEND\n",7);
-                    if (compare_checksum(data, head->msg_size, head->checksum) != SUCCESS) {
+                    LOG_TRACE("RESEND %u", head->sequence);
+                    if (compare_checksum(head->checksum_type, data, head->msg_size, head->checksum) != SUCCESS) {
                         bad_packets++;
-                        memset(&receiving_packet_list[head->sequence], 0, sizeof(Packet));
-                        handle_corruption(socket, src_ip, dst_ip, head->sequence, pid);
+                        received[head->sequence] = 0;
+                        handle_corruption(conn, head->sequence);
                     } else {
-                        receiving_packet_list[head->sequence]->iov[2].iov_base = buff;
+                        collection_store(conn, received, packet);
                     }
                     break;
 
                 case DATA:
-                    if (compare_checksum(data, head->msg_size, head->checksum) != SUCCESS) {
-                        memset(&receiving_packet_list[head->sequence], 0, sizeof(Packet));
+                    if (compare_checksum(head->checksum_type, data, head->msg_size, head->checksum) != SUCCESS) {
+                        received[head->sequence] = 0;
                         bad_packets++;
-                        handle_corruption(socket, src_ip, dst_ip, head->sequence, pid);
+                        handle_corruption(conn, head->sequence);
                     } else {
-                        if(receiving_packet_list[head->sequence] == NULL){
-                            allocate_packet(&receiving_packet_list[head->sequence]);
-                       }
-                        if(receiving_packet_list[head->sequence] == NULL){
-                            allocate_packet(&receiving_packet_list[head->sequence]);
-                        }
-                        memcpy(receiving_packet_list[head->sequence]->iov[2].iov_base,buff,head->msg_size - 1);
-                      //  receiving_packet_list[head->sequence]->iov[2].iov_base = buff;
+                        collection_store(conn, received, packet);
                     }
                     break;
 
@@ -944,19 +1187,8 @@ uint16_t receive_data_packets(Packet *receiving_packet_list[], int socket, uint1
 
 }
 
-/*
- * When OOB data is handled, we want to send an interrupt which will then immediately go to this handler and start processing the OOB data.
- * I'll just keep this one check for now I will decide what I want to do with this later.
- */
-void sig_int_handler() {
-
-    write(1, "SIGINT OOB", 10);
-    if (oob_data == 'd') {
-        exit(EXIT_SUCCESS);
-    } else {
-        exit(EXIT_FAILURE);
-    }
-
+static void collection_deliver_to_stdout(const char *data, size_t length, void *context) {
+    write(1, data, length);
 }
 
 /*
@@ -974,20 +1206,51 @@ void sig_int_handler() {
  */
 
 void handle_client_connection(int socket, uint32_t src_ip, uint32_t dest_ip, uint16_t pid) {
-    Packet *packets[MAX_PACKET_COLLECTION];
-    Packet *received_packets[MAX_PACKET_COLLECTION];
+    //Which sequences of the collection we have so far, the data itself is in the reassembly ring
+    uint8_t received[MAX_PACKET_COLLECTION];
+    memset(received, 0, sizeof(received));
 
-    signal(SIGINT, sig_int_handler);
-    signal(SIGALRM, sigalrm_handler);
+    /*
+     * Received datagrams land in here and get parsed in place, receive_data_packets() hands each slot back once it has looked at it.
+     */
+    ReceiveRing ring;
+    if (receive_ring_init(&ring, RECEIVE_RING_SLOTS, RECEIVE_BATCH_SIZE, 0, PAYLOAD_SIZE) != SUCCESS) {
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * Retransmission timing for this connection, no more SIGALRM
+     */
+    TimerWheel wheel;
+    if (timer_wheel_init(&wheel) != SUCCESS) {
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * Everything that belongs to the one peer we are talking to. Every packet we receive or send on this connection comes out of
+     * its pool and goes back in there once we are done with the collection.
+     */
+    Connection conn;
+    if (connection_init(&conn, socket, src_ip, SERVER_PID, dest_ip, pid, &wheel, DEFAULT_WINDOW_SIZE, PACKET_POOL_INITIAL_BLOCKS,
+                        collection_timeout_handler) != SUCCESS) {
+        exit(EXIT_FAILURE);
+    }
 
     uint16_t status = 0;
 
 
-    char *msg_buff = malloc(512000);
-    if(msg_buff == NULL){
-        perror("malloc");
+    /*
+     * Data is written out as it arrives in order, not once the whole collection is in, and the ring's free slots are what we
+     * tell the peer it can send next.
+     */
+    ReassemblyRing reassembly;
+    if (reassembly_init(&reassembly, REASSEMBLY_DEFAULT_SLOTS, collection_deliver_to_stdout, NULL) != SUCCESS) {
         exit(EXIT_FAILURE);
     }
+    conn.reassembly = &reassembly;
+    //The ring puts packet s of a collection s * PAYLOAD_SIZE bytes in, so we only take PAYLOAD_SIZE packets
+    conn.max_payload = PAYLOAD_SIZE;
+    uint64_t message_start = 0;
 
     uint16_t failed_packet_seq[MAX_PACKET_COLLECTION];
     uint16_t failed_packets;
@@ -997,57 +1260,65 @@ void handle_client_connection(int socket, uint32_t src_ip, uint32_t dest_ip, uin
         // Receive echoed message
 
         memset(&failed_packet_seq, 0, MAX_PACKET_COLLECTION);
-        uint16_t packets_received = receive_data_packets(received_packets, socket, failed_packet_seq, src_ip,dest_ip, pid,&status);
+        uint16_t packets_received = receive_data_packets(&conn, &ring, received, failed_packet_seq, &status);
         if (packets_received == ERROR) {
             fprintf(stderr, "Error occurred while receiving packets.\n");
+            trace_dump_on_error("Collection receive failed");
             goto cleanup;
         }
 
-        fflush(stdout);
-
-        if(status != SENT_ACK){
-            continue;
+        if(status == CLOSE){
+            LOG_INFO("Client closed connection");
+            goto cleanup;
         }
 
-
-        if(status == CLOSE){
-            printf("Client closed connection\n");
-            fflush(stdout);
+        /*
+         * Whatever the peer sent out of band ends the connection, 'd' means it is done with us and everything is fine
+         */
+        if(status == OOB){
+            LOG_INFO("Out of band data received : %c", conn.oob_data);
             goto cleanup;
         }
 
-        if (dump_packet_collection_payload_into_buffer(received_packets, &msg_buff, 512000, packets_received) == NO_BUFFER_SPACE){
-            fprintf(stderr,"Error dumping packets into data buffer, not enough buffer space\n");
+        if(status != SENT_ACK){
+            memset(received, 0, sizeof(received));
+            continue;
         }
-        msg_buff[strlen(msg_buff)] = '\0';
-        fprintf(stdout, "Length : %zu ,Full Message: %s\n", strlen(msg_buff),msg_buff);
-        fflush(stdout);
-        memset(msg_buff,0,512000);
+
+        LOG_DEBUG("Length : %lu", reassembly.bytes_ready - message_start);
+        message_start = reassembly.bytes_ready;
+        connection_publish_stats(&conn);
 
 /*
         // Echo the received message back to the client
-        failed_packets = send_packet_collection(socket, packets_received, received_packets, failed_packet_seq,pid,src_ip,dest_ip);
+        failed_packets = send_packet_collection(socket, packets_received, received_packets, failed_packet_seq,pid,src_ip,dest_ip,&conn.retransmit_timer);
         if (failed_packets != SUCCESS) {
             fprintf(stderr, "Error occurred while sending echoed packets.\n");
             goto cleanup;
         }
         */
 
+        memset(received, 0, sizeof(received));
+
     }
 
 
     cleanup:
-    for(int i=0;i < MAX_PACKET_COLLECTION;i++){
-        free(packets[i]);
-    }
     if(status != CLOSE){
-        if (handle_close(socket, src_ip, dest_ip, pid) != SUCCESS) {
+        if (handle_close(&conn) != SUCCESS) {
             fprintf(stderr, "Error occurred while handling connection close.\n");
         }
     }
 
+    reassembly_destroy(&reassembly);
+    connection_release(&conn);
+    timer_wheel_destroy(&wheel);
+    receive_ring_destroy(&ring);
     close(socket);
 
+    if (status == OOB && conn.oob_data != 'd') {
+        exit(EXIT_FAILURE);
+    }
     exit(EXIT_SUCCESS);
 
 }
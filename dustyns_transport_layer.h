@@ -20,10 +20,20 @@
 #define UNIXCUSTOMTRANSPORTLAYER_DUSTYNS_TRANSPORT_LAYER_H
 
 #define BACKLOG 15
+/*
+ * PAYLOAD_SIZE is the payload every peer can take, packets are this size until the peer tells us it can take more (see
+ * Header.max_payload). Control packets and the packet pool's own blocks are sized off it. A datagram can't be more than 64KB
+ * with every header in it, kernel ip header included, which is where MAX_PAYLOAD_SIZE comes from.
+ */
 #define PAYLOAD_SIZE 512
-#define HEADER_SIZE 12
-#define PACKET_SIZE ((sizeof (struct iphdr) + HEADER_SIZE + PAYLOAD_SIZE))
+#define MAX_DATAGRAM_SIZE 65535
+#define HEADER_SIZE (sizeof (Header))
+#define PACKET_LENGTH(payload_length) (sizeof (struct iphdr) + HEADER_SIZE + (payload_length))
+#define PACKET_SIZE PACKET_LENGTH(PAYLOAD_SIZE)
+#define MAX_PAYLOAD_SIZE (MAX_DATAGRAM_SIZE - 2 * sizeof (struct iphdr) - HEADER_SIZE)
 #define MAX_PACKET_COLLECTION 1000
+#define SEND_BATCH_SIZE 64
+#define MAX_SEND_BATCH_SIZE 1024
 #define OUT_OF_BAND_DATA_SIZE 1
 #define DATA 1
 #define ACKNOWLEDGE 2
@@ -32,12 +42,13 @@
 #define CLOSE 5
 #define OOB 6
 #define SECOND_SEND 7
+#define NACK 8
+#define HEADER_FLAG_ACK 0x01
 #define NO_BUFFER_SPACE 50000
-#define INITIAL_TIMEOUT 15
-#define MAX_TIMEOUT 160
 #define SUCCESS 0
 #define RECEIVED_ACK 6969
 #define SENT_ACK 6060
+#define TIMED_OUT 7070
 //This because they're all unsigned 16 bits,
 // so this makes more sense than using 1 since if 1 packet was missing, for example, it would also return 1.
 // 65536 would never come up so this makes more sense as the error code.
@@ -45,66 +56,171 @@
 
 #define SERVER_PID 1000
 
+/*
+ * Version 1 was the original header with 16 bit sequence numbers, which capped a sliding window message at 65535 packets and had
+ * no version field at all. Version 2 has 32 bit sequence numbers. Version 3 numbers collections, without that a late resend from one
+ * collection looked just like a packet of the next. Every packet carries the version it was built with and each side
+ * speaks the lowest version either of them has sent, anything outside HEADER_VERSION_MIN ... HEADER_VERSION is dropped.
+ */
+#define HEADER_VERSION 3
+#define HEADER_VERSION_MIN 3
+
 
 typedef struct Packet {
     struct iovec iov[3];
 } Packet;
 
+typedef struct PacketPool PacketPool;
+
+typedef struct ReceiveRing ReceiveRing;
+
+typedef struct PinnedBuffer PinnedBuffer;
+
+typedef struct Timer Timer;
+
+typedef struct RetransmitTimer RetransmitTimer;
+
+typedef struct TimerWheel TimerWheel;
+
+typedef struct Connection Connection;
+
+typedef struct ReassemblyRing ReassemblyRing;
+
 
 typedef struct Header {
+    /*
+     * Which header layout the packet was built with. It stays the first byte whatever else changes, so a packet
+     * from a peer speaking some other version can always be recognised and dropped rather than misread.
+     */
+    uint8_t version;
+    /*
+     * Which algorithm the payload checksum was made with, see checksum.h
+     */
+    uint8_t checksum_type;
     uint16_t status;
-    uint16_t checksum;
-    uint16_t sequence;
+    uint32_t checksum;
+    /*
+     * Sequence numbers are 32 bits and wrap, only ever compare them by their difference (see
+     * sequence_distance() in sliding_window.c), never with < or >.
+     */
+    uint32_t sequence;
+    /*
+     * This will mark the last packet in the stream, it will let us know when to stop processing this set of packets.
+     */
+    uint32_t packet_end;
+    /*
+     * Collection mode only. Which collection the packet belongs to, each side numbers the collections it sends from 0 and sequence
+     * and packet_end count from the start of it. An ACK, NACK, RESEND or CORRUPTION carries the number of the collection it is about.
+     */
+    uint32_t collection;
+    /*
+     * Used by sliding window mode, ack is the next sequence the receiver is waiting on (everything before it has arrived)
+     * and bit i of sack_bitmap is set if sequence ack + 1 + i has arrived out of order.
+     */
+    uint32_t ack;
+    uint32_t sack_bitmap;
     uint16_t msg_size;
     uint16_t dest_process_id;
     /*
-     * This will mark the last packet in the stream, it will let us know when to stop processing this set of packets.
+     * The process id this packet was sent from, replies go back to it. Together with the source address it tells
+     * one peer apart from another when a single socket is serving many of them.
+     */
+    uint16_t source_process_id;
+    /*
+     * Flow control, carried on every ACK. In sliding window mode it is how many packets from ack onwards the receiver has room for,
+     * in collection mode how many packets the next collection can have. The sender never goes past it.
+     */
+    uint16_t window;
+    /*
+     * HEADER_FLAG_ACK on a DATA packet means ack and sack_bitmap are an acknowledgement riding along with the data,
+     * read them exactly like a standalone ACKNOWLEDGE.
+     */
+    uint8_t flags;
+    /*
+     * The biggest payload whoever sent this packet can take, so the other side never builds anything bigger. 0 means they didn't
+     * say, which only leaves PAYLOAD_SIZE.
      */
-    uint16_t packet_end;
+    uint16_t max_payload;
 
 } Header;
 
-uint16_t handle_ack(int socket, Packet **packets,uint16_t num_packets, uint32_t src_ip, uint32_t dest_ip, uint16_t pid);
-uint16_t allocate_packet(Packet **packet_ptr);
+/*
+ * A NACK's payload is a list of these, each one a run of missing sequences start, start + 1 ... start + length - 1.
+ * A burst of losses costs one range instead of one RESEND datagram per packet.
+ */
+typedef struct NackRange {
+    uint16_t start;
+    uint16_t length;
+} NackRange;
+
+#define MAX_NACK_RANGES (PAYLOAD_SIZE / sizeof(NackRange))
+
+uint8_t header_version_supported(uint8_t version);
 
-uint16_t free_packet(Packet **packet);
+uint16_t handle_ack(Connection *conn, const uint8_t received[], uint16_t collection_end);
 
-uint8_t compare_checksum(char data[], size_t length, uint16_t received_checksum);
+uint16_t allocate_packet(PacketPool *pool, Packet **packet_ptr);
 
-uint16_t calculate_checksum(char data[], size_t length);
+uint16_t free_packet(PacketPool *pool, Packet **packet);
+
+uint16_t compare_checksum(uint16_t checksum_type, const char data[], size_t length, uint32_t received_checksum);
+
+uint32_t calculate_checksum(uint16_t checksum_type, const char data[], size_t length);
 
 void handle_client_connection(int socket, uint32_t src_ip, uint32_t dest_ip, uint16_t pid);
 
-uint16_t send_resend(int socket, uint16_t sequence, uint32_t src_ip, uint32_t dst_ip, uint16_t pid);
+uint16_t send_resend(Connection *conn, uint16_t sequence);
+
+uint16_t send_ack(Connection *conn, uint16_t max_sequence);
+
+uint16_t send_selective_ack(Connection *conn, uint32_t ack, uint32_t sack_bitmap);
+
+uint16_t handle_close(Connection *conn);
 
-uint16_t send_ack(int socket, uint16_t max_sequence, uint32_t src, uint32_t dest, uint16_t pid);
+uint16_t handle_corruption(Connection *conn, uint16_t sequence);
 
-uint16_t handle_close(int socket, uint32_t src_ip, uint32_t dst_ip, uint16_t pid);
+uint16_t send_nack(Connection *conn, const NackRange ranges[], uint16_t num_ranges);
 
-void sig_int_handler();
+uint16_t read_nack_ranges(const Packet *packet, NackRange ranges[], uint16_t max_ranges);
 
-uint16_t handle_corruption(int socket, uint32_t src_ip, uint32_t dst_ip, uint16_t sequence, uint16_t pid);
+uint16_t send_missing_packets(Connection *conn, const NackRange ranges[], uint16_t num_ranges, Packet *packet_collection[],
+                              uint16_t num_packets);
 
-uint16_t set_packet_timeout();
+uint16_t set_packet_timeout(RetransmitTimer *timer);
 
-void reset_timeout();
+void reset_timeout(RetransmitTimer *timer);
 
-uint16_t
-packetize_data(Packet *packet[], char data_buff[], uint16_t packet_array_len, uint32_t src_ip, uint32_t dest_ip,uint16_t pid);
+void collection_timeout_handler(Timer *timer, void *context);
+
+uint16_t wait_for_packets(ReceiveRing *ring, int socket, TimerWheel *wheel, RetransmitTimer *timer);
+
+uint16_t packetize_data(Connection *conn, Packet *packet[], PinnedBuffer *buffer, uint16_t packet_array_len);
 
 void get_transport_packet_host_ready(struct iovec iov[3]);
 
 void get_transport_packet_wire_ready(struct iovec iov[3]);
 
-uint16_t send_oob_data(int socket, char oob_char, uint32_t src_ip, uint32_t dst_ip, uint16_t pid);
+uint16_t send_oob_data(Connection *conn, char oob_char);
+
+uint16_t receive_data_packets(Connection *conn, ReceiveRing *ring, uint8_t received[], uint16_t *packets_to_resend,
+                              uint16_t *status);
+
+uint16_t send_packet_collection(int socket, uint16_t num_packets, Packet *packets[], uint32_t failed_packet_seq[PACKET_SIZE],uint16_t pid, uint32_t src_ip, uint32_t dest_ip,
+                                RetransmitTimer *timer);
+
+uint16_t send_packet_batch(int socket, const struct sockaddr_in *destination, uint16_t num_packets, Packet *packets[],
+                           uint32_t failed_packet_seq[], uint16_t batch_size);
 
-uint16_t receive_data_packets(Packet *receiving_packet_list[], int socket, uint16_t *packets_to_resend, uint32_t src_ip,uint32_t dst_ip, uint16_t pid,uint16_t *status);
+uint16_t send_packet_batch_at(int socket, const struct sockaddr_in *destination, uint16_t num_packets, Packet *packets[],
+                              uint32_t failed_packet_seq[], uint16_t batch_size, const uint64_t departures_ns[],
+                              uint16_t *attempted);
 
-uint16_t send_packet_collection(int socket, uint16_t num_packets, Packet *packets[], uint16_t failed_packet_seq[PACKET_SIZE],uint16_t pid, uint32_t src_ip, uint32_t dest_ip);
+uint16_t send_packet_collection_batched(int socket, const struct sockaddr_in *destination, uint16_t num_packets, Packet *packets[],
+                                        uint32_t failed_packet_seq[PACKET_SIZE], uint16_t batch_size, RetransmitTimer *timer);
 
 uint16_t missing_packets(int socket, uint16_t sequence, uint32_t src_ip, uint32_t dst_ip, uint16_t pid);
 
-void sigalrm_handler();
+void release_packet_collection(PacketPool *pool, Packet *packets[], uint16_t packet_array_len);
 
 uint16_t dump_packet_collection_payload_into_buffer(Packet *packet[], char *data_buff[], uint64_t buff_size,
                                                     uint16_t packet_array_len);
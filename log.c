@@ -0,0 +1,243 @@
+//
+// Created by dustyn on 7/30/24.
+//
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include "log.h"
+#include "dustyns_transport_layer.h"
+#include "timer_wheel.h"
+
+/*
+ * Everything we had to say used to go straight to stdout with printf() and write(), a sequence number, "ACK", "NACK" and a
+ * fflush() for every packet. That is two or three syscalls per datagram before we have done any actual work, and in collection
+ * mode it went into the same stdout as the data we were delivering.
+ *
+ * Now messages have a level. Anything under LOG_COMPILE_LEVEL is not in the binary at all, anything under log_level costs a compare.
+ * What is left gets formatted into a slot of a ring and a background thread writes the ring out to stderr (or whatever log_start()
+ * was given) in big chunks, so the thread that logged never does any I/O. Many threads put messages in and only the writer takes
+ * them out, each slot carries a sequence number saying whose turn it is, so nobody takes a lock and a full ring just drops.
+ *
+ * Before log_start() and after log_stop() there is no writer, messages are written out right there instead. That keeps tools that
+ * never start it working, they only log what they are asked to.
+ */
+
+typedef struct LogRecord {
+    uint64_t sequence;
+    uint64_t time_us;
+    const char *file;
+    uint32_t line;
+    uint32_t thread;
+    uint8_t level;
+    char message[LOG_MESSAGE_SIZE];
+} LogRecord;
+
+static const char *level_names[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR", "OFF"};
+
+uint8_t log_level = LOG_DEFAULT_LEVEL;
+
+static LogRecord ring[LOG_RING_SLOTS];
+static uint64_t ring_tail;
+static uint64_t ring_head;
+static uint64_t dropped;
+static uint8_t running;
+static int log_fd = STDERR_FILENO;
+static pthread_t writer;
+
+static uint32_t log_thread_id() {
+    static __thread uint32_t thread_id;
+    if (thread_id == 0) {
+        thread_id = (uint32_t) syscall(SYS_gettid);
+    }
+    return thread_id;
+}
+
+/*
+ * One line, "seconds.micros LEVEL [thread] file:line message"
+ */
+static size_t log_format(char *line, size_t size, const LogRecord *record) {
+    int length = snprintf(line, size, "%lu.%06lu %-5s [%u] %s:%u %s\n", record->time_us / 1000000, record->time_us % 1000000,
+                          level_names[record->level], record->thread, record->file, record->line, record->message);
+    if (length < 0) {
+        return 0;
+    }
+    //Cut short, still end the line
+    if ((size_t) length >= size) {
+        line[size - 2] = '\n';
+        return size - 1;
+    }
+    return (size_t) length;
+}
+
+static void log_write_all(const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(log_fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+void log_write(uint8_t level, const char *file, uint32_t line, const char *format, ...) {
+    va_list arguments;
+
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        LogRecord record = {.time_us = monotonic_us(), .file = file, .line = line, .thread = log_thread_id(), .level = level};
+        char text[LOG_MESSAGE_SIZE + 128];
+        va_start(arguments, format);
+        vsnprintf(record.message, sizeof(record.message), format, arguments);
+        va_end(arguments);
+        log_write_all(text, log_format(text, sizeof(text), &record));
+        return;
+    }
+
+    /*
+     * Claim the slot at the tail. It is ours to fill once its sequence has come round to the tail, if it is still behind then
+     * the writer hasn't got to it yet and the ring is full.
+     */
+    uint64_t position = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    LogRecord *record;
+    while (true) {
+        record = &ring[position & LOG_RING_MASK];
+        int64_t difference = (int64_t) (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) - position);
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&ring_tail, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (difference < 0) {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            position = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    record->time_us = monotonic_us();
+    record->file = file;
+    record->line = line;
+    record->thread = log_thread_id();
+    record->level = level;
+    va_start(arguments, format);
+    vsnprintf(record->message, sizeof(record->message), format, arguments);
+    va_end(arguments);
+
+    //Hand it to the writer
+    __atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write out everything that is ready, as few write() calls as we can. Returns how many records there were.
+ */
+static uint32_t log_drain() {
+    static char buffer[64 * 1024];
+    size_t used = 0;
+    uint32_t drained = 0;
+
+    while (true) {
+        LogRecord *record = &ring[ring_head & LOG_RING_MASK];
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != ring_head + 1) {
+            break;
+        }
+        if (sizeof(buffer) - used < LOG_MESSAGE_SIZE + 128) {
+            log_write_all(buffer, used);
+            used = 0;
+        }
+        used += log_format(buffer + used, sizeof(buffer) - used, record);
+        //Free for whoever comes round to it next lap
+        __atomic_store_n(&record->sequence, ring_head + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+        ring_head++;
+        drained++;
+    }
+
+    uint64_t lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (lost > 0) {
+        if (sizeof(buffer) - used < 128) {
+            log_write_all(buffer, used);
+            used = 0;
+        }
+        used += snprintf(buffer + used, sizeof(buffer) - used, "log ring full, dropped %lu messages\n", lost);
+    }
+    log_write_all(buffer, used);
+    return drained;
+}
+
+static void *log_writer_main(void *arg) {
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        if (log_drain() == 0) {
+            usleep(LOG_DRAIN_INTERVAL_MS * 1000);
+        }
+    }
+    return NULL;
+}
+
+uint16_t log_parse_level(const char *name, uint8_t *level) {
+    for (uint8_t i = 0; i <= LOG_LEVEL_OFF; i++) {
+        if (strcasecmp(name, level_names[i]) == 0) {
+            *level = i;
+            return SUCCESS;
+        }
+    }
+    return ERROR;
+}
+
+void log_set_level(uint8_t level) {
+    log_level = level > LOG_LEVEL_OFF ? LOG_LEVEL_OFF : level;
+}
+
+/*
+ * Start the writer thread, from now on messages go through the ring to fd. Whatever is still in the ring gets written when
+ * the process exits.
+ *
+ * The writer is started with every signal blocked so it never takes one meant for somebody else, a server watching SIGINT
+ * on a signalfd needs every other thread to have it blocked.
+ */
+uint16_t log_start(int fd) {
+    if (running) {
+        return SUCCESS;
+    }
+
+    for (uint32_t i = 0; i < LOG_RING_SLOTS; i++) {
+        ring[i].sequence = i;
+    }
+    ring_head = 0;
+    ring_tail = 0;
+    log_fd = fd;
+
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    int result = pthread_create(&writer, NULL, log_writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (result != 0) {
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        return ERROR;
+    }
+
+    atexit(log_stop);
+    return SUCCESS;
+}
+
+/*
+ * Stop the writer and write out whatever it left behind. Anything logged after this is written out directly.
+ */
+void log_stop() {
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    log_drain();
+}
@@ -0,0 +1,72 @@
+//
+// Created by dustyn on 7/30/24.
+//
+#include <stdint.h>
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_LOG_H
+#define UNIXCUSTOMTRANSPORTLAYER_LOG_H
+
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARN 3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_OFF 5
+
+/*
+ * Anything logged below this level is compiled out altogether, arguments and all. The build sets it (see CMakeLists.txt),
+ * left alone everything is compiled in and log_level alone decides.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+#endif
+
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_INFO
+/*
+ * Slots in the ring between the threads logging and the one writing it out, a power of 2. When it is full messages are dropped
+ * and counted rather than making anyone wait.
+ */
+#define LOG_RING_SLOTS 4096
+#define LOG_RING_MASK (LOG_RING_SLOTS - 1)
+#define LOG_MESSAGE_SIZE 192
+/*
+ * How long the writer sleeps when the ring is empty
+ */
+#define LOG_DRAIN_INTERVAL_MS 10
+
+#ifdef __FILE_NAME__
+#define LOG_FILE __FILE_NAME__
+#else
+#define LOG_FILE __FILE__
+#endif
+
+extern uint8_t log_level;
+
+/*
+ * Log at level if it was compiled in and is at or above log_level. Below LOG_COMPILE_LEVEL the condition is a constant
+ * and the whole call goes away, the arguments are never evaluated.
+ */
+#define LOG_AT(level, ...) \
+    do { \
+        if ((level) >= LOG_COMPILE_LEVEL && (level) >= log_level) { \
+            log_write((level), LOG_FILE, __LINE__, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+void log_write(uint8_t level, const char *file, uint32_t line, const char *format, ...) __attribute__((format(printf, 4, 5)));
+
+uint16_t log_parse_level(const char *name, uint8_t *level);
+
+void log_set_level(uint8_t level);
+
+uint16_t log_start(int fd);
+
+void log_stop();
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_LOG_H
@@ -0,0 +1,417 @@
+//
+// Created by dustyn on 7/28/24.
+//
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include "netsim.h"
+#include "dustyns_transport_layer.h"
+#include "timer_wheel.h"
+
+/*
+ * Loopback never loses, reorders or corrupts anything, so none of the recovery code (NACKs, RESEND, CORRUPTION, SECOND_SEND, timeouts)
+ * ever runs unless something gets in the way on purpose. This is that something. Every datagram the stack sends goes through
+ * netsim_sendmmsg() or netsim_sendmsg(), and once netsim_configure() has been given some impairments they decide what happens to it:
+ * dropped, sent twice, held back so later ones overtake it, delayed, or sent with a byte flipped.
+ *
+ * The decisions come out of a seeded generator and every datagram takes the same number of draws, so with the same seed the n'th
+ * datagram we send always gets the same treatment. Both ends impair what they send, so between them both directions are covered.
+ *
+ * The stand-in mode is for when raw sockets are not an option (no CAP_NET_RAW) or other traffic would get in the way. netsim_socketpair()
+ * hands out a connected pair of AF_UNIX datagram sockets for the two ends and we put a copy of our ip header in front of everything we
+ * send, standing in for the one the kernel adds on a raw socket, so the receive side can't tell the difference.
+ *
+ * With nothing configured and no stand-in this is one branch in front of sendmmsg().
+ */
+
+/*
+ * A datagram we are holding on to, flattened into one piece since the caller's buffers may be gone by the time it goes out.
+ */
+typedef struct NetsimDatagram {
+    struct NetsimDatagram *next;
+    uint64_t release_us;
+    int socket;
+    struct sockaddr_in destination;
+    uint8_t has_destination;
+    uint8_t copies;
+    size_t length;
+    char data[];
+} NetsimDatagram;
+
+static NetsimConfig config;
+static NetsimStats stats;
+static uint64_t random_state = 1;
+static uint8_t impairing;
+static uint8_t stand_in;
+
+/*
+ * Delayed datagrams wait in here in release order, a thread of their own sends them when their time comes. Everything in this file
+ * that changes is under the lock, workers may be sending at the same time.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake;
+static NetsimDatagram *delayed;
+static uint8_t delay_thread_started;
+
+static uint64_t splitmix64(uint64_t value) {
+    value += 0x9E3779B97F4A7C15ULL;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+/*
+ * xorshift64*, small and fast and good enough to decide the fate of a datagram.
+ */
+static uint64_t netsim_random() {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double netsim_uniform() {
+    return (double) (netsim_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Start the generator over from the configured seed. Two processes with the same configuration (the two ends of a stand-in pair
+ * after a fork, say) pass different streams so they don't make the same decisions in lockstep.
+ */
+void netsim_reseed(uint64_t stream) {
+    pthread_mutex_lock(&lock);
+    random_state = splitmix64(config.seed ^ splitmix64(stream));
+    if (random_state == 0) {
+        random_state = 1;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static uint16_t netsim_parse_rate(const char *key, const char *value, double *rate) {
+    char *end;
+    *rate = strtod(value, &end);
+    if (*end != '\0' || *rate < 0 || *rate > 1) {
+        fprintf(stderr, "netsim: %s wants a rate between 0 and 1, not %s\n", key, value);
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Takes a comma separated list of key=value, for example "seed=7,drop=0.05,reorder=0.01,delay=2,jitter=1".
+ * drop, duplicate, reorder and corrupt are rates between 0 and 1, delay, jitter and reorder_ms are milliseconds.
+ * Anything not mentioned keeps whatever it was. Only meant to be called at startup before any worker threads are running.
+ */
+uint16_t netsim_configure(const char *spec) {
+    char buffer[256];
+    char *save;
+
+    if (strlen(spec) >= sizeof(buffer)) {
+        fprintf(stderr, "netsim: configuration too long\n");
+        return ERROR;
+    }
+    strcpy(buffer, spec);
+
+    for (char *option = strtok_r(buffer, ",", &save); option != NULL; option = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(option, '=');
+        if (value == NULL) {
+            fprintf(stderr, "netsim: expected key=value, got %s\n", option);
+            return ERROR;
+        }
+        *value++ = '\0';
+
+        uint16_t result = SUCCESS;
+        if (strcmp(option, "seed") == 0) {
+            config.seed = strtoull(value, NULL, 10);
+        } else if (strcmp(option, "drop") == 0) {
+            result = netsim_parse_rate(option, value, &config.drop);
+        } else if (strcmp(option, "duplicate") == 0) {
+            result = netsim_parse_rate(option, value, &config.duplicate);
+        } else if (strcmp(option, "reorder") == 0) {
+            result = netsim_parse_rate(option, value, &config.reorder);
+        } else if (strcmp(option, "corrupt") == 0) {
+            result = netsim_parse_rate(option, value, &config.corrupt);
+        } else if (strcmp(option, "delay") == 0) {
+            config.delay_ms = (uint32_t) atoi(value);
+        } else if (strcmp(option, "jitter") == 0) {
+            config.jitter_ms = (uint32_t) atoi(value);
+        } else if (strcmp(option, "reorder_ms") == 0) {
+            config.reorder_ms = (uint32_t) atoi(value);
+        } else {
+            fprintf(stderr, "netsim: unknown option %s\n", option);
+            return ERROR;
+        }
+        if (result != SUCCESS) {
+            return ERROR;
+        }
+    }
+
+    if (config.reorder > 0 && config.reorder_ms == 0) {
+        config.reorder_ms = NETSIM_DEFAULT_REORDER_MS;
+    }
+    impairing = config.drop > 0 || config.duplicate > 0 || config.reorder > 0 || config.corrupt > 0 || config.delay_ms > 0 ||
+                config.jitter_ms > 0;
+    netsim_reseed(0);
+    return SUCCESS;
+}
+
+/*
+ * A connected pair of stand-in sockets, one for each end, and from now on everything we send is laid out for them.
+ * Datagram sockets keep message boundaries the way a raw socket does, and a sender blocks rather than drops when the other end
+ * falls behind, so the only losses are the ones we make.
+ */
+uint16_t netsim_socketpair(int sockets[2]) {
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) < 0) {
+        perror("socketpair");
+        return ERROR;
+    }
+    stand_in = 1;
+    return SUCCESS;
+}
+
+uint8_t netsim_active() {
+    return impairing || stand_in;
+}
+
+/*
+ * Send for real. A stand-in socket is already connected and has nobody in between to add an ip header, so we drop the address
+ * and put a copy of our own ip header (always the first io vector) in front, where the kernel's would be.
+ * Ancillary data like SCM_TXTIME means nothing to it either.
+ */
+static ssize_t netsim_transmit(int socket, const struct msghdr *message, int flags) {
+    if (!stand_in) {
+        return sendmsg(socket, message, flags);
+    }
+
+    struct iovec iov[8];
+    struct msghdr stand_in_message;
+    if (message->msg_iovlen + 1 > sizeof(iov) / sizeof(iov[0])) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    iov[0] = message->msg_iov[0];
+    iov[0].iov_len = sizeof(struct iphdr);
+    memcpy(&iov[1], message->msg_iov, message->msg_iovlen * sizeof(struct iovec));
+
+    memset(&stand_in_message, 0, sizeof(stand_in_message));
+    stand_in_message.msg_iov = iov;
+    stand_in_message.msg_iovlen = message->msg_iovlen + 1;
+
+    ssize_t sent = sendmsg(socket, &stand_in_message, flags);
+    return sent > 0 ? sent - (ssize_t) sizeof(struct iphdr) : sent;
+}
+
+static void netsim_transmit_datagram(NetsimDatagram *datagram, int flags, void *control, size_t control_length) {
+    struct iovec iov = {.iov_base = datagram->data, .iov_len = datagram->length};
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (datagram->has_destination) {
+        message.msg_name = &datagram->destination;
+        message.msg_namelen = sizeof(datagram->destination);
+    }
+    message.msg_control = control;
+    message.msg_controllen = control_length;
+
+    for (uint8_t i = 0; i < datagram->copies; i++) {
+        if (netsim_transmit(datagram->socket, &message, flags) < 0 && errno != EBADF) {
+            perror("sendmsg");
+        }
+    }
+}
+
+static void *netsim_delay_thread(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&lock);
+    while (true) {
+        if (delayed == NULL) {
+            pthread_cond_wait(&wake, &lock);
+            continue;
+        }
+
+        uint64_t now = monotonic_us();
+        if (delayed->release_us > now) {
+            struct timespec until;
+            until.tv_sec = (time_t) (delayed->release_us / 1000000);
+            until.tv_nsec = (long) (delayed->release_us % 1000000) * 1000L;
+            pthread_cond_timedwait(&wake, &lock, &until);
+            continue;
+        }
+
+        NetsimDatagram *datagram = delayed;
+        delayed = datagram->next;
+        pthread_mutex_unlock(&lock);
+        netsim_transmit_datagram(datagram, 0, NULL, 0);
+        free(datagram);
+        pthread_mutex_lock(&lock);
+    }
+    return NULL;
+}
+
+/*
+ * Into the queue in release order, behind anything due at the same time so equal delays keep their order. Called with the lock held.
+ */
+static uint16_t netsim_hold(NetsimDatagram *datagram) {
+    if (!delay_thread_started) {
+        pthread_condattr_t attributes;
+        pthread_t thread;
+        pthread_condattr_init(&attributes);
+        pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+        pthread_cond_init(&wake, &attributes);
+        pthread_condattr_destroy(&attributes);
+        if (pthread_create(&thread, NULL, netsim_delay_thread, NULL) != 0) {
+            perror("pthread_create");
+            return ERROR;
+        }
+        pthread_detach(thread);
+        delay_thread_started = 1;
+    }
+
+    NetsimDatagram **position = &delayed;
+    while (*position != NULL && (*position)->release_us <= datagram->release_us) {
+        position = &(*position)->next;
+    }
+    datagram->next = *position;
+    *position = datagram;
+    pthread_cond_signal(&wake);
+    return SUCCESS;
+}
+
+/*
+ * One datagram through the impairments. Whatever we do to it, the caller is told it went out, same as a real network that loses it
+ * further along. Every datagram takes the same draws whether it needs them or not, that keeps the decisions for the ones after it
+ * the same from run to run.
+ *
+ * A flipped byte lands in our ip header or the payload, never in our transport header. Nothing checks that header on its own, so a
+ * flip there isn't something the protocol claims to survive, where the other two have their checksums and the RESEND and CORRUPTION
+ * paths behind them.
+ */
+static ssize_t netsim_send_one(int socket, const struct msghdr *message, int flags) {
+    if (!impairing) {
+        return netsim_transmit(socket, message, flags);
+    }
+
+    size_t length = 0;
+    for (size_t i = 0; i < message->msg_iovlen; i++) {
+        length += message->msg_iov[i].iov_len;
+    }
+
+    pthread_mutex_lock(&lock);
+    stats.datagrams++;
+    uint8_t drop = netsim_uniform() < config.drop;
+    uint8_t corrupt = netsim_uniform() < config.corrupt;
+    uint64_t flip_position = netsim_random();
+    uint8_t flip_value = (uint8_t) (1 + netsim_random() % 255);
+    uint8_t duplicate = netsim_uniform() < config.duplicate;
+    uint8_t reorder = netsim_uniform() < config.reorder;
+    uint64_t jitter = config.jitter_ms > 0 ? netsim_random() % ((uint64_t) config.jitter_ms * 1000 + 1) : 0;
+
+    if (drop) {
+        stats.dropped++;
+        pthread_mutex_unlock(&lock);
+        return (ssize_t) length;
+    }
+    corrupt = corrupt && length > HEADER_SIZE;
+    stats.corrupted += corrupt;
+    stats.duplicated += duplicate;
+    stats.reordered += reorder;
+    uint64_t delay_us = (uint64_t) config.delay_ms * 1000 + jitter + (reorder ? (uint64_t) config.reorder_ms * 1000 : 0);
+    stats.delayed += delay_us > 0;
+    pthread_mutex_unlock(&lock);
+
+    if (!corrupt && delay_us == 0) {
+        ssize_t sent = netsim_transmit(socket, message, flags);
+        if (sent >= 0 && duplicate) {
+            netsim_transmit(socket, message, flags);
+        }
+        return sent;
+    }
+
+    NetsimDatagram *datagram = malloc(sizeof(NetsimDatagram) + length);
+    if (datagram == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < message->msg_iovlen; i++) {
+        memcpy(datagram->data + offset, message->msg_iov[i].iov_base, message->msg_iov[i].iov_len);
+        offset += message->msg_iov[i].iov_len;
+    }
+    datagram->length = length;
+    datagram->socket = socket;
+    datagram->copies = duplicate ? 2 : 1;
+    datagram->has_destination = message->msg_name != NULL && message->msg_namelen >= sizeof(struct sockaddr_in);
+    if (datagram->has_destination) {
+        memcpy(&datagram->destination, message->msg_name, sizeof(struct sockaddr_in));
+    }
+
+    if (corrupt) {
+        size_t position = flip_position % (length - HEADER_SIZE);
+        if (position >= sizeof(struct iphdr)) {
+            position += HEADER_SIZE;
+        }
+        datagram->data[position] ^= (char) flip_value;
+    }
+
+    if (delay_us == 0) {
+        netsim_transmit_datagram(datagram, flags, message->msg_control, message->msg_controllen);
+        free(datagram);
+        return (ssize_t) length;
+    }
+
+    datagram->release_us = monotonic_us() + delay_us;
+    pthread_mutex_lock(&lock);
+    uint16_t held = netsim_hold(datagram);
+    pthread_mutex_unlock(&lock);
+    if (held != SUCCESS) {
+        free(datagram);
+        return -1;
+    }
+    return (ssize_t) length;
+}
+
+/*
+ * Stand ins for sendmmsg() and sendmsg(), same arguments and same return values.
+ */
+int netsim_sendmmsg(int socket, struct mmsghdr *messages, unsigned int count, int flags) {
+    if (!netsim_active()) {
+        return sendmmsg(socket, messages, count, flags);
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        ssize_t sent = netsim_send_one(socket, &messages[i].msg_hdr, flags);
+        if (sent < 0) {
+            return i > 0 ? (int) i : -1;
+        }
+        messages[i].msg_len = (unsigned int) sent;
+    }
+    return (int) count;
+}
+
+ssize_t netsim_sendmsg(int socket, const struct msghdr *message, int flags) {
+    if (!netsim_active()) {
+        return sendmsg(socket, message, flags);
+    }
+    return netsim_send_one(socket, message, flags);
+}
+
+void netsim_get_stats(NetsimStats *copy) {
+    pthread_mutex_lock(&lock);
+    *copy = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+void netsim_print_stats(FILE *stream) {
+    NetsimStats copy;
+    netsim_get_stats(&copy);
+    fprintf(stream, "netsim sent %lu dropped %lu duplicated %lu reordered %lu corrupted %lu delayed %lu\n", copy.datagrams,
+            copy.dropped, copy.duplicated, copy.reordered, copy.corrupted, copy.delayed);
+}
@@ -0,0 +1,58 @@
+//
+// Created by dustyn on 7/28/24.
+//
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_NETSIM_H
+#define UNIXCUSTOMTRANSPORTLAYER_NETSIM_H
+
+/*
+ * How long a reordered datagram is held back when no reorder_ms was given, long enough for whatever goes out after it to overtake it.
+ */
+#define NETSIM_DEFAULT_REORDER_MS 1
+
+/*
+ * What happens to the datagrams we send. Rates are the chance, 0 to 1, that it happens to any one datagram, and each is rolled on
+ * its own so a datagram can be both duplicated and corrupted. Every datagram is held for delay_ms plus up to jitter_ms, and
+ * reordered ones for reorder_ms on top of that.
+ */
+typedef struct NetsimConfig {
+    uint64_t seed;
+    double drop;
+    double duplicate;
+    double reorder;
+    double corrupt;
+    uint32_t delay_ms;
+    uint32_t jitter_ms;
+    uint32_t reorder_ms;
+} NetsimConfig;
+
+typedef struct NetsimStats {
+    uint64_t datagrams;
+    uint64_t dropped;
+    uint64_t duplicated;
+    uint64_t reordered;
+    uint64_t corrupted;
+    uint64_t delayed;
+} NetsimStats;
+
+uint16_t netsim_configure(const char *spec);
+
+void netsim_reseed(uint64_t stream);
+
+uint16_t netsim_socketpair(int sockets[2]);
+
+uint8_t netsim_active();
+
+int netsim_sendmmsg(int socket, struct mmsghdr *messages, unsigned int count, int flags);
+
+ssize_t netsim_sendmsg(int socket, const struct msghdr *message, int flags);
+
+void netsim_get_stats(NetsimStats *stats);
+
+void netsim_print_stats(FILE *stream);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_NETSIM_H
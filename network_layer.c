@@ -6,45 +6,181 @@
 
 
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ONES_COMPLEMENT_HAVE_AVX2_PATH 1
+#endif
+
 /*
- * This is a standard algorithm for IP checksums.
- * We will use to verify layer 3 headers to ensure
- * that the IP header has not been corrupted during
- * transport.If it is no good, the packet will be thrown out.
+ * The internet checksum is the one's complement of the one's complement sum of the data taken as 16 bit words. The nice thing
+ * about one's complement addition is that it doesn't care about byte order or how wide the words are while you add, as long as all
+ * the carries get folded back in at the end. So rather than 16 bits at a time we add 32 bit words into a 64 bit accumulator, or
+ * 16 words at once with AVX2, and fold once at the end. Which kernel we use is decided once at startup.
+ *
+ * The kernels return the raw unfolded accumulator so a sum can be carried across several buffers, ones_complement_fold() finishes it.
  */
 
+static ones_complement_sum_fn ones_complement_selected = ones_complement_sum_scalar;
 
-uint16_t checksum(struct iphdr *ip_hdr, int len) {
-    // Cast the input pointer to an unsigned short pointer
-    uint16_t *buf = (uint16_t *) ip_hdr;
+__attribute__((constructor)) static void ones_complement_init() {
+    if (ones_complement_has_avx2()) {
+        ones_complement_selected = ones_complement_sum_avx2;
+    }
+}
 
-    // Initialize the sum variable
-    uint32_t sum = 0;
+uint64_t ones_complement_sum_scalar(const void *data, size_t length, uint64_t sum) {
+    const unsigned char *bytes = data;
 
-    // Declare a variable to hold the checksum result
-    uint16_t result;
+    while (length >= 4) {
+        uint32_t word;
+        memcpy(&word, bytes, sizeof(word));
+        sum += word;
+        bytes += 4;
+        length -= 4;
+    }
+    if (length >= 2) {
+        uint16_t word;
+        memcpy(&word, bytes, sizeof(word));
+        sum += word;
+        bytes += 2;
+        length -= 2;
+    }
+    //An odd byte at the end is the first byte of a word padded with zero, where that lands depends on byte order
+    if (length == 1) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        sum += (uint32_t) *bytes << 8;
+#else
+        sum += *bytes;
+#endif
+    }
+    return sum;
+}
+
+#ifdef ONES_COMPLEMENT_HAVE_AVX2_PATH
 
-    // Iterate over the data buffer, summing up 16-bit words
-    for (sum = 0; len > 1; len -= 2) {
-        sum += *buf++; // Add the value pointed to by buf to sum, then move buf to the next 16-bit word
+/*
+ * Each 32 byte block is widened into two vectors of eight 32 bit lanes and added in, so a lane grows by at most 2 * 0xFFFF per block.
+ * Spilling to the 64 bit sum every 4096 blocks keeps the lanes well clear of overflowing.
+ */
+#define ONES_COMPLEMENT_AVX2_SPILL 4096
+
+__attribute__((target("avx2")))
+uint64_t ones_complement_sum_avx2(const void *data, size_t length, uint64_t sum) {
+    const unsigned char *bytes = data;
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (length >= 32) {
+        __m256i lanes = zero;
+        size_t blocks = length / 32;
+        if (blocks > ONES_COMPLEMENT_AVX2_SPILL) {
+            blocks = ONES_COMPLEMENT_AVX2_SPILL;
+        }
+
+        for (size_t i = 0; i < blocks; i++) {
+            __m256i words = _mm256_loadu_si256((const __m256i *) bytes);
+            lanes = _mm256_add_epi32(lanes, _mm256_unpacklo_epi16(words, zero));
+            lanes = _mm256_add_epi32(lanes, _mm256_unpackhi_epi16(words, zero));
+            bytes += 32;
+        }
+        length -= blocks * 32;
+
+        uint32_t lane[8];
+        _mm256_storeu_si256((__m256i *) lane, lanes);
+        for (int i = 0; i < 8; i++) {
+            sum += lane[i];
+        }
     }
+    return ones_complement_sum_scalar(bytes, length, sum);
+}
+
+uint8_t ones_complement_has_avx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? 1 : 0;
+}
+
+#else
+
+uint64_t ones_complement_sum_avx2(const void *data, size_t length, uint64_t sum) {
+    return ones_complement_sum_scalar(data, length, sum);
+}
 
-    // If the length is odd, add the last byte separately
-    if (len == 1) {
-        sum += *(unsigned char*)buf; // Add the value of the last byte to sum
+uint8_t ones_complement_has_avx2() {
+    return 0;
+}
+
+#endif
+
+ones_complement_sum_fn ones_complement_implementation() {
+    return ones_complement_selected;
+}
+
+uint16_t ones_complement_fold(uint64_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
     }
+    return (uint16_t) sum;
+}
 
-    // Add any carry bits to the lower 16 bits of sum
-    sum = (sum >> 16) + (sum & 0xFFFF);
+uint16_t ones_complement_sum(const void *data, size_t length) {
+    return ones_complement_fold(ones_complement_selected(data, length, 0));
+}
 
-    // Add carry from the addition above to the lower 16 bits of sum
-    sum += (sum >> 16);
+/*
+ * This is a standard algorithm for IP checksums.
+ * We will use to verify layer 3 headers to ensure
+ * that the IP header has not been corrupted during
+ * transport.If it is no good, the packet will be thrown out.
+ */
+uint16_t checksum(struct iphdr *ip_hdr, int len) {
+    return ~ones_complement_sum(ip_hdr, len);
+}
+
+/*
+ * RFC 1624 incremental update, HC' = ~(~HC + ~m + m'). When one 16 bit word of a header changes from m to m' we can fix the checksum
+ * from the old checksum and the two values instead of summing the whole header again. The words are taken exactly as they sit in the
+ * header, byte order doesn't matter here for the same reason it doesn't for the full sum.
+ */
+uint16_t checksum_adjust16(uint16_t check, uint16_t old_word, uint16_t new_word) {
+    uint32_t sum = (uint16_t) ~check;
+    sum += (uint16_t) ~old_word;
+    sum += new_word;
+    return ~ones_complement_fold(sum);
+}
+
+/*
+ * Same thing for a 32 bit field like an address, it is just two 16 bit words changing at once.
+ */
+uint16_t checksum_adjust32(uint16_t check, uint32_t old_value, uint32_t new_value) {
+    uint64_t sum = (uint16_t) ~check;
+    sum += (uint16_t) ~(old_value >> 16);
+    sum += (uint16_t) ~(old_value & 0xFFFF);
+    sum += new_value >> 16;
+    sum += new_value & 0xFFFF;
+    return ~ones_complement_fold(sum);
+}
 
-    // Take the one's complement of sum to obtain the checksum result
-    result = ~sum;
+/*
+ * Patch the fields that change from packet to packet, fixing the checksum as we go. Both take host order values.
+ */
+void ip_header_set_tot_len(struct iphdr *ip_header, uint16_t tot_len) {
+    uint16_t new_tot_len = htons(tot_len);
+    ip_header->check = checksum_adjust16(ip_header->check, ip_header->tot_len, new_tot_len);
+    ip_header->tot_len = new_tot_len;
+}
+
+void ip_header_set_id(struct iphdr *ip_header, uint16_t id) {
+    uint16_t new_id = htons(id);
+    ip_header->check = checksum_adjust16(ip_header->check, ip_header->id, new_id);
+    ip_header->id = new_id;
+}
 
-    // Return the checksum result
-    return result;
+/*
+ * Copy a header built by fill_ip_header() and set its length, for sending lots of packets to the same place without building
+ * and summing every header from scratch.
+ */
+void fill_ip_header_from_template(struct iphdr *ip_header, const struct iphdr *template, uint16_t tot_len) {
+    memcpy(ip_header, template, sizeof(struct iphdr));
+    ip_header_set_tot_len(ip_header, tot_len);
 }
 
 /*
@@ -61,8 +197,8 @@ uint16_t fill_ip_header(struct iphdr *ip_header, uint32_t src_ip, uint32_t dst_i
     ip_header->version = 4; // IPv4
     ip_header->check = 0; //set checksum to 0 first
     ip_header->tos = 0; // Type of service
-    ip_header->tot_len = htons(PACKET_SIZE); // Total length of the packet
-    ip_header->id = htons(12345); // Identification
+    ip_header->tot_len = PACKET_LENGTH(0); // Total length, just the headers until a payload goes in (see ip_header_set_tot_len())
+    ip_header->id = 12345; // Identification
     ip_header->frag_off = 0; // Fragmentation offset
     ip_header->ttl = 64; // Time to live
     ip_header->protocol = IPPROTO_RAW; // Protocol
@@ -87,20 +223,17 @@ uint16_t fill_ip_header(struct iphdr *ip_header, uint32_t src_ip, uint32_t dst_i
 
 }
 
+/*
+ * Summing a header with its checksum still in it gives all ones when nothing has been damaged, so we don't need to pull the
+ * checksum out and recompute it to compare.
+ */
 int16_t compare_ip_checksum(struct iphdr *ip_hdr){
    // get_ip_header_host_ready(ip_hdr);
-    uint16_t check = ip_hdr->check;
-    memset(&ip_hdr->check,0,sizeof(uint16_t));
-    uint16_t new_check;
-    new_check = checksum(ip_hdr,sizeof (struct iphdr));
+    uint16_t sum = ones_complement_sum(ip_hdr, sizeof (struct iphdr));
 
-
-    if(check != new_check){
-        printf("Check mismatch , check %d new check %d \n",check,new_check);
-        fflush(stdout);
+    if(sum != 0xFFFF){
         return -1;
     }
-    ip_hdr->check = new_check;
     return SUCCESS;
 }
 
@@ -111,11 +244,13 @@ int16_t compare_ip_checksum(struct iphdr *ip_hdr){
  */
 uint16_t get_ip_header_wire_ready(struct iphdr (*ip_header)){
 
-    ip_header->ihl = htonl(ip_header->ihl);
-    ip_header->version = htonl(ip_header->version); // IPv4
+    /*
+     * ihl and version share one byte as 4 bit fields, there is no byte order to them. They used to go through htonl() here too,
+     * which left both of them 0 on the wire. Nothing of ours looks at them, but anything else reading our packets does.
+     */
     ip_header->tos = 0; // Type of service
-    ip_header->tot_len = htons(PACKET_SIZE); // Total length of the packet
-    ip_header->id = htons(12345); // Identification
+    ip_header->tot_len = htons(ip_header->tot_len); // Total length of the packet
+    ip_header->id = htons(ip_header->id); // Identification
     ip_header->ttl = 64; // Time to live
     ip_header->check = htons(ip_header->check);
 
@@ -131,11 +266,9 @@ uint16_t get_ip_header_wire_ready(struct iphdr (*ip_header)){
  */
 uint16_t get_ip_header_host_ready(struct iphdr (*ip_header)){
 
-    ip_header->ihl = ntohl(ip_header->ihl);
-    ip_header->version = ntohl(ip_header->version); // IPv4
     ip_header->tos = 0; // Type of service
-    ip_header->tot_len = ntohl(PACKET_SIZE); // Total length of the packet
-    ip_header->id = ntohs(12345); // Identification
+    ip_header->tot_len = ntohs(ip_header->tot_len); // Total length of the packet
+    ip_header->id = ntohs(ip_header->id); // Identification
     ip_header->ttl = 64; // Time to live
     ip_header->check = ntohs(ip_header->check);
 
@@ -10,8 +10,32 @@
 
 uint16_t fill_ip_header(struct iphdr *ip_header, uint32_t src_ip, uint32_t dst_ip);
 
+typedef uint64_t (*ones_complement_sum_fn)(const void *data, size_t length, uint64_t sum);
+
+uint64_t ones_complement_sum_scalar(const void *data, size_t length, uint64_t sum);
+
+uint64_t ones_complement_sum_avx2(const void *data, size_t length, uint64_t sum);
+
+uint8_t ones_complement_has_avx2();
+
+ones_complement_sum_fn ones_complement_implementation();
+
+uint16_t ones_complement_fold(uint64_t sum);
+
+uint16_t ones_complement_sum(const void *data, size_t length);
+
 uint16_t checksum(struct iphdr *ip_hdr, int len);
 
+uint16_t checksum_adjust16(uint16_t check, uint16_t old_word, uint16_t new_word);
+
+uint16_t checksum_adjust32(uint16_t check, uint32_t old_value, uint32_t new_value);
+
+void ip_header_set_tot_len(struct iphdr *ip_header, uint16_t tot_len);
+
+void ip_header_set_id(struct iphdr *ip_header, uint16_t id);
+
+void fill_ip_header_from_template(struct iphdr *ip_header, const struct iphdr *template, uint16_t tot_len);
+
 uint16_t get_ip_header_wire_ready(struct iphdr (*ip_header));
 
 uint16_t get_ip_header_host_ready(struct iphdr (*ip_header));
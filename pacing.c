@@ -0,0 +1,154 @@
+//
+// Created by dustyn on 7/24/24.
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/net_tstamp.h>
+#include "pacing.h"
+#include "dustyns_transport_layer.h"
+#include "timer_wheel.h"
+
+/*
+ * Even with a congestion window, everything the window allows goes out back to back the moment an ACK opens it up, and collections go
+ * out all at once. The network then sees line rate bursts a window long, and the first queue that can't take a whole burst drops the
+ * tail of it. On loopback that queue is the receiver's socket buffer, which is where the RESEND storms were coming from.
+ *
+ * Pacing spreads sending out over time instead. The window sender paces at cwnd / srtt (a window per round trip) unless a fixed
+ * rate was configured, and collections are paced when a rate was configured. Either the token bucket here holds packets back in
+ * user space, or with SO_TXTIME the kernel does it.
+ */
+
+static double pacing_rate;
+static uint8_t pacing_txtime;
+
+/*
+ * Only meant to be set once at startup before any worker threads are running. A rate of 0 leaves the window sender pacing off its
+ * own cwnd and srtt and collections unpaced.
+ */
+void pacing_set_default(double rate, uint8_t txtime) {
+    pacing_rate = rate;
+    pacing_txtime = txtime;
+}
+
+double pacing_default_rate() {
+    return pacing_rate;
+}
+
+uint8_t pacing_default_txtime() {
+    return pacing_txtime;
+}
+
+/*
+ * Departure times are on CLOCK_MONOTONIC, same clock as everything else of ours.
+ */
+uint16_t pacer_enable_txtime(int socket) {
+    struct sock_txtime txtime;
+    memset(&txtime, 0, sizeof(txtime));
+    txtime.clockid = CLOCK_MONOTONIC;
+
+    if (setsockopt(socket, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) < 0) {
+        perror("SO_TXTIME");
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+uint8_t pacer_socket_has_txtime(int socket) {
+    struct sock_txtime txtime;
+    socklen_t length = sizeof(txtime);
+
+    memset(&txtime, 0, sizeof(txtime));
+    if (getsockopt(socket, SOL_SOCKET, SO_TXTIME, &txtime, &length) < 0) {
+        return 0;
+    }
+    return txtime.clockid == CLOCK_MONOTONIC;
+}
+
+void pacer_init(Pacer *pacer, double rate, uint8_t txtime) {
+    memset(pacer, 0, sizeof(Pacer));
+    pacer->txtime = txtime;
+    pacer->refilled_us = monotonic_us();
+    pacer_set_rate(pacer, rate);
+    pacer->tokens = pacer->burst;
+}
+
+void pacer_set_rate(Pacer *pacer, double rate) {
+    double burst = rate * PACING_QUANTUM_US / 1e6;
+
+    pacer->rate = rate;
+    pacer->burst = burst > PACING_MIN_BURST ? burst : PACING_MIN_BURST;
+    if (pacer->tokens > pacer->burst) {
+        pacer->tokens = pacer->burst;
+    }
+}
+
+/*
+ * Top the bucket up for the time since we last looked and say how many packets can go right now.
+ */
+uint32_t pacer_allowance(Pacer *pacer, uint64_t now_us) {
+    if (pacer->rate <= 0) {
+        return PACING_UNLIMITED;
+    }
+
+    if (now_us > pacer->refilled_us) {
+        pacer->tokens += (double) (now_us - pacer->refilled_us) * pacer->rate / 1e6;
+        if (pacer->tokens > pacer->burst) {
+            pacer->tokens = pacer->burst;
+        }
+        pacer->refilled_us = now_us;
+    }
+    return pacer->tokens >= 1 ? (uint32_t) pacer->tokens : 0;
+}
+
+void pacer_consume(Pacer *pacer, uint32_t packets) {
+    if (pacer->rate > 0) {
+        pacer->tokens -= packets;
+    }
+}
+
+/*
+ * How long until there are tokens for this many packets, as of the last allowance check.
+ */
+uint64_t pacer_delay_us(Pacer *pacer, uint32_t packets) {
+    if (pacer->rate <= 0 || pacer->tokens >= packets) {
+        return 0;
+    }
+    return (uint64_t) (((double) packets - pacer->tokens) * 1e6 / pacer->rate) + 1;
+}
+
+/*
+ * Block until this many packets can go, for the collection senders which block anyway.
+ */
+void pacer_wait(Pacer *pacer, uint32_t packets) {
+    if (pacer_allowance(pacer, monotonic_us()) >= packets) {
+        return;
+    }
+
+    uint64_t delay_us = pacer_delay_us(pacer, packets);
+    struct timespec delay;
+    delay.tv_sec = (time_t) (delay_us / 1000000);
+    delay.tv_nsec = (long) (delay_us % 1000000) * 1000L;
+    while (clock_nanosleep(CLOCK_MONOTONIC, 0, &delay, &delay) == EINTR) {
+    }
+    pacer_allowance(pacer, monotonic_us());
+}
+
+/*
+ * When the next packet should leave, for SO_TXTIME. Packets are spaced 1 / rate apart, but a pacer that has been idle doesn't get
+ * to send its missed departures all at once.
+ */
+uint64_t pacer_departure_ns(Pacer *pacer, uint64_t now_ns) {
+    if (pacer->next_departure_ns < now_ns) {
+        pacer->next_departure_ns = now_ns;
+    }
+
+    uint64_t departure = pacer->next_departure_ns;
+    if (pacer->rate > 0) {
+        pacer->next_departure_ns += (uint64_t) (1e9 / pacer->rate);
+    }
+    return departure;
+}
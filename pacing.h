@@ -0,0 +1,65 @@
+//
+// Created by dustyn on 7/24/24.
+//
+#include <stdint.h>
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_PACING_H
+#define UNIXCUSTOMTRANSPORTLAYER_PACING_H
+
+/*
+ * When we pick the rate ourselves it is cwnd / srtt times a gain, a bit over 1 so pacing never holds us under what the window allows.
+ * Slow start gets 2 so the window can still double every RTT, same as Linux does.
+ */
+#define PACING_GAIN_SLOW_START 2.0
+#define PACING_GAIN 1.25
+/*
+ * The timer wheel only ticks once a millisecond, so a pacer that is held up gets woken at most once a millisecond. The bucket holds
+ * a millisecond's worth of packets so a wake up can still send at the full rate, and never less than PACING_MIN_BURST.
+ */
+#define PACING_QUANTUM_US 1000
+#define PACING_MIN_BURST 4
+#define PACING_UNLIMITED UINT32_MAX
+
+/*
+ * A token bucket in packets. rate is packets per second and 0 means unpaced, tokens builds up at that rate to at most burst and
+ * every packet sent takes one. Sending more than we had (resends do this) leaves tokens negative, which holds up new data for as
+ * long as it takes to pay that back.
+ *
+ * With txtime set the socket has SO_TXTIME on and nothing is held in user space at all, every packet gets stamped with the time it
+ * should leave (next_departure_ns) and the fq qdisc holds on to it until then. Where there is no fq on the way out the stamp is ignored
+ * and everything goes out right away.
+ */
+typedef struct Pacer {
+    double rate;
+    double tokens;
+    double burst;
+    uint64_t refilled_us;
+    uint64_t next_departure_ns;
+    uint8_t txtime;
+} Pacer;
+
+void pacing_set_default(double rate, uint8_t txtime);
+
+double pacing_default_rate();
+
+uint8_t pacing_default_txtime();
+
+uint16_t pacer_enable_txtime(int socket);
+
+uint8_t pacer_socket_has_txtime(int socket);
+
+void pacer_init(Pacer *pacer, double rate, uint8_t txtime);
+
+void pacer_set_rate(Pacer *pacer, double rate);
+
+uint32_t pacer_allowance(Pacer *pacer, uint64_t now_us);
+
+void pacer_consume(Pacer *pacer, uint32_t packets);
+
+uint64_t pacer_delay_us(Pacer *pacer, uint32_t packets);
+
+void pacer_wait(Pacer *pacer, uint32_t packets);
+
+uint64_t pacer_departure_ns(Pacer *pacer, uint64_t now_ns);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_PACING_H
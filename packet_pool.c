@@ -0,0 +1,190 @@
+//
+// Created by dustyn on 6/2/24.
+//
+
+#include <stddef.h>
+#include "packet_pool.h"
+
+/*
+ * Every packet used to cost us four mallocs (the packet and one for each io vector) and four frees, and the control
+ * packet senders never freed theirs at all. Instead, each connection gets a pool of packet blocks. A block is a single
+ * cache aligned chunk that holds the ip header, our transport header and the payload back to back, so grabbing a packet
+ * is just popping the head of a free list and giving it back is pushing it on again, both O(1).
+ *
+ * Blocks are carved out of slabs, if we run out we just add another slab rather than failing. Slabs are only
+ * handed back to the system when the pool is destroyed, so blocks get recycled across packet collections.
+ */
+
+static uint16_t packet_pool_grow(PacketPool *pool, uint32_t num_blocks) {
+
+    PacketSlab *slab = malloc(sizeof(PacketSlab));
+    if (slab == NULL) {
+        perror("malloc");
+        return ERROR;
+    }
+
+    slab->blocks = aligned_alloc(CACHE_LINE_SIZE, num_blocks * pool->block_size);
+    if (slab->blocks == NULL) {
+        perror("aligned_alloc");
+        free(slab);
+        return ERROR;
+    }
+    slab->num_blocks = num_blocks;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    /*
+     * Wire up the io vectors once here, they always point back into their own block so
+     * we never have to touch them again on acquire.
+     */
+    for (uint32_t i = 0; i < num_blocks; i++) {
+        PacketBlock *block = (PacketBlock *) ((char *) slab->blocks + i * pool->block_size);
+        block->owner = pool;
+        block->in_use = 0;
+        block->pin = NULL;
+        block->packet.iov[0].iov_base = &block->ip_header;
+        block->packet.iov[0].iov_len = sizeof(struct iphdr);
+        block->packet.iov[1].iov_base = &block->header;
+        block->packet.iov[1].iov_len = HEADER_SIZE;
+        block->packet.iov[2].iov_base = block->payload;
+        block->packet.iov[2].iov_len = pool->payload_size;
+        block->next_free = pool->free_list;
+        pool->free_list = block;
+    }
+
+    pool->blocks_total += num_blocks;
+    return SUCCESS;
+}
+
+/*
+ * Blocks hold payload_size bytes of payload, never less than PAYLOAD_SIZE.
+ */
+uint16_t packet_pool_init(PacketPool *pool, uint32_t initial_blocks, uint16_t payload_size) {
+    memset(pool, 0, sizeof(PacketPool));
+    if (initial_blocks == 0) {
+        initial_blocks = PACKET_POOL_SLAB_SIZE;
+    }
+    if (payload_size < PAYLOAD_SIZE) {
+        payload_size = PAYLOAD_SIZE;
+    }
+    pool->payload_size = payload_size;
+    pool->block_size = (offsetof(PacketBlock, payload) + payload_size + CACHE_LINE_SIZE - 1) & ~((size_t) CACHE_LINE_SIZE - 1);
+    return packet_pool_grow(pool, initial_blocks);
+}
+
+/*
+ * Hands every slab back to the system. Any packet still held by someone is gone after this, so only call it
+ * once the connection is finished with.
+ */
+void packet_pool_destroy(PacketPool *pool) {
+
+    if (pool->blocks_in_use != 0) {
+        fprintf(stderr, "Packet pool destroyed with %u packets still in use\n", pool->blocks_in_use);
+    }
+
+    PacketSlab *slab = pool->slabs;
+    while (slab != NULL) {
+        PacketSlab *next = slab->next;
+        free(slab->blocks);
+        free(slab);
+        slab = next;
+    }
+    memset(pool, 0, sizeof(PacketPool));
+}
+
+/*
+ * Pop a block off the free list. We only clear the two headers, the payload is always
+ * overwritten before use and msg_size tells the other side how much of it is real.
+ */
+Packet *packet_pool_acquire(PacketPool *pool) {
+
+    if (pool->free_list == NULL && packet_pool_grow(pool, PACKET_POOL_SLAB_SIZE) != SUCCESS) {
+        return NULL;
+    }
+
+    PacketBlock *block = pool->free_list;
+    pool->free_list = block->next_free;
+    block->next_free = NULL;
+    block->in_use = 1;
+
+    memset(&block->ip_header, 0, sizeof(struct iphdr));
+    memset(&block->header, 0, sizeof(Header));
+
+    pool->blocks_in_use++;
+    if (pool->blocks_in_use > pool->high_water) {
+        pool->high_water = pool->blocks_in_use;
+    }
+
+    return &block->packet;
+}
+
+/*
+ * Drop the block's pin on whatever buffer it points into, if it has one. The last pin going lets the owner have the buffer back.
+ */
+static void packet_block_unpin(PacketBlock *block) {
+    PinnedBuffer *buffer = block->pin;
+
+    if (buffer == NULL) {
+        return;
+    }
+    block->pin = NULL;
+    if (--buffer->pins == 0 && buffer->on_release != NULL) {
+        buffer->on_release(buffer, buffer->context);
+    }
+}
+
+/*
+ * Push the block back on the free list. If someone repointed an io vector (a zero copy payload pointing into a caller's
+ * buffer for example) we put it back so the next user gets a clean block, and drop the pin on that buffer.
+ */
+uint16_t packet_pool_release(PacketPool *pool, Packet *packet) {
+
+    if (packet == NULL) {
+        return ERROR;
+    }
+
+    PacketBlock *block = (PacketBlock *) ((char *) packet - offsetof(PacketBlock, packet));
+    if (block->owner != pool || !block->in_use) {
+        fprintf(stderr, "Packet released to the wrong pool or released twice\n");
+        return ERROR;
+    }
+
+    packet->iov[0].iov_base = &block->ip_header;
+    packet->iov[0].iov_len = sizeof(struct iphdr);
+    packet->iov[1].iov_base = &block->header;
+    packet->iov[1].iov_len = HEADER_SIZE;
+    packet->iov[2].iov_base = block->payload;
+    packet->iov[2].iov_len = pool->payload_size;
+
+    packet_block_unpin(block);
+
+    block->in_use = 0;
+    block->next_free = pool->free_list;
+    pool->free_list = block;
+    pool->blocks_in_use--;
+    return SUCCESS;
+}
+
+void pinned_buffer_init(PinnedBuffer *buffer, const char *data, size_t length,
+                        void (*on_release)(PinnedBuffer *buffer, void *context), void *context) {
+    buffer->data = data;
+    buffer->length = length;
+    buffer->pins = 0;
+    buffer->on_release = on_release;
+    buffer->context = context;
+}
+
+/*
+ * Point the packet's payload straight at a slice of a pinned buffer rather than copying it into the block.
+ * The block holds a pin on the buffer until it goes back to the pool. If it was already pinned to a buffer that pin is dropped,
+ * after taking the new one so repinning to the same buffer can't release it in between.
+ */
+void packet_pin_payload(Packet *packet, PinnedBuffer *buffer, size_t offset, size_t length) {
+    PacketBlock *block = (PacketBlock *) ((char *) packet - offsetof(PacketBlock, packet));
+
+    buffer->pins++;
+    packet_block_unpin(block);
+    packet->iov[2].iov_base = (char *) buffer->data + offset;
+    packet->iov[2].iov_len = length;
+    block->pin = buffer;
+}
@@ -0,0 +1,75 @@
+//
+// Created by dustyn on 6/2/24.
+//
+#include "dustyns_transport_layer.h"
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_PACKET_POOL_H
+#define UNIXCUSTOMTRANSPORTLAYER_PACKET_POOL_H
+
+#define CACHE_LINE_SIZE 64
+#define PACKET_POOL_SLAB_SIZE 256
+#define PACKET_POOL_INITIAL_BLOCKS (2 * MAX_PACKET_COLLECTION)
+
+/*
+ * A caller's message buffer that packets point into instead of copying out of. Every packet that references it holds a pin,
+ * the buffer must not be changed or freed until the pin count drops back to 0. Packets are only released back to the pool
+ * once their collection has been ACKed, so that is the earliest point the buffer can come free. If on_release is set it gets
+ * called when the last pin goes away.
+ */
+typedef struct PinnedBuffer {
+    const char *data;
+    size_t length;
+    uint32_t pins;
+    void (*on_release)(struct PinnedBuffer *buffer, void *context);
+    void *context;
+} PinnedBuffer;
+
+/*
+ * One block holds everything a packet needs. The bookkeeping takes the first cache line, the wire image (ip header, our header,
+ * payload) starts on the next one and sits contiguous in memory. How big the payload is depends on the pool, so blocks are
+ * block_size apart in their slab rather than sizeof(PacketBlock).
+ */
+typedef struct PacketBlock {
+    Packet packet;
+    struct PacketBlock *next_free;
+    struct PacketPool *owner;
+    PinnedBuffer *pin;
+    uint8_t in_use;
+    struct iphdr ip_header __attribute__((aligned(CACHE_LINE_SIZE)));
+    Header header;
+    char payload[];
+} __attribute__((aligned(CACHE_LINE_SIZE))) PacketBlock;
+
+typedef struct PacketSlab {
+    struct PacketSlab *next;
+    uint32_t num_blocks;
+    PacketBlock *blocks;
+} PacketSlab;
+
+/*
+ * payload_size is how much every block can hold, anything copied into a block has to fit in that.
+ */
+struct PacketPool {
+    PacketBlock *free_list;
+    PacketSlab *slabs;
+    size_t block_size;
+    uint16_t payload_size;
+    uint32_t blocks_total;
+    uint32_t blocks_in_use;
+    uint32_t high_water;
+};
+
+uint16_t packet_pool_init(PacketPool *pool, uint32_t initial_blocks, uint16_t payload_size);
+
+void packet_pool_destroy(PacketPool *pool);
+
+Packet *packet_pool_acquire(PacketPool *pool);
+
+uint16_t packet_pool_release(PacketPool *pool, Packet *packet);
+
+void pinned_buffer_init(PinnedBuffer *buffer, const char *data, size_t length,
+                        void (*on_release)(PinnedBuffer *buffer, void *context), void *context);
+
+void packet_pin_payload(Packet *packet, PinnedBuffer *buffer, size_t offset, size_t length);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_PACKET_POOL_H
@@ -0,0 +1,78 @@
+//
+// Created by dustyn on 7/26/24.
+//
+
+#include "path_mtu.h"
+
+/*
+ * Every packet used to carry PAYLOAD_SIZE bytes, 512, whatever the path could take. On Ethernet that is a third of what fits in a
+ * frame, on loopback (64KB MTU) less than a hundredth, so a big message cost us many times the packets, headers, checksums and
+ * syscalls it needed to.
+ *
+ * Now each connection works out how big a payload the path to its peer can carry without fragmenting, from the route's MTU, and
+ * each side tells the other the biggest payload it can take in (Header.max_payload). We send the smaller of the two.
+ * The kernel learns path MTUs from ICMP along the way, so asking it again later picks up anything that changed.
+ */
+
+static uint16_t max_payload = PAYLOAD_SIZE;
+
+/*
+ * The biggest payload we take in, so how big receive ring slots and packet pool blocks have to be. Only meant to be set once at
+ * startup before any worker threads are running.
+ */
+void path_mtu_set_max_payload(uint32_t payload) {
+    max_payload = path_mtu_payload(payload + PATH_MTU_OVERHEAD);
+}
+
+uint16_t path_mtu_max_payload() {
+    return max_payload;
+}
+
+/*
+ * Raw sockets can't be connected to ask this, so we connect a UDP socket to the peer, which makes the kernel look the route up, and
+ * read that route's MTU off it. Nothing is ever sent on it. Returns 0 if the kernel couldn't tell us.
+ */
+uint32_t path_mtu_query(uint32_t peer_ip) {
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe < 0) {
+        perror("socket");
+        return 0;
+    }
+
+    struct sockaddr_in peer;
+    memset(&peer, 0, sizeof(peer));
+    peer.sin_family = AF_INET;
+    peer.sin_addr.s_addr = peer_ip;
+    peer.sin_port = htons(9);
+
+    int mtu = 0;
+    socklen_t length = sizeof(mtu);
+    if (connect(probe, (struct sockaddr *) &peer, sizeof(peer)) < 0 || getsockopt(probe, IPPROTO_IP, IP_MTU, &mtu, &length) < 0) {
+        perror("IP_MTU");
+        mtu = 0;
+    }
+    close(probe);
+    return mtu > 0 ? (uint32_t) mtu : 0;
+}
+
+/*
+ * The payload that fits in a datagram of this size, never less than PAYLOAD_SIZE (every peer takes that much, the path had better too)
+ * and never more than MAX_PAYLOAD_SIZE.
+ */
+uint16_t path_mtu_payload(uint32_t mtu) {
+    if (mtu < PAYLOAD_SIZE + PATH_MTU_OVERHEAD) {
+        return PAYLOAD_SIZE;
+    }
+    if (mtu - PATH_MTU_OVERHEAD > MAX_PAYLOAD_SIZE) {
+        return MAX_PAYLOAD_SIZE;
+    }
+    return (uint16_t) (mtu - PATH_MTU_OVERHEAD);
+}
+
+/*
+ * The biggest payload that gets to peer_ip in one piece.
+ */
+uint16_t path_mtu_payload_to(uint32_t peer_ip) {
+    uint32_t mtu = path_mtu_query(peer_ip);
+    return path_mtu_payload(mtu > 0 ? mtu : PATH_MTU_FALLBACK);
+}
@@ -0,0 +1,28 @@
+//
+// Created by dustyn on 7/26/24.
+//
+#include "dustyns_transport_layer.h"
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_PATH_MTU_H
+#define UNIXCUSTOMTRANSPORTLAYER_PATH_MTU_H
+
+/*
+ * What a datagram carries besides our payload, the kernel's ip header, ours and our transport header.
+ */
+#define PATH_MTU_OVERHEAD (2 * sizeof(struct iphdr) + HEADER_SIZE)
+/*
+ * What we assume when the kernel can't tell us, plain Ethernet.
+ */
+#define PATH_MTU_FALLBACK 1500
+
+void path_mtu_set_max_payload(uint32_t max_payload);
+
+uint16_t path_mtu_max_payload();
+
+uint32_t path_mtu_query(uint32_t peer_ip);
+
+uint16_t path_mtu_payload(uint32_t mtu);
+
+uint16_t path_mtu_payload_to(uint32_t peer_ip);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_PATH_MTU_H
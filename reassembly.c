@@ -0,0 +1,145 @@
+//
+// Created by dustyn on 7/25/24.
+//
+
+#include "reassembly.h"
+
+/*
+ * Collection mode used to hold on to every packet of a collection until packet_end arrived, then copy the whole thing into one
+ * 512KB buffer and hand it over. Nothing reached the application until the last packet did, and nothing bigger than that
+ * buffer could ever be received.
+ *
+ * The reassembly ring gives every packet a home at its place in the stream as soon as it arrives, and whatever is in order gets
+ * handed over right away, so the first bytes show up after the first packet rather than the last. Memory is fixed at however many
+ * slots the ring has, and because we advertise how many of them are free (see collection_space in connection.h) the peer
+ * never sends more than fits, so a stream can be as long as it likes.
+ */
+
+uint16_t reassembly_init(ReassemblyRing *ring, uint32_t slots, deliver_fn deliver, void *context) {
+    memset(ring, 0, sizeof(ReassemblyRing));
+
+    if (slots == 0 || (slots & (slots - 1)) != 0) {
+        return ERROR;
+    }
+
+    ring->buffer = malloc((size_t) slots * PAYLOAD_SIZE);
+    ring->lengths = calloc(slots, sizeof(uint16_t));
+    ring->present = calloc(slots, sizeof(uint8_t));
+    if (ring->buffer == NULL || ring->lengths == NULL || ring->present == NULL) {
+        perror("malloc");
+        reassembly_destroy(ring);
+        return ERROR;
+    }
+
+    ring->slots = slots;
+    ring->deliver = deliver;
+    ring->context = context;
+    return SUCCESS;
+}
+
+void reassembly_destroy(ReassemblyRing *ring) {
+    free(ring->buffer);
+    free(ring->lengths);
+    free(ring->present);
+    memset(ring, 0, sizeof(ReassemblyRing));
+}
+
+/*
+ * How many slots are free, so how many packets the next collection can have.
+ */
+uint16_t reassembly_space(ReassemblyRing *ring) {
+    uint64_t free_slots = ring->slots - (ring->ready_slot - ring->read_slot);
+    return free_slots < MAX_PACKET_COLLECTION ? (uint16_t) free_slots : MAX_PACKET_COLLECTION;
+}
+
+/*
+ * The longest run of readable bytes that sits in one piece in the buffer, starting where the application is up to. Slots run
+ * into each other as long as they are full and don't wrap around the end of the ring. Returns 0 if there is nothing to read.
+ */
+size_t reassembly_peek(ReassemblyRing *ring, const char **data) {
+    uint32_t mask = ring->slots - 1;
+
+    //An empty message still takes a slot, there is nothing in it to read so skip straight past
+    while (ring->read_slot != ring->ready_slot && ring->lengths[ring->read_slot & mask] == 0) {
+        ring->present[ring->read_slot & mask] = 0;
+        ring->read_slot++;
+    }
+    if (ring->read_slot == ring->ready_slot) {
+        return 0;
+    }
+
+    uint32_t slot = ring->read_slot & mask;
+    size_t length = ring->lengths[slot] - ring->read_offset;
+    *data = ring->buffer + (size_t) slot * PAYLOAD_SIZE + ring->read_offset;
+
+    for (uint64_t next = ring->read_slot + 1;
+         next != ring->ready_slot && (next & mask) != 0 && ring->lengths[(next - 1) & mask] == PAYLOAD_SIZE; next++) {
+        length += ring->lengths[next & mask];
+    }
+    return length;
+}
+
+/*
+ * The application is done with this many bytes, any slots they used up are free again.
+ */
+void reassembly_consume(ReassemblyRing *ring, size_t bytes) {
+    uint32_t mask = ring->slots - 1;
+
+    while (bytes > 0 && ring->read_slot != ring->ready_slot) {
+        uint32_t slot = ring->read_slot & mask;
+        size_t left = ring->lengths[slot] - ring->read_offset;
+        if (bytes < left) {
+            ring->read_offset += bytes;
+            return;
+        }
+        bytes -= left;
+        ring->present[slot] = 0;
+        ring->read_offset = 0;
+        ring->read_slot++;
+    }
+}
+
+/*
+ * Put one payload in its place. Anything that was already there or has already been read is a duplicate and left alone.
+ * If that completes a run in order it is delivered, or left for the application to read.
+ *
+ * Returns SUCCESS, or ERROR if there is no room for it, which only happens when the peer sent more than we advertised.
+ */
+uint16_t reassembly_accept(ReassemblyRing *ring, uint16_t sequence, uint16_t packet_end, const char *data, uint16_t length) {
+    uint32_t mask = ring->slots - 1;
+    uint64_t position = ring->collection_slot + sequence;
+
+    if (sequence > packet_end || length > PAYLOAD_SIZE || (sequence != packet_end && length != PAYLOAD_SIZE)) {
+        return ERROR;
+    }
+    if (position < ring->ready_slot || ring->present[position & mask]) {
+        return SUCCESS;
+    }
+    if (position - ring->read_slot >= ring->slots) {
+        return ERROR;
+    }
+
+    uint32_t slot = position & mask;
+    memcpy(ring->buffer + (size_t) slot * PAYLOAD_SIZE, data, length);
+    ring->lengths[slot] = length;
+    ring->present[slot] = 1;
+
+    uint64_t collection_end = ring->collection_slot + packet_end;
+    while (ring->ready_slot <= collection_end && ring->present[ring->ready_slot & mask]) {
+        ring->bytes_ready += ring->lengths[ring->ready_slot & mask];
+        ring->ready_slot++;
+    }
+    if (ring->ready_slot > collection_end) {
+        ring->collection_slot = ring->ready_slot;
+    }
+
+    if (ring->deliver != NULL) {
+        const char *readable;
+        size_t readable_length;
+        while ((readable_length = reassembly_peek(ring, &readable)) > 0) {
+            ring->deliver(readable, readable_length, ring->context);
+            reassembly_consume(ring, readable_length);
+        }
+    }
+    return SUCCESS;
+}
@@ -0,0 +1,54 @@
+//
+// Created by dustyn on 7/25/24.
+//
+#include "dustyns_transport_layer.h"
+#include "sliding_window.h"
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_REASSEMBLY_H
+#define UNIXCUSTOMTRANSPORTLAYER_REASSEMBLY_H
+
+/*
+ * Has to be a power of 2 so a slot number can be masked into the ring. 1024 slots is a full collection and then some, 512KB,
+ * same as the message buffer it replaces.
+ */
+#define REASSEMBLY_DEFAULT_SLOTS 1024
+
+/*
+ * A ring of packet sized slots that payloads get copied into at their place in the stream as they arrive, in whatever order.
+ * Slot numbers count up forever and get masked into the ring. Every packet but the last one of a collection is full, so
+ * sequence s of the current collection always goes in slot collection_slot + s.
+ *
+ * Everything before ready_slot has arrived and is in order, everything from read_slot up to that is waiting to be read,
+ * read_offset bytes into read_slot. Once the last packet of a collection is ready the next collection starts in the slot after it.
+ *
+ * With deliver set, in order data is handed over the moment it is ready and the slots are free again straight away. Without it,
+ * the application reads at its own pace with reassembly_peek() and reassembly_consume(), and whatever it hasn't read yet is
+ * room the peer doesn't get (see reassembly_space()).
+ */
+typedef struct ReassemblyRing {
+    char *buffer;
+    uint16_t *lengths;
+    uint8_t *present;
+    uint32_t slots;
+    uint64_t read_slot;
+    uint64_t ready_slot;
+    uint64_t collection_slot;
+    uint32_t read_offset;
+    deliver_fn deliver;
+    void *context;
+    uint64_t bytes_ready;
+} ReassemblyRing;
+
+uint16_t reassembly_init(ReassemblyRing *ring, uint32_t slots, deliver_fn deliver, void *context);
+
+void reassembly_destroy(ReassemblyRing *ring);
+
+uint16_t reassembly_accept(ReassemblyRing *ring, uint16_t sequence, uint16_t packet_end, const char *data, uint16_t length);
+
+size_t reassembly_peek(ReassemblyRing *ring, const char **data);
+
+void reassembly_consume(ReassemblyRing *ring, size_t bytes);
+
+uint16_t reassembly_space(ReassemblyRing *ring);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_REASSEMBLY_H
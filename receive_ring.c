@@ -0,0 +1,201 @@
+//
+// Created by dustyn on 6/9/24.
+//
+
+#include "receive_ring.h"
+#include "packet_pool.h"
+
+/*
+ * The receive side used to do a recvmsg() per datagram into one malloc'd buffer, then allocate a packet and memcpy the
+ * ip header, our header and the payload out of that buffer into it. That is a syscall, an allocation and three copies per packet.
+ *
+ * Instead we keep a ring of packet sized slots allocated once up front and let recvmmsg() drop up to batch_size datagrams
+ * straight into the free slots in one syscall. Each slot has a Packet whose io vectors point right into the slot, so the
+ * datagram is parsed where it landed and nothing gets copied. A slot stays put until the caller releases it, which lets a
+ * whole collection sit in the ring while we work out whether anything is missing.
+ *
+ * The batch size and the timeout trade latency against throughput. With no timeout we wait for the first datagram and then
+ * take whatever else is already queued, which is the lowest latency. With a timeout, recvmmsg() keeps filling the batch until
+ * it is full or the timeout runs out. Note the kernel only checks the timeout after each datagram arrives, so it is a bound on
+ * how long we wait for more once things are flowing, not a bound on how long we wait for the first one.
+ */
+
+/*
+ * Every slot holds a datagram with up to max_payload bytes of payload, anything bigger gets cut short and dropped once it is
+ * parsed. If that many slots that size would go over RECEIVE_RING_MAX_BYTES we use fewer, halving num_slots until it fits.
+ */
+uint16_t receive_ring_init(ReceiveRing *ring, uint32_t num_slots, uint16_t batch_size, uint32_t timeout_ms, uint16_t max_payload) {
+    memset(ring, 0, sizeof(ReceiveRing));
+
+    //Has to be a power of 2 so we can mask instead of mod
+    if (num_slots == 0 || (num_slots & (num_slots - 1)) != 0) {
+        fprintf(stderr, "Receive ring size must be a power of 2\n");
+        return ERROR;
+    }
+
+    if (max_payload < PAYLOAD_SIZE) {
+        max_payload = PAYLOAD_SIZE;
+    }
+    size_t slot_size = RECEIVE_SLOT_SIZE(max_payload);
+    while (num_slots > RECEIVE_BATCH_SIZE && (size_t) num_slots * slot_size > RECEIVE_RING_MAX_BYTES) {
+        num_slots /= 2;
+    }
+
+    if (batch_size == 0) {
+        batch_size = RECEIVE_BATCH_SIZE;
+    } else if (batch_size > MAX_RECEIVE_BATCH_SIZE) {
+        batch_size = MAX_RECEIVE_BATCH_SIZE;
+    }
+    if (batch_size > num_slots) {
+        batch_size = num_slots;
+    }
+
+    ring->num_slots = num_slots;
+    ring->slot_size = slot_size;
+    ring->batch_size = batch_size;
+    ring->timeout_ms = timeout_ms;
+
+    ring->slots = aligned_alloc(CACHE_LINE_SIZE, num_slots * slot_size);
+    ring->packets = malloc(num_slots * sizeof(Packet));
+    ring->lengths = malloc(num_slots * sizeof(uint32_t));
+    ring->messages = malloc(batch_size * sizeof(struct mmsghdr));
+    ring->iovecs = malloc(batch_size * sizeof(struct iovec));
+
+    if (ring->slots == NULL || ring->packets == NULL || ring->lengths == NULL || ring->messages == NULL ||
+        ring->iovecs == NULL) {
+        perror("malloc");
+        receive_ring_destroy(ring);
+        return ERROR;
+    }
+
+    memset(ring->lengths, 0, num_slots * sizeof(uint32_t));
+    return SUCCESS;
+}
+
+void receive_ring_destroy(ReceiveRing *ring) {
+    free(ring->slots);
+    free(ring->packets);
+    free(ring->lengths);
+    free(ring->messages);
+    free(ring->iovecs);
+    memset(ring, 0, sizeof(ReceiveRing));
+}
+
+/*
+ * Point the packet's io vectors at the right spots inside the slot. The kernel header can carry options so
+ * we read its length rather than assuming 20 bytes.
+ */
+static void receive_ring_parse_slot(ReceiveRing *ring, uint32_t index) {
+    char *slot = ring->slots + (size_t) index * ring->slot_size;
+    Packet *packet = &ring->packets[index];
+    uint32_t length = ring->lengths[index];
+
+    size_t kernel_header_len = (size_t) (((unsigned char) slot[0]) & 0x0F) * 4;
+    if (kernel_header_len < KERNEL_IP_HEADER_SIZE || kernel_header_len > length) {
+        kernel_header_len = KERNEL_IP_HEADER_SIZE;
+    }
+
+    size_t offset = kernel_header_len;
+    packet->iov[0].iov_base = slot + offset;
+    packet->iov[0].iov_len = sizeof(struct iphdr);
+    offset += sizeof(struct iphdr);
+    packet->iov[1].iov_base = slot + offset;
+    packet->iov[1].iov_len = HEADER_SIZE;
+    offset += HEADER_SIZE;
+    packet->iov[2].iov_base = slot + offset;
+    packet->iov[2].iov_len = length > offset ? length - offset : 0;
+}
+
+/*
+ * Pull as many datagrams as we can (up to the batch size) into the free slots with one recvmmsg() call.
+ * We only ever hand recvmmsg() a run of slots that does not wrap past the end of the ring.
+ * Returns how many datagrams arrived, 0 if the ring is full or the timeout expired with nothing, -1 on error.
+ */
+int receive_ring_fill(ReceiveRing *ring, int socket) {
+
+    uint32_t in_use = ring->head - ring->tail;
+    uint32_t free_slots = ring->num_slots - in_use;
+    uint32_t start = ring->head & (ring->num_slots - 1);
+    uint32_t until_wrap = ring->num_slots - start;
+
+    uint32_t count = ring->batch_size;
+    if (count > free_slots) {
+        count = free_slots;
+    }
+    if (count > until_wrap) {
+        count = until_wrap;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        ring->iovecs[i].iov_base = ring->slots + (size_t) (start + i) * ring->slot_size;
+        ring->iovecs[i].iov_len = ring->slot_size;
+        memset(&ring->messages[i].msg_hdr, 0, sizeof(struct msghdr));
+        ring->messages[i].msg_hdr.msg_iov = &ring->iovecs[i];
+        ring->messages[i].msg_hdr.msg_iovlen = 1;
+        ring->messages[i].msg_len = 0;
+    }
+
+    struct timespec timeout;
+    struct timespec *timeout_ptr = NULL;
+    int flags = MSG_WAITFORONE;
+    if (ring->timeout_ms > 0) {
+        timeout.tv_sec = ring->timeout_ms / 1000;
+        timeout.tv_nsec = (long) (ring->timeout_ms % 1000) * 1000000L;
+        timeout_ptr = &timeout;
+        flags = 0;
+    }
+
+    int received;
+    do {
+        received = recvmmsg(socket, ring->messages, count, flags, timeout_ptr);
+    } while (received < 0 && errno == EINTR);
+
+    if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        perror("recvmmsg");
+        return -1;
+    }
+
+    for (int i = 0; i < received; i++) {
+        ring->lengths[start + i] = ring->messages[i].msg_len;
+        receive_ring_parse_slot(ring, start + i);
+    }
+
+    ring->head += received;
+    return received;
+}
+
+/*
+ * Hand out the next received packet, receiving another batch first if we have gone through everything we had.
+ * The packet stays valid until receive_ring_release_consumed() is called. Returns NULL on error, on timeout, or if
+ * the ring is full of packets nobody has released yet.
+ */
+Packet *receive_ring_next(ReceiveRing *ring, int socket, uint32_t *length) {
+
+    if (ring->cursor == ring->head) {
+        if (receive_ring_fill(ring, socket) <= 0) {
+            return NULL;
+        }
+    }
+
+    uint32_t index = ring->cursor & (ring->num_slots - 1);
+    ring->cursor++;
+
+    if (length != NULL) {
+        *length = ring->lengths[index];
+    }
+    return &ring->packets[index];
+}
+
+/*
+ * Everything that has been handed out so far is done with, those slots can be received into again.
+ * Anything received but not handed out yet stays where it is for the next call.
+ */
+void receive_ring_release_consumed(ReceiveRing *ring) {
+    ring->tail = ring->cursor;
+}
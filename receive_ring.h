@@ -0,0 +1,52 @@
+//
+// Created by dustyn on 6/9/24.
+//
+#include "dustyns_transport_layer.h"
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_RECEIVE_RING_H
+#define UNIXCUSTOMTRANSPORTLAYER_RECEIVE_RING_H
+
+/*
+ * A raw socket hands us the datagram with the kernel's own ip header in front of ours
+ */
+#define KERNEL_IP_HEADER_SIZE 20
+#define RECEIVE_SLOT_SIZE(max_payload) (((KERNEL_IP_HEADER_SIZE + PACKET_LENGTH(max_payload)) + 63) & ~((size_t) 63))
+#define RECEIVE_RING_SLOTS 2048
+/*
+ * Slots big enough for 64KB datagrams would make a full size ring 128MB, so big slots get fewer of them instead
+ */
+#define RECEIVE_RING_MAX_BYTES (32 * 1024 * 1024)
+#define RECEIVE_BATCH_SIZE 32
+#define MAX_RECEIVE_BATCH_SIZE 1024
+
+/*
+ * Slots are used in order and the three counters only ever go up, a slot's index is the counter masked by the
+ * ring size. Slots between tail and cursor have been handed out and are still being looked at, slots between
+ * cursor and head have been received but not handed out yet.
+ */
+typedef struct ReceiveRing {
+    char *slots;
+    Packet *packets;
+    uint32_t *lengths;
+    struct mmsghdr *messages;
+    struct iovec *iovecs;
+    size_t slot_size;
+    uint32_t num_slots;
+    uint32_t head;
+    uint32_t cursor;
+    uint32_t tail;
+    uint16_t batch_size;
+    uint32_t timeout_ms;
+} ReceiveRing;
+
+uint16_t receive_ring_init(ReceiveRing *ring, uint32_t num_slots, uint16_t batch_size, uint32_t timeout_ms, uint16_t max_payload);
+
+void receive_ring_destroy(ReceiveRing *ring);
+
+int receive_ring_fill(ReceiveRing *ring, int socket);
+
+Packet *receive_ring_next(ReceiveRing *ring, int socket, uint32_t *length);
+
+void receive_ring_release_consumed(ReceiveRing *ring);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_RECEIVE_RING_H
@@ -0,0 +1,446 @@
+//
+// Created by dustyn on 7/7/24.
+//
+
+#include <stdbool.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include "server.h"
+#include "network_layer.h"
+#include "sliding_window.h"
+#include "pacing.h"
+#include "log.h"
+#include "trace.h"
+
+/*
+ * The server used to sit blocked in recvmmsg()/poll() with signals for everything else, SIGINT for OOB data and SIGALRM for timeouts
+ * before the timer wheel came along. That is fine for a demo but not for something that is meant to stay up.
+ *
+ * This is a single threaded reactor instead. The raw socket is non blocking and sits in an edge triggered epoll set next to the timer
+ * wheel's timerfd and an eventfd used to ask the loop to stop. Everything happens on this one loop: receiving, running retransmit timers,
+ * sending ACKs and shutting down. Signals are not handled with handlers at all, if we are asked to watch them they are blocked and read
+ * off a signalfd in the same epoll set.
+ *
+ * Edge triggered means epoll only tells us once that the socket became readable, so we have to keep receiving until it runs dry.
+ * Under a flood that could starve the timers, so we only take SERVER_RECEIVE_BUDGET batches at a time and remember that the socket
+ * still has more, the next epoll_wait() then doesn't block and we get straight back to it once the timers have had their turn.
+ * The socket is in the set for writing too. When a send window finds it full it stops and waits, and the socket becoming writable
+ * again is what sends it back out.
+ */
+
+static uint16_t server_add_fd(Server *server, int fd, uint32_t events) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("epoll_ctl");
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Copy every connection's numbers out to the stats segment and go again in STATS_PUBLISH_INTERVAL_MS. Connections that close in
+ * between publish once more on their way out (see connection_release).
+ */
+static void server_publish_stats(Timer *timer, void *context) {
+    Server *server = context;
+
+    for (uint32_t i = 0; i < server->table.capacity; i++) {
+        if (server->table.entries[i].connection != NULL) {
+            connection_publish_stats(server->table.entries[i].connection);
+        }
+    }
+    timer_wheel_schedule(&server->wheel, timer, STATS_PUBLISH_INTERVAL_MS);
+}
+
+uint16_t server_init(Server *server, int socket, uint32_t local_ip, uint16_t local_pid, uint16_t window_size) {
+    memset(server, 0, sizeof(Server));
+    server->socket = socket;
+    server->local_ip = local_ip;
+    server->local_pid = local_pid;
+    server->window_size = window_size;
+    server->num_shards = 1;
+    server->epoll_fd = -1;
+    server->control_fd = -1;
+    server->signal_fd = -1;
+    server->wheel.timer_fd = -1;
+
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags < 0 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return ERROR;
+    }
+
+    //Without SO_TXTIME the send windows just fall back to pacing in user space
+    if (pacing_default_txtime()) {
+        pacer_enable_txtime(socket);
+    }
+
+    if (receive_ring_init(&server->ring, RECEIVE_RING_SLOTS, RECEIVE_BATCH_SIZE, 0, path_mtu_max_payload()) != SUCCESS) {
+        return ERROR;
+    }
+
+    /*
+     * The default socket buffer only has room for three 64KB datagrams, so with big payloads it gets to hold as much as the ring does.
+     * Going past rmem_max needs SO_RCVBUFFORCE, anyone who can open a raw socket is allowed that.
+     */
+    if (path_mtu_max_payload() > PAYLOAD_SIZE) {
+        int buffer_size = (int) (server->ring.num_slots * server->ring.slot_size);
+        if (setsockopt(socket, SOL_SOCKET, SO_RCVBUFFORCE, &buffer_size, sizeof(buffer_size)) < 0 &&
+            setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size)) < 0) {
+            perror("SO_RCVBUF");
+        }
+    }
+    if (timer_wheel_init(&server->wheel) != SUCCESS || connection_table_init(&server->table, CONNECTION_TABLE_INITIAL_CAPACITY) != SUCCESS) {
+        server_destroy(server);
+        return ERROR;
+    }
+
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->control_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->epoll_fd < 0 || server->control_fd < 0) {
+        perror("epoll_create1/eventfd");
+        server_destroy(server);
+        return ERROR;
+    }
+
+    if (server_add_fd(server, socket, EPOLLIN | EPOLLOUT | EPOLLET) != SUCCESS ||
+        server_add_fd(server, server->wheel.timer_fd, EPOLLIN | EPOLLET) != SUCCESS ||
+        server_add_fd(server, server->control_fd, EPOLLIN) != SUCCESS) {
+        server_destroy(server);
+        return ERROR;
+    }
+
+    timer_init(&server->stats_publish, server_publish_stats, server);
+    if (stats_enabled()) {
+        timer_wheel_schedule(&server->wheel, &server->stats_publish, STATS_PUBLISH_INTERVAL_MS);
+    }
+    return SUCCESS;
+}
+
+/*
+ * Have SIGINT and SIGTERM shut the loop down cleanly instead of killing the process. They get blocked and show up on a signalfd,
+ * so this has to be called before any other threads are started or they will still have them unblocked.
+ */
+uint16_t server_watch_signals(Server *server) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    if (sigprocmask(SIG_BLOCK, &signals, NULL) < 0) {
+        perror("sigprocmask");
+        return ERROR;
+    }
+
+    server->signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (server->signal_fd < 0) {
+        perror("signalfd");
+        return ERROR;
+    }
+    return server_add_fd(server, server->signal_fd, EPOLLIN);
+}
+
+/*
+ * Ask the loop to stop. Only writes to the eventfd so it is safe to call from any thread.
+ */
+void server_stop(Server *server) {
+    uint64_t one = 1;
+    if (write(server->control_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("write eventfd");
+    }
+}
+
+/*
+ * Delivery for sliding window mode, in order data just goes straight to stdout as it arrives.
+ */
+static void deliver_to_stdout(const char *data, size_t length, void *context) {
+    write(1, data, length);
+}
+
+/*
+ * Delivery for echo mode, the data is queued straight back to the connection it came from. It goes out once the batch is done.
+ */
+static void deliver_to_peer(const char *data, size_t length, void *context) {
+    Connection *conn = context;
+    if (connection_queue_copy(conn, data, length) != SUCCESS) {
+        LOG_WARN("Error queueing echo, send queue full");
+    }
+}
+
+/*
+ * Everything one datagram means for its connection. Corrupt packets are just dropped, they show up as a hole in the bitmap and
+ * the sender resends them without us asking. ACKs coming the other way drive the connection's own send window, whether they
+ * come on their own or riding on the peer's data.
+ * Anything that ends the connection only queues it up to be closed, the batch it came in on may still have packets for it.
+ */
+static void handle_connection_packet(Server *server, Connection *conn, Packet *packet) {
+
+    Header *head = packet->iov[1].iov_base;
+
+    switch (head->status) {
+        case DATA:
+        case SECOND_SEND:
+            if ((head->flags & HEADER_FLAG_ACK) &&
+                send_window_handle_ack(&conn->send_window, &conn->pool, head->ack, head->sack_bitmap, head->window) == ERROR) {
+                LOG_WARN("Error handling ACK");
+            }
+            receive_window_check_update(&conn->receive_window);
+            if (compare_checksum(head->checksum_type, packet->iov[2].iov_base, head->msg_size, head->checksum) == SUCCESS) {
+                deliver_fn deliver = server->echo ? deliver_to_peer : deliver_to_stdout;
+                if (receive_window_accept(&conn->receive_window, &conn->pool, packet, deliver, conn) == ERROR) {
+                    connection_schedule_close(conn);
+                    break;
+                }
+            }
+            connection_schedule_ack(conn);
+            break;
+
+        case ACKNOWLEDGE:
+            if (send_window_handle_ack(&conn->send_window, &conn->pool, head->ack, head->sack_bitmap, head->window) == ERROR) {
+                LOG_WARN("Error handling ACK");
+            }
+            //What the peer just ACKed was taking up room our receive window is waiting on
+            if (receive_window_check_update(&conn->receive_window)) {
+                connection_schedule_ack(conn);
+            }
+            break;
+
+        case OOB:
+            conn->oob_data = ((char *) packet->iov[2].iov_base)[0];
+            LOG_INFO("Out of band data received : %c", conn->oob_data);
+            connection_schedule_close(conn);
+            break;
+
+        case CLOSE:
+            LOG_INFO("Client closed connection");
+            conn->peer_closed = 1;
+            connection_schedule_close(conn);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*
+ * Every datagram addressed to local_pid is routed to a connection by where it came from, its source address and the process id it was sent
+ * from. A peer we have not seen before gets a connection of its own as soon as it sends us data, anything else from an unknown peer is dropped.
+ * So is new data from an address that already has CONNECTION_MAX_PER_PEER_IP connections open.
+ * now_ms is when the batch came off the socket, the connection has heard from its peer as of then.
+ */
+static void server_dispatch(Server *server, Packet *packet, uint32_t bytes_received, uint64_t now_ms) {
+
+    Header *head = packet->iov[1].iov_base;
+    struct iphdr *ip_hdr = packet->iov[0].iov_base;
+
+    if (bytes_received < KERNEL_IP_HEADER_SIZE + sizeof(struct iphdr) + HEADER_SIZE ||
+        head->msg_size > packet->iov[2].iov_len || head->dest_process_id != server->local_pid ||
+        !header_version_supported(head->version)) {
+        return;
+    }
+
+    if (!server->shard_filtered && connection_shard(ip_hdr->saddr, head, server->num_shards) != server->shard_index) {
+        //Another worker's peer, it got its own copy of this datagram
+        return;
+    }
+    STATS_ADD(packets_in, 1);
+    STATS_ADD(bytes_in, bytes_received);
+    trace_record(TRACE_IN, packet->iov, 3, bytes_received - KERNEL_IP_HEADER_SIZE);
+
+    if (compare_ip_checksum(ip_hdr) == -1) {
+        STATS_ADD(ip_checksum_failures, 1);
+        LOG_DEBUG("IP checksum mismatch, check %u", ip_hdr->check);
+        return;
+    }
+
+    Connection *conn = connection_table_lookup(&server->table, ip_hdr->saddr, head->source_process_id);
+    if (conn == NULL) {
+        if (head->status != DATA && head->status != SECOND_SEND) {
+            return;
+        }
+        if (connection_table_peer_count(&server->table, ip_hdr->saddr) >= CONNECTION_MAX_PER_PEER_IP) {
+            LOG_DEBUG("Peer already has %u connections, not opening another", CONNECTION_MAX_PER_PEER_IP);
+            return;
+        }
+        conn = connection_open(&server->table, server->socket, server->local_ip, server->local_pid, ip_hdr->saddr,
+                               head->source_process_id, &server->wheel, server->window_size);
+        if (conn == NULL) {
+            fprintf(stderr, "Error opening connection\n");
+            return;
+        }
+        if (server->echo) {
+            receive_window_set_space(&conn->receive_window, connection_send_space, conn);
+        }
+    }
+
+    conn->last_heard_ms = now_ms;
+    connection_negotiate(conn, head);
+    handle_connection_packet(server, conn, packet);
+}
+
+/*
+ * Once a batch has been worked through, every connection that got data first sends whatever it has queued for its peer, echoes
+ * for example, and that carries the ACK it owes. If nothing did, connection_flush_ack() sends one ACK covering the whole batch
+ * with the SACK bitmap telling the other side about anything out of order, or holds it back for a moment if it can wait.
+ * Then anything that is finished gets closed down, telling the peer unless it was the one that closed.
+ */
+static void server_flush_connections(Server *server) {
+    Connection *conn;
+
+    while ((conn = connection_table_pop_pending(&server->table)) != NULL) {
+        if (conn->closing) {
+            continue;
+        }
+        if (send_window_transmit(&conn->send_window) == ERROR || connection_flush_ack(conn) != SUCCESS) {
+            LOG_WARN("Error sending to peer");
+        }
+    }
+
+    while ((conn = connection_table_pop_closing(&server->table)) != NULL) {
+        if (!conn->peer_closed && handle_close(conn) != SUCCESS) {
+            fprintf(stderr, "Error occurred while handling connection close.\n");
+        }
+        connection_print_stats(conn, stderr);
+        connection_close(conn);
+    }
+}
+
+/*
+ * Take up to SERVER_RECEIVE_BUDGET batches off the socket. Every packet in a batch has either been delivered or copied into a window
+ * by the time we are done with it, so the ring slots go straight back after each batch.
+ * Returns 1 if the socket ran dry, 0 if it may still have more, ERROR if receiving failed.
+ */
+static uint16_t server_receive(Server *server) {
+    uint32_t bytes_received;
+
+    for (int batch = 0; batch < SERVER_RECEIVE_BUDGET; batch++) {
+        int received = receive_ring_fill(&server->ring, server->socket);
+        if (received < 0) {
+            return ERROR;
+        }
+        if (received == 0) {
+            return 1;
+        }
+
+        Packet *packet;
+        uint64_t now_ms = monotonic_ms();
+        while (server->ring.cursor != server->ring.head &&
+               (packet = receive_ring_next(&server->ring, server->socket, &bytes_received)) != NULL) {
+            server_dispatch(server, packet, bytes_received, now_ms);
+        }
+
+        server_flush_connections(server);
+        receive_ring_release_consumed(&server->ring);
+    }
+    return 0;
+}
+
+/*
+ * Run until we are stopped, by server_stop(), by a watched signal, or because something went badly wrong.
+ * Returns SUCCESS on a clean stop.
+ */
+uint16_t server_run(Server *server) {
+
+    struct epoll_event events[SERVER_MAX_EVENTS];
+
+    while (true) {
+        int ready = epoll_wait(server->epoll_fd, events, SERVER_MAX_EVENTS, server->socket_ready ? 0 : -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return ERROR;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == server->socket) {
+                if (events[i].events & EPOLLIN) {
+                    server->socket_ready = 1;
+                }
+                //Room to send again, anyone the full socket held up goes on the pending list and is flushed below
+                if (events[i].events & EPOLLOUT) {
+                    connection_table_resume_blocked(&server->table);
+                }
+            } else if (fd == server->wheel.timer_fd) {
+                timer_wheel_handle_fd(&server->wheel);
+            } else if (fd == server->control_fd || fd == server->signal_fd) {
+                return SUCCESS;
+            }
+        }
+
+        if (server->socket_ready) {
+            uint16_t drained = server_receive(server);
+            if (drained == ERROR) {
+                fprintf(stderr, "Error occurred while receiving packets.\n");
+                return ERROR;
+            }
+            server->socket_ready = !drained;
+        }
+
+        //Connections whose retransmit timers gave up get reaped here, whether or not anything arrived
+        server_flush_connections(server);
+    }
+}
+
+/*
+ * Say goodbye to every peer still connected and free everything. The socket belongs to whoever handed it to us.
+ */
+void server_destroy(Server *server) {
+
+    if (server->table.entries != NULL) {
+        server_flush_connections(server);
+        for (uint32_t i = 0; i < server->table.capacity; i++) {
+            if (server->table.entries[i].connection != NULL && handle_close(server->table.entries[i].connection) != SUCCESS) {
+                fprintf(stderr, "Error occurred while handling connection close.\n");
+            }
+        }
+        connection_table_destroy(&server->table);
+    }
+
+    if (server->signal_fd >= 0) {
+        close(server->signal_fd);
+    }
+    if (server->control_fd >= 0) {
+        close(server->control_fd);
+    }
+    if (server->epoll_fd >= 0) {
+        close(server->epoll_fd);
+    }
+    timer_wheel_cancel(&server->wheel, &server->stats_publish);
+    timer_wheel_destroy(&server->wheel);
+    receive_ring_destroy(&server->ring);
+}
+
+/*
+ * The sliding window version of the connection handler, serving any number of peers off the one raw socket until SIGINT or SIGTERM.
+ * There are no collections to wait on here, data packets get fed to their connection's receive window as they arrive and in order data
+ * is delivered right away.
+ */
+void serve_connections(int socket, uint32_t local_ip, uint16_t local_pid, uint16_t window_size, uint8_t echo) {
+
+    Server server;
+
+    if (server_init(&server, socket, local_ip, local_pid, window_size) != SUCCESS || server_watch_signals(&server) != SUCCESS) {
+        exit(EXIT_FAILURE);
+    }
+    server.echo = echo;
+
+    uint16_t result = server_run(&server);
+    if (result != SUCCESS) {
+        trace_dump_on_error("Server failed");
+    }
+
+    server_destroy(&server);
+    close(socket);
+
+    exit(result == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,63 @@
+//
+// Created by dustyn on 7/7/24.
+//
+#include "dustyns_transport_layer.h"
+#include "receive_ring.h"
+#include "timer_wheel.h"
+#include "connection.h"
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_SERVER_H
+#define UNIXCUSTOMTRANSPORTLAYER_SERVER_H
+
+#define SERVER_MAX_EVENTS 8
+/*
+ * How many recvmmsg() batches we take off the socket before letting timers and control events have a turn
+ */
+#define SERVER_RECEIVE_BUDGET 16
+
+/*
+ * One event loop serving every connection that comes in on its socket. The socket, the timer wheel's timerfd and the control
+ * eventfd all sit in one epoll set. signal_fd is only open once server_watch_signals() has been called.
+ */
+typedef struct Server {
+    int socket;
+    uint32_t local_ip;
+    uint16_t local_pid;
+    uint16_t window_size;
+    int epoll_fd;
+    int control_fd;
+    int signal_fd;
+    uint8_t socket_ready;
+    /*
+     * When this server is one of several workers it only serves its own shard of the peers. If the kernel is filtering
+     * the socket for us (shard_filtered) we never see anyone else's packets, otherwise we have to drop them ourselves.
+     */
+    uint16_t shard_index;
+    uint16_t num_shards;
+    uint8_t shard_filtered;
+    /*
+     * Send every peer's data straight back to it instead of writing it to stdout, any ACK we owe the peer rides back on the echo.
+     */
+    uint8_t echo;
+    /*
+     * Puts every connection's numbers in the stats segment every STATS_PUBLISH_INTERVAL_MS, only armed when there is one
+     */
+    Timer stats_publish;
+    ReceiveRing ring;
+    TimerWheel wheel;
+    ConnectionTable table;
+} Server;
+
+uint16_t server_init(Server *server, int socket, uint32_t local_ip, uint16_t local_pid, uint16_t window_size);
+
+uint16_t server_watch_signals(Server *server);
+
+uint16_t server_run(Server *server);
+
+void server_stop(Server *server);
+
+void server_destroy(Server *server);
+
+void serve_connections(int socket, uint32_t local_ip, uint16_t local_pid, uint16_t window_size, uint8_t echo);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_SERVER_H
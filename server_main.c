@@ -5,10 +5,121 @@
 #include "server_helper_functions.h"
 #include "dustyns_transport_layer.h"
 #include "network_layer.h"
+#include "server.h"
+#include "worker.h"
+#include "congestion.h"
+#include "pacing.h"
+#include "path_mtu.h"
+#include "netsim.h"
+#include "stats.h"
+#include "log.h"
+#include "trace.h"
 
-int main() {
+int main(int argc, char *argv[]) {
     int sockfd;
     ssize_t recv_len;
+    int option;
+    uint16_t window_size = 0;
+    uint16_t num_workers = 1;
+    int cpus[MAX_WORKERS];
+    uint16_t num_cpus = 0;
+    uint8_t echo = 0;
+    const CongestionOps *congestion;
+    double pacing_rate = 0;
+    uint8_t txtime = 0;
+    uint8_t level;
+
+    /*
+     * -w <size> runs the sliding window protocol with that window size and serves every peer that talks to us,
+     * otherwise we do collections with a single peer like always.
+     * -t <workers> spreads the peers over that many threads, -c <cpu,cpu,...> pins worker i to the i'th cpu in the list (wrapping around)
+     * -e sends every peer's data back to it instead of printing it
+     * -C <reno|cubic> picks the congestion control for what we send, cubic by default
+     * -p <packets per second> paces everything we send at that rate, otherwise windows pace at cwnd / srtt and collections don't
+     * -T leaves the pacing to the kernel with SO_TXTIME, which needs the fq qdisc on the way out to do anything
+     * -m <bytes> is the biggest payload peers may send us in sliding window mode, as big as their path allows up to that.
+     *    PAYLOAD_SIZE by default, up to MAX_PAYLOAD_SIZE. Bigger costs memory, receive slots and pool blocks are sized for it
+     * -I <impairments> drops, reorders, duplicates, delays or corrupts what we send, see netsim_configure() for the format
+     * -S <path> keeps counters in a file mapped at path (somewhere under /dev/shm is best) for dtl-stat to read, it is removed on exit
+     * -L <trace|debug|info|warn|error|off> what gets logged to stderr, info by default. Per packet messages are trace and debug,
+     *    builds with LOG_COMPILE_LEVEL above that don't have them at all
+     * -P <path> remembers the last TRACE_DEFAULT_SLOTS datagrams sent and received and writes them to path as pcapng on SIGUSR1,
+     *    or when a connection gives up
+     */
+    while ((option = getopt(argc, argv, "w:t:c:eC:p:Tm:I:S:L:P:")) != -1) {
+        switch (option) {
+            case 'w':
+                window_size = (uint16_t) atoi(optarg);
+                break;
+            case 't':
+                num_workers = (uint16_t) atoi(optarg);
+                break;
+            case 'c':
+                for (char *cpu = strtok(optarg, ","); cpu != NULL && num_cpus < MAX_WORKERS; cpu = strtok(NULL, ",")) {
+                    cpus[num_cpus++] = atoi(cpu);
+                }
+                break;
+            case 'e':
+                echo = 1;
+                break;
+            case 'C':
+                congestion = congestion_find(optarg);
+                if (congestion == NULL) {
+                    fprintf(stderr, "Unknown congestion control %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                congestion_set_default(congestion);
+                break;
+            case 'p':
+                pacing_rate = atof(optarg);
+                break;
+            case 'T':
+                txtime = 1;
+                break;
+            case 'm':
+                path_mtu_set_max_payload((uint32_t) atoi(optarg));
+                break;
+            case 'I':
+                if (netsim_configure(optarg) != SUCCESS) {
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                if (stats_open(optarg) != SUCCESS) {
+                    exit(EXIT_FAILURE);
+                }
+                atexit(stats_close);
+                break;
+            case 'L':
+                if (log_parse_level(optarg, &level) != SUCCESS) {
+                    fprintf(stderr, "Unknown log level %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                log_set_level(level);
+                break;
+            case 'P':
+                if (trace_enable(optarg, TRACE_DEFAULT_SLOTS, TRACE_DEFAULT_SNAPLEN) != SUCCESS) {
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p packets_per_second] [-w window_size [-t workers] [-c cpu_list] [-e] [-C reno|cubic] [-T] [-m max_payload]] [-I impairments] [-S stats_path] [-L log_level] [-P trace_path]\n",
+                        argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    pacing_set_default(pacing_rate, txtime);
+
+    //From here on messages are written out by a thread of their own
+    if (log_start(STDERR_FILENO) != SUCCESS) {
+        exit(EXIT_FAILURE);
+    }
+
+    if ((num_workers > 1 || num_cpus > 0 || echo) && window_size == 0) {
+        fprintf(stderr, "Workers and echo only run in sliding window mode, pass -w as well\n");
+        exit(EXIT_FAILURE);
+    }
 
     // Create a raw socket for custom protocol packets
     if ((sockfd = socket(AF_INET, SOCK_RAW, IP_HDRINCL)) == -1) {
@@ -16,8 +127,17 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    printf("getting ready to listen\n");
-    handle_client_connection(sockfd, inet_addr("127.0.0.1"),inet_addr("127.0.0.1"),500);
+    LOG_INFO("getting ready to listen");
+    if (window_size > 0 && (num_workers > 1 || num_cpus > 0)) {
+        //Every worker opens its own socket
+        close(sockfd);
+        exit(run_workers(num_workers, cpus, num_cpus, inet_addr("127.0.0.1"), SERVER_PID, window_size, echo) == SUCCESS
+             ? EXIT_SUCCESS : EXIT_FAILURE);
+    } else if (window_size > 0) {
+        serve_connections(sockfd, inet_addr("127.0.0.1"), SERVER_PID, window_size, echo);
+    } else {
+        handle_client_connection(sockfd, inet_addr("127.0.0.1"),inet_addr("127.0.0.1"),500);
+    }
 
     close(sockfd);
     return 0;
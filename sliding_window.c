@@ -0,0 +1,728 @@
+//
+// Created by dustyn on 6/16/24.
+//
+
+#include <stdbool.h>
+#include "sliding_window.h"
+#include "packet_pool.h"
+#include "stats.h"
+#include "log.h"
+
+/*
+ * Up until now the protocol was stop and wait at the collection level. We blast out a collection, sit there until the other side
+ * has all of it, and only then does the next one go. On a link with any real latency that means the pipe sits empty for a whole
+ * round trip between every collection.
+ *
+ * Sliding window mode fixes that. Sequence numbers keep counting up across messages instead of starting at 0 for every collection,
+ * and the sender is allowed to have up to window_size packets out that have not been ACKed yet. Every ACK carries the next sequence
+ * the receiver is waiting on, which ACKs everything before it in one go, plus a bitmap (SACK, selective ACK) of which packets after
+ * that have already shown up. As soon as the base of the window gets ACKed it slides forward and more packets go out, so the pipe
+ * stays full. When the bitmap shows holes we resend just the holes, not everything after the first loss.
+ *
+ * Sequence numbers are 32 bits and wrap, so every comparison is done on the difference between two of them, serial number arithmetic
+ * (RFC 1982). Two sequences are never more than the send queue's length apart so the difference is always the short way round.
+ */
+
+#define TRANSMIT_CHUNK 256
+
+static uint32_t sequence_distance(uint32_t from, uint32_t to) {
+    return to - from;
+}
+
+/*
+ * The smallest power of 2 that is at least count
+ */
+static uint32_t round_up_power_of_2(uint32_t count) {
+    uint32_t size = 1;
+    while (size < count) {
+        size <<= 1;
+    }
+    return size;
+}
+
+uint16_t send_window_init(SendWindow *window, uint16_t window_size, int socket, const struct sockaddr_in *destination,
+                          RetransmitTimer *timer) {
+    memset(window, 0, sizeof(SendWindow));
+
+    if (window_size == 0) {
+        window_size = DEFAULT_WINDOW_SIZE;
+    } else if (window_size > MAX_WINDOW_SIZE) {
+        window_size = MAX_WINDOW_SIZE;
+    }
+
+    uint32_t queue_size = round_up_power_of_2(SEND_QUEUE_WINDOWS * window_size);
+    window->queue = calloc(queue_size, sizeof(Packet *));
+    window->sent_at_us = calloc(queue_size, sizeof(uint64_t));
+    window->deadline_ms = calloc(queue_size, sizeof(uint64_t));
+    window->sacked = calloc(queue_size, sizeof(uint8_t));
+    window->retransmitted = calloc(queue_size, sizeof(uint8_t));
+    window->transmissions = calloc(queue_size, sizeof(uint8_t));
+    window->timer = timer;
+    if (window->queue == NULL || window->sent_at_us == NULL || window->deadline_ms == NULL || window->sacked == NULL ||
+        window->retransmitted == NULL || window->transmissions == NULL) {
+        perror("calloc");
+        send_window_destroy(window, NULL);
+        return ERROR;
+    }
+    window->queue_size = (uint16_t) queue_size;
+    window->queue_mask = queue_size - 1;
+    window->window_size = window_size;
+    window->peer_window = window_size;
+    window->socket = socket;
+    window->destination = destination;
+    congestion_init(&window->congestion, NULL, window_size);
+    pacer_init(&window->pacer, pacing_default_rate(), pacing_default_txtime() && pacer_socket_has_txtime(socket));
+    timer_init(&window->pace_timer, send_window_pace_handler, window);
+    return SUCCESS;
+}
+
+uint16_t send_window_in_flight(SendWindow *window) {
+    return sequence_distance(window->base, window->next);
+}
+
+/*
+ * How many packets we may have in flight, the smallest of our own window, what the receiver has room for and what the network
+ * will take. A receiver with no room at all still gets one packet at a time to probe with.
+ */
+uint16_t send_window_limit(SendWindow *window) {
+    uint32_t limit = window->congestion.cwnd < window->window_size ? window->congestion.cwnd : window->window_size;
+    if (window->peer_window < limit) {
+        limit = window->peer_window;
+    }
+    return limit > 0 ? (uint16_t) limit : 1;
+}
+
+/*
+ * How many more packets can be queued.
+ */
+uint16_t send_window_free(SendWindow *window) {
+    return window->queue_size - sequence_distance(window->base, window->tail);
+}
+
+/*
+ * Something in flight went missing. Only the first loss in a window counts, everything sent before we noticed
+ * was sent at the old rate and will see the same queue.
+ */
+static void send_window_congestion_event(SendWindow *window, uint8_t timed_out) {
+    uint64_t now_us = monotonic_us();
+
+    //A receiver with no room drops our probes, that says nothing about the network
+    if (window->peer_window == 0) {
+        return;
+    }
+
+    if (timed_out) {
+        congestion_on_timeout(&window->congestion, now_us);
+    } else if (!window->in_recovery) {
+        congestion_on_loss(&window->congestion, now_us);
+    } else {
+        return;
+    }
+    window->in_recovery = 1;
+    window->recovery_point = window->next;
+}
+
+/*
+ * Keep the retransmit timer armed for the earliest deadline of anything still in flight and not selectively ACKed,
+ * or disarm it if there is nothing left waiting on an ACK.
+ */
+static void send_window_rearm(SendWindow *window) {
+
+    uint64_t earliest = UINT64_MAX;
+
+    for (uint32_t sequence = window->base; sequence != window->next; sequence++) {
+        uint32_t slot = sequence & window->queue_mask;
+        if (!window->sacked[slot] && window->deadline_ms[slot] < earliest) {
+            earliest = window->deadline_ms[slot];
+        }
+    }
+
+    if (earliest == UINT64_MAX) {
+        timer_wheel_cancel(window->timer->wheel, &window->timer->timer);
+        return;
+    }
+
+    uint64_t now = monotonic_ms();
+    timer_wheel_schedule(window->timer->wheel, &window->timer->timer, earliest > now ? (uint32_t) (earliest - now) : 0);
+}
+
+/*
+ * Stamp a packet that is about to go out with its send time and retransmit deadline.
+ */
+static void send_window_stamp(SendWindow *window, uint32_t sequence, uint64_t now_us) {
+    uint32_t slot = sequence & window->queue_mask;
+    window->sent_at_us[slot] = now_us;
+    window->deadline_ms[slot] = now_us / 1000 + window->timer->rtt.rto_ms;
+    if (window->transmissions[slot] < UINT8_MAX) {
+        window->transmissions[slot]++;
+    }
+}
+
+/*
+ * Take a packetized collection and put it on the end of the send queue. The packets get restamped with their place
+ * in the stream, and packet_end is moved along with them so it still marks the last packet of this message.
+ * Returns how many packets made it onto the queue, if the queue is full the rest have to wait for some ACKs.
+ */
+uint16_t send_window_queue(SendWindow *window, Packet *packets[], uint16_t num_packets) {
+
+    uint16_t queued = 0;
+
+    for (uint16_t i = 0; i < num_packets; i++) {
+        if (sequence_distance(window->base, window->tail) >= window->queue_size) {
+            break;
+        }
+
+        Header *header = packets[i]->iov[1].iov_base;
+        uint32_t packets_left_in_message = sequence_distance(header->sequence, header->packet_end);
+        header->sequence = window->tail;
+        header->packet_end = window->tail + packets_left_in_message;
+
+        uint32_t slot = window->tail & window->queue_mask;
+        window->queue[slot] = packets[i];
+        window->sacked[slot] = 0;
+        window->retransmitted[slot] = 0;
+        window->transmissions[slot] = 0;
+        window->tail++;
+        queued++;
+    }
+    return queued;
+}
+
+/*
+ * Stamp the ACK the other direction owes onto a batch of data packets about to go out, that ACK is then paid and nothing separate
+ * needs sending. Packets going out again get the flag cleared if nothing is owed, we don't want an old bitmap read as current.
+ * Returns whether an ACK went on the batch.
+ */
+static uint8_t send_window_piggyback(SendWindow *window, Packet *batch[], uint16_t count) {
+
+    if (window->piggyback == NULL) {
+        return 0;
+    }
+
+    ReceiveWindow *reverse = window->piggyback;
+    uint8_t owed = receive_window_ack_owed(reverse);
+    uint32_t sack_bitmap = owed ? receive_window_sack(reverse) : 0;
+
+    uint16_t advertised = owed ? receive_window_advertise(reverse) : 0;
+
+    for (uint16_t i = 0; i < count; i++) {
+        Header *header = batch[i]->iov[1].iov_base;
+        if (owed) {
+            header->flags |= HEADER_FLAG_ACK;
+            header->ack = reverse->expected;
+            header->window = advertised;
+            header->sack_bitmap = sack_bitmap;
+        } else {
+            header->flags &= ~HEADER_FLAG_ACK;
+        }
+    }
+
+    if (owed) {
+        receive_window_acked(reverse);
+    }
+    return owed;
+}
+
+/*
+ * The socket filled up and the last count packets we stamped never went out. Move next back to the first of them so they are
+ * not in flight, take back the transmission we counted, and let the owner know to try again once the socket has room.
+ */
+static void send_window_unsend(SendWindow *window, uint16_t count) {
+    for (uint16_t i = 0; i < count; i++) {
+        window->next--;
+        window->transmissions[window->next & window->queue_mask]--;
+    }
+    window->blocked = 1;
+    if (window->on_blocked != NULL) {
+        window->on_blocked(window->blocked_context);
+    }
+    /*
+     * ENOBUFS comes from the device queue, the socket itself may never stop being writable so nobody would hear it has room again.
+     * Try again on our own shortly in any case.
+     */
+    timer_wheel_schedule(window->timer->wheel, &window->pace_timer, 1);
+}
+
+/*
+ * A configured rate wins, otherwise a window per smoothed RTT. Until there is an RTT sample we have nothing to go on and don't pace.
+ */
+static void send_window_update_pacing(SendWindow *window) {
+    double rate = pacing_default_rate();
+    RttEstimator *rtt = &window->timer->rtt;
+
+    if (rate <= 0 && rtt->has_sample && rtt->srtt_us > 0) {
+        CongestionControl *cc = &window->congestion;
+        double gain = cc->cwnd < cc->ssthresh ? PACING_GAIN_SLOW_START : PACING_GAIN;
+        rate = gain * (double) send_window_limit(window) * 1e6 / (double) rtt->srtt_us;
+    }
+    pacer_set_rate(&window->pacer, rate);
+}
+
+/*
+ * Push out everything that is queued and fits in the window, in batches, as far as the pacer lets us. With SO_TXTIME the pacer
+ * doesn't hold anything back, it stamps each packet with when it should leave instead.
+ * Anything that fails to send is still counted as sent, it will come back around as a hole in the SACK bitmap or on a timeout.
+ * A full socket is different, we stop there and leave the rest queued (see send_window_unsend()).
+ */
+uint16_t send_window_transmit(SendWindow *window) {
+
+    Packet *batch[TRANSMIT_CHUNK];
+    uint32_t failed[TRANSMIT_CHUNK];
+    uint64_t departures_ns[TRANSMIT_CHUNK];
+    uint16_t sent = 0;
+    uint16_t stamped = 0;
+    uint64_t now_us = monotonic_us();
+
+    window->blocked = 0;
+    uint16_t limit = send_window_limit(window);
+    send_window_update_pacing(window);
+    uint32_t allowance = window->pacer.txtime ? PACING_UNLIMITED : pacer_allowance(&window->pacer, now_us);
+
+    while (window->next != window->tail && send_window_in_flight(window) < limit && allowance > 0) {
+
+        uint16_t count = 0;
+        while (count < TRANSMIT_CHUNK && count < allowance && window->next != window->tail &&
+               send_window_in_flight(window) < limit) {
+            if (window->pacer.txtime) {
+                departures_ns[count] = pacer_departure_ns(&window->pacer, now_us * 1000);
+            }
+            batch[count++] = window->queue[window->next & window->queue_mask];
+            send_window_stamp(window, window->next, now_us);
+            window->next++;
+        }
+
+        uint8_t acked = send_window_piggyback(window, batch, count);
+        uint16_t attempted;
+        uint16_t failed_packets = send_packet_batch_at(window->socket, window->destination, count, batch, failed, SEND_BATCH_SIZE,
+                                                       window->pacer.txtime ? departures_ns : NULL, &attempted);
+        if (failed_packets == ERROR) {
+            return ERROR;
+        }
+        if (attempted < count) {
+            send_window_unsend(window, count - attempted);
+            //Nothing carried the ACK after all, it is still owed
+            if (attempted == 0 && acked) {
+                window->piggyback->ack_now = 1;
+            }
+            count = attempted;
+        }
+        sent += count - failed_packets;
+        stamped += count;
+        window->packets_sent += count;
+        pacer_consume(&window->pacer, count);
+        allowance -= allowance == PACING_UNLIMITED ? 0 : count;
+        if (window->blocked) {
+            break;
+        }
+    }
+
+    //Held back by the pacer rather than the window, come back when the next packet is due
+    if (!window->blocked && window->next != window->tail && send_window_in_flight(window) < limit && allowance == 0) {
+        uint64_t delay_us = pacer_delay_us(&window->pacer, 1);
+        timer_wheel_schedule(window->timer->wheel, &window->pace_timer, (uint32_t) ((delay_us + 999) / 1000));
+    }
+
+    /*
+     * Go by what was stamped, not what made it onto the wire. A batch that failed outright (EAGAIN, ENOBUFS) with nothing else
+     * in flight still has deadlines, and the timer is the only thing that will ever come back for it.
+     */
+    if (stamped > 0 && !window->timer->timer.armed) {
+        send_window_rearm(window);
+    }
+    return sent;
+}
+
+/*
+ * Resend a list of sequences in one batch, they are marked SECOND_SEND so the other side knows what they are.
+ */
+static uint16_t send_window_resend(SendWindow *window, uint32_t sequences[], uint16_t count) {
+
+    Packet *batch[TRANSMIT_CHUNK];
+    uint32_t failed[TRANSMIT_CHUNK];
+    uint16_t done = 0;
+    uint64_t now_us = monotonic_us();
+
+    while (done < count) {
+        uint16_t chunk = 0;
+        while (chunk < TRANSMIT_CHUNK && done + chunk < count) {
+            Packet *packet = window->queue[sequences[done + chunk] & window->queue_mask];
+            ((Header *) packet->iov[1].iov_base)->status = SECOND_SEND;
+            send_window_stamp(window, sequences[done + chunk], now_us);
+            batch[chunk++] = packet;
+        }
+        send_window_piggyback(window, batch, chunk);
+        if (send_packet_batch(window->socket, window->destination, chunk, batch, failed, SEND_BATCH_SIZE) == ERROR) {
+            return ERROR;
+        }
+        done += chunk;
+        window->packets_sent += chunk;
+        window->packets_retransmitted += chunk;
+        STATS_ADD(retransmits, chunk);
+        pacer_consume(&window->pacer, chunk);
+    }
+    return done;
+}
+
+/*
+ * An ACK came in. Everything before ack is done with and goes back to the pool, which also drops the pin on the
+ * caller's buffer for zero copy packets. The newest of those gives us an RTT sample if it only went out once.
+ * Then we look at the SACK bitmap, anything before the highest selectively ACKed packet that is not in the bitmap is a hole
+ * and gets resent once. After that the window has moved so we fill it back up and rearm the timer for whatever is left.
+ * Newly ACKed packets open the congestion window, unless we are still recovering from a loss, and holes close it.
+ * peer_window is the receiver's advertised window, it counts from ack.
+ *
+ * Returns how many holes were resent, or ERROR.
+ */
+uint16_t send_window_handle_ack(SendWindow *window, PacketPool *pool, uint32_t ack, uint32_t sack_bitmap, uint16_t peer_window) {
+
+    //An ACK for something we have not sent yet, or from before the window, is stale or bogus
+    if (sequence_distance(window->base, ack) > send_window_in_flight(window)) {
+        return 0;
+    }
+
+    window->peer_window = peer_window;
+    if (peer_window == 0) {
+        //It is there and answering, it just has no room. Probing goes on for as long as that lasts
+        window->timer->num_timeouts = 0;
+    }
+
+    if (window->base != ack) {
+        uint64_t now_us = monotonic_us();
+        uint32_t newest = (ack - 1) & window->queue_mask;
+        if (window->transmissions[newest] == 1) {
+            rtt_estimator_sample(&window->timer->rtt, now_us - window->sent_at_us[newest]);
+        }
+        //The window moved so whatever was going wrong has cleared up, backoff starts over
+        window->timer->num_timeouts = 0;
+
+        if (window->in_recovery && sequence_distance(window->base, window->recovery_point) <= sequence_distance(window->base, ack)) {
+            window->in_recovery = 0;
+        }
+        if (!window->in_recovery) {
+            congestion_on_ack(&window->congestion, sequence_distance(window->base, ack), window->timer->rtt.srtt_us, now_us);
+        }
+    }
+
+    while (window->base != ack) {
+        uint32_t slot = window->base & window->queue_mask;
+        free_packet(pool, &window->queue[slot]);
+        window->sacked[slot] = 0;
+        window->retransmitted[slot] = 0;
+        window->transmissions[slot] = 0;
+        window->base++;
+    }
+
+    uint32_t highest_sacked = window->base;
+    bool have_sack = false;
+    for (int i = 0; i < SACK_BITS; i++) {
+        if ((sack_bitmap & (1U << i)) == 0) {
+            continue;
+        }
+        uint32_t sequence = ack + 1 + i;
+        if (sequence_distance(window->base, sequence) >= send_window_in_flight(window)) {
+            break;
+        }
+        window->sacked[sequence & window->queue_mask] = 1;
+        highest_sacked = sequence;
+        have_sack = true;
+    }
+
+    uint32_t holes[SACK_BITS + 1];
+    uint16_t num_holes = 0;
+    if (have_sack) {
+        for (uint32_t sequence = window->base; sequence != highest_sacked; sequence++) {
+            uint32_t slot = sequence & window->queue_mask;
+            if (!window->sacked[slot] && !window->retransmitted[slot]) {
+                window->retransmitted[slot] = 1;
+                holes[num_holes++] = sequence;
+            }
+        }
+    }
+
+    if (num_holes > 0) {
+        send_window_congestion_event(window, 0);
+        if (send_window_resend(window, holes, num_holes) == ERROR) {
+            return ERROR;
+        }
+    }
+
+    if (send_window_transmit(window) == ERROR) {
+        return ERROR;
+    }
+    send_window_rearm(window);
+    return num_holes;
+}
+
+/*
+ * The retransmit timer went off, so at least one packet in flight is past its deadline. Back off the RTO, then resend every
+ * packet whose deadline has passed and that has not been selectively ACKed, each one gets a fresh deadline. Packets that still
+ * have time left are left alone, that is the point of keeping a deadline per packet. A timeout means nothing at all is getting
+ * through, so the congestion window drops right back down and new data goes out one packet at a time again.
+ *
+ * Returns how many packets were resent, or ERROR if we have timed out too many times in a row and should give up.
+ */
+uint16_t send_window_handle_timeout(SendWindow *window) {
+
+    if (retransmit_timer_backoff(window->timer) != SUCCESS) {
+        return ERROR;
+    }
+    send_window_congestion_event(window, 1);
+
+    uint32_t resend[TRANSMIT_CHUNK];
+    uint16_t count = 0;
+    uint16_t total = 0;
+    uint64_t now = monotonic_ms();
+
+    for (uint32_t sequence = window->base; sequence != window->next; sequence++) {
+        uint32_t slot = sequence & window->queue_mask;
+        if (window->sacked[slot] || window->deadline_ms[slot] > now) {
+            continue;
+        }
+        window->retransmitted[slot] = 0;
+        resend[count++] = sequence;
+        if (count == TRANSMIT_CHUNK) {
+            if (send_window_resend(window, resend, count) == ERROR) {
+                return ERROR;
+            }
+            total += count;
+            count = 0;
+        }
+    }
+
+    if (count > 0 && send_window_resend(window, resend, count) == ERROR) {
+        return ERROR;
+    }
+    send_window_rearm(window);
+    return total + count;
+}
+
+/*
+ * Timer wheel callback, context is the SendWindow. Giving up shows up as num_timeouts going past MAX_RETRANSMITS.
+ */
+void send_window_timeout_handler(Timer *timer, void *context) {
+    SendWindow *window = context;
+    if (send_window_handle_timeout(window) == ERROR) {
+        LOG_WARN("Max timeout reached");
+    }
+}
+
+/*
+ * Timer wheel callback, context is the SendWindow. The pacer has tokens again for whatever it was holding back.
+ */
+void send_window_pace_handler(Timer *timer, void *context) {
+    SendWindow *window = context;
+    if (send_window_transmit(window) == ERROR) {
+        LOG_WARN("Error sending paced packets");
+    }
+}
+
+void send_window_destroy(SendWindow *window, PacketPool *pool) {
+    timer_wheel_cancel(window->timer->wheel, &window->timer->timer);
+    timer_wheel_cancel(window->timer->wheel, &window->pace_timer);
+    while (window->base != window->tail) {
+        free_packet(pool, &window->queue[window->base & window->queue_mask]);
+        window->base++;
+    }
+    free(window->queue);
+    free(window->sent_at_us);
+    free(window->deadline_ms);
+    free(window->sacked);
+    free(window->retransmitted);
+    free(window->transmissions);
+    window->queue = NULL;
+    window->sent_at_us = NULL;
+    window->deadline_ms = NULL;
+    window->sacked = NULL;
+    window->retransmitted = NULL;
+    window->transmissions = NULL;
+    window->queue_size = 0;
+}
+
+uint16_t receive_window_init(ReceiveWindow *window, uint16_t window_size) {
+    memset(window, 0, sizeof(ReceiveWindow));
+
+    if (window_size == 0) {
+        window_size = DEFAULT_WINDOW_SIZE;
+    } else if (window_size > MAX_WINDOW_SIZE) {
+        window_size = MAX_WINDOW_SIZE;
+    }
+
+    uint32_t slots = round_up_power_of_2(window_size);
+    window->out_of_order = calloc(slots, sizeof(Packet *));
+    if (window->out_of_order == NULL) {
+        perror("calloc");
+        return ERROR;
+    }
+    window->slots_mask = slots - 1;
+    window->window_size = window_size;
+    window->advertised = window_size;
+    return SUCCESS;
+}
+
+/*
+ * Tell the window how much room whoever it delivers to has, without it the consumer is assumed to take anything.
+ */
+void receive_window_set_space(ReceiveWindow *window, space_fn space, void *context) {
+    window->space = space;
+    window->space_context = context;
+}
+
+/*
+ * How many packets from expected onwards we could take right now.
+ */
+uint16_t receive_window_space(ReceiveWindow *window) {
+    uint16_t space = window->window_size;
+
+    if (window->space != NULL) {
+        uint16_t consumer = window->space(window->space_context);
+        if (consumer < space) {
+            space = consumer;
+        }
+    }
+    return space;
+}
+
+/*
+ * The window to put on an ACK that is about to go out.
+ */
+uint16_t receive_window_advertise(ReceiveWindow *window) {
+    window->advertised = receive_window_space(window);
+    return window->advertised;
+}
+
+/*
+ * Once the consumer has freed up a quarter of the window or more since we last advertised, the sender should hear about it
+ * now. It may be sitting on a zero window waiting to probe. Returns 1 if that makes an ACK due.
+ */
+uint8_t receive_window_check_update(ReceiveWindow *window) {
+    uint16_t space = receive_window_space(window);
+    uint16_t threshold = window->window_size / 4 > 0 ? window->window_size / 4 : 1;
+
+    if (space > window->advertised && space - window->advertised >= threshold) {
+        window->ack_now = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Hand an incoming data packet to the window. If it is the one we were waiting on it gets delivered right away, straight out
+ * of the receive ring, followed by anything we were holding that is now in order. If it is further ahead but still inside the
+ * window we hold on to a copy of it. Duplicates and anything outside the window are dropped, and so is anything the consumer has no
+ * room for, the sender will have it again once it hears there is room.
+ *
+ * Returns how many packets were delivered, or ERROR if we could not get a block to hold an out of order packet.
+ */
+uint16_t receive_window_accept(ReceiveWindow *window, PacketPool *pool, Packet *packet, deliver_fn deliver, void *context) {
+
+    Header *head = packet->iov[1].iov_base;
+    uint32_t offset = sequence_distance(window->expected, head->sequence);
+    uint16_t delivered = 0;
+
+    //Bigger than we could hold on to, and bigger than we ever told the peer we take
+    if (head->msg_size > pool->payload_size) {
+        return 0;
+    }
+
+    //Anything but the next packet in order means loss, reordering or a lost ACK, the sender wants to hear about all of those now
+    if (offset != 0) {
+        window->ack_now = 1;
+    }
+
+    //Past what we have room for, a probe or a sender that hasn't heard the window shrink yet
+    if (offset < window->window_size && offset >= receive_window_space(window)) {
+        window->ack_now = 1;
+        return 0;
+    }
+
+    if (offset == 0) {
+        deliver(packet->iov[2].iov_base, head->msg_size, context);
+        window->expected++;
+        delivered++;
+
+        Packet **held = &window->out_of_order[window->expected & window->slots_mask];
+        while (*held != NULL) {
+            Header *held_head = (*held)->iov[1].iov_base;
+            deliver((*held)->iov[2].iov_base, held_head->msg_size, context);
+            free_packet(pool, held);
+            window->buffered--;
+            window->expected++;
+            delivered++;
+            held = &window->out_of_order[window->expected & window->slots_mask];
+        }
+        window->unacked += delivered;
+        return delivered;
+    }
+
+    //Behind the window, something we already delivered
+    if (offset >= window->window_size) {
+        STATS_ADD(duplicates, 1);
+        return 0;
+    }
+
+    Packet **slot = &window->out_of_order[head->sequence & window->slots_mask];
+    if (*slot != NULL) {
+        STATS_ADD(duplicates, 1);
+        return 0;
+    }
+
+    if (allocate_packet(pool, slot) != SUCCESS) {
+        return ERROR;
+    }
+    memcpy((*slot)->iov[0].iov_base, packet->iov[0].iov_base, sizeof(struct iphdr));
+    memcpy((*slot)->iov[1].iov_base, head, HEADER_SIZE);
+    memcpy((*slot)->iov[2].iov_base, packet->iov[2].iov_base, head->msg_size);
+    window->buffered++;
+    return 0;
+}
+
+/*
+ * Build the selective ACK bitmap, bit i means expected + 1 + i is sitting in the window.
+ */
+uint32_t receive_window_sack(ReceiveWindow *window) {
+
+    uint32_t bitmap = 0;
+
+    if (window->buffered == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < SACK_BITS && i + 1 < window->window_size; i++) {
+        uint32_t sequence = window->expected + 1 + i;
+        if (window->out_of_order[sequence & window->slots_mask] != NULL) {
+            bitmap |= 1U << i;
+        }
+    }
+    return bitmap;
+}
+
+/*
+ * Whether the sender is waiting to hear from us at all, and whether it should hear right now rather than after DELAYED_ACK_MS.
+ * Anything still held out of order keeps it urgent, the sender needs the bitmap to fill the holes.
+ */
+uint8_t receive_window_ack_owed(ReceiveWindow *window) {
+    return window->unacked > 0 || window->ack_now;
+}
+
+uint8_t receive_window_ack_urgent(ReceiveWindow *window) {
+    return window->ack_now || window->buffered > 0 || window->unacked >= DELAYED_ACK_PACKETS;
+}
+
+/*
+ * An ACK covering everything so far has gone out, on its own or riding on data.
+ */
+void receive_window_acked(ReceiveWindow *window) {
+    window->unacked = 0;
+    window->ack_now = 0;
+}
+
+void receive_window_destroy(ReceiveWindow *window, PacketPool *pool) {
+    for (uint32_t i = 0; window->out_of_order != NULL && i <= window->slots_mask; i++) {
+        if (window->out_of_order[i] != NULL) {
+            free_packet(pool, &window->out_of_order[i]);
+        }
+    }
+    free(window->out_of_order);
+    window->out_of_order = NULL;
+    window->buffered = 0;
+}
@@ -0,0 +1,164 @@
+//
+// Created by dustyn on 6/16/24.
+//
+#include "dustyns_transport_layer.h"
+#include "timer_wheel.h"
+#include "congestion.h"
+#include "pacing.h"
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_SLIDING_WINDOW_H
+#define UNIXCUSTOMTRANSPORTLAYER_SLIDING_WINDOW_H
+
+#define DEFAULT_WINDOW_SIZE 64
+#define MAX_WINDOW_SIZE 1024
+/*
+ * The send queue holds this many windows' worth of packets, one in flight and the next one queued up behind it. It is rounded up to
+ * a power of 2 so masking a sequence number gives the same slot before and after it wraps, same for the receive window's slots.
+ */
+#define SEND_QUEUE_WINDOWS 2
+#define SACK_BITS 32
+/*
+ * Delayed ACKs. The receiver only ACKs straight away once this many in order packets are waiting on one, anything else waits up to
+ * DELAYED_ACK_MS for more data to cover or for data of our own going the other way to carry it. That has to stay well under MIN_RTO_MS
+ * or the sender will start resending things that arrived fine.
+ */
+#define DELAYED_ACK_PACKETS 2
+#define DELAYED_ACK_MS 2
+
+/*
+ * Sender side. Every packet from base up to tail has been queued and not ACKed yet, the ones from base up to next
+ * have actually been sent. We never let next get more than window_size past base.
+ *
+ * Every packet in flight has its own retransmit deadline, the window's retransmit timer is kept armed for the earliest one.
+ * transmissions counts how many times a packet has gone out, only packets sent once give us an RTT sample.
+ *
+ * If piggyback is set, it is the receive window for the other direction of the same connection and every data packet we send
+ * carries whatever ACK it owes, so traffic going both ways doesn't need separate ACKs.
+ *
+ * window_size is only what the receiver can take, congestion decides how much of that the network gets. After a loss we are in
+ * recovery until base gets past recovery_point (what had been sent when we noticed), more holes from that same window are the
+ * same congestion event and don't shrink cwnd again.
+ *
+ * peer_window is the last window the receiver advertised, packets from base up to base + peer_window are all it has room for.
+ * If that is 0 we still keep one packet out as a probe, its ACK is how we hear the window has opened again.
+ *
+ * What the windows allow doesn't all go out at once either, pacer spreads it over a round trip. If the pacer holds packets back,
+ * pace_timer brings us back to send them once there are tokens for them.
+ *
+ * The per packet arrays are queue_size long, sized from window_size when the window is set up rather than for the biggest window
+ * anybody could ask for, a connection with a small window stays small.
+ *
+ * blocked is set when the socket was full and some of what we meant to send never went out, next was moved back to the first of
+ * them. on_blocked (if set) is told so whoever owns the socket can call send_window_transmit() again once it has room.
+ */
+typedef void (*blocked_fn)(void *context);
+
+typedef struct SendWindow {
+    Packet **queue;
+    uint64_t *sent_at_us;
+    uint64_t *deadline_ms;
+    uint8_t *sacked;
+    uint8_t *retransmitted;
+    uint8_t *transmissions;
+    RetransmitTimer *timer;
+    struct ReceiveWindow *piggyback;
+    blocked_fn on_blocked;
+    void *blocked_context;
+    const struct sockaddr_in *destination;
+    CongestionControl congestion;
+    Pacer pacer;
+    Timer pace_timer;
+    uint64_t packets_sent;
+    uint64_t packets_retransmitted;
+    int socket;
+    uint32_t base;
+    uint32_t next;
+    uint32_t tail;
+    uint32_t recovery_point;
+    uint32_t queue_mask;
+    uint16_t queue_size;
+    uint16_t window_size;
+    uint16_t peer_window;
+    uint8_t in_recovery;
+    uint8_t blocked;
+} SendWindow;
+
+typedef void (*deliver_fn)(const char *data, size_t length, void *context);
+
+/*
+ * How many more packets whatever data gets delivered to can take right now.
+ */
+typedef uint16_t (*space_fn)(void *context);
+
+/*
+ * Receiver side. expected is the next sequence we can deliver, anything that shows up inside the window past that
+ * gets held (copied into a pool block, the receive ring slot it came in on will be reused) until the gap fills in.
+ *
+ * unacked counts in order packets delivered since our last ACK went out, ack_now is set by anything the sender should hear about
+ * right away, a packet out of order or one we already had.
+ *
+ * The window we advertise is window_size, or less if space says whoever we deliver to is running out of room. Anything past
+ * what we advertised is dropped rather than delivered into a consumer that can't take it. advertised is the last window we sent,
+ * once there is a good deal more room than that the sender hears about it straight away instead of waiting on its next probe.
+ *
+ * out_of_order has slots_mask + 1 slots, window_size rounded up to a power of 2.
+ */
+typedef struct ReceiveWindow {
+    Packet **out_of_order;
+    space_fn space;
+    void *space_context;
+    uint32_t expected;
+    uint32_t slots_mask;
+    uint16_t window_size;
+    uint16_t buffered;
+    uint16_t unacked;
+    uint16_t advertised;
+    uint8_t ack_now;
+} ReceiveWindow;
+
+uint16_t send_window_init(SendWindow *window, uint16_t window_size, int socket, const struct sockaddr_in *destination,
+                      RetransmitTimer *timer);
+
+uint16_t send_window_queue(SendWindow *window, Packet *packets[], uint16_t num_packets);
+
+uint16_t send_window_transmit(SendWindow *window);
+
+uint16_t send_window_handle_ack(SendWindow *window, PacketPool *pool, uint32_t ack, uint32_t sack_bitmap, uint16_t peer_window);
+
+uint16_t send_window_handle_timeout(SendWindow *window);
+
+void send_window_timeout_handler(Timer *timer, void *context);
+
+void send_window_pace_handler(Timer *timer, void *context);
+
+uint16_t send_window_in_flight(SendWindow *window);
+
+uint16_t send_window_limit(SendWindow *window);
+
+uint16_t send_window_free(SendWindow *window);
+
+void send_window_destroy(SendWindow *window, PacketPool *pool);
+
+uint16_t receive_window_init(ReceiveWindow *window, uint16_t window_size);
+
+void receive_window_set_space(ReceiveWindow *window, space_fn space, void *context);
+
+uint16_t receive_window_space(ReceiveWindow *window);
+
+uint16_t receive_window_advertise(ReceiveWindow *window);
+
+uint8_t receive_window_check_update(ReceiveWindow *window);
+
+uint16_t receive_window_accept(ReceiveWindow *window, PacketPool *pool, Packet *packet, deliver_fn deliver, void *context);
+
+uint32_t receive_window_sack(ReceiveWindow *window);
+
+uint8_t receive_window_ack_owed(ReceiveWindow *window);
+
+uint8_t receive_window_ack_urgent(ReceiveWindow *window);
+
+void receive_window_acked(ReceiveWindow *window);
+
+void receive_window_destroy(ReceiveWindow *window, PacketPool *pool);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_SLIDING_WINDOW_H
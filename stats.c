@@ -0,0 +1,246 @@
+//
+// Created by dustyn on 7/29/24.
+//
+
+#include <stdbool.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stats.h"
+#include "timer_wheel.h"
+
+/*
+ * Until now the only way to see what the stack was doing was the printing it does on every packet, which costs more than most of what
+ * it reports on. These are counters instead, kept per thread so keeping them costs a load and a store, and published in a memory mapped
+ * file (a path under /dev/shm keeps it in memory) that dtl-stat, or anything else, can map read only and look at whenever it likes.
+ * Nothing the reader does touches the data path.
+ *
+ * Counting happens whether or not there is a segment, a thread that was never attached counts into a scratch block nobody reads.
+ * Connection slots are only handed out once a segment is open.
+ */
+
+static StatsCounters stats_scratch;
+__thread StatsCounters *stats_thread = &stats_scratch;
+
+static StatsSegment *segment;
+static char segment_path[256];
+
+/*
+ * Create the segment at path, replacing whatever was there, and attach the calling thread to the first counter block.
+ * Only meant to be called once at startup before any worker threads are running.
+ */
+uint16_t stats_open(const char *path) {
+    if (strlen(path) >= sizeof(segment_path)) {
+        fprintf(stderr, "Stats path too long\n");
+        return ERROR;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return ERROR;
+    }
+    if (ftruncate(fd, sizeof(StatsSegment)) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return ERROR;
+    }
+
+    void *mapped = mmap(NULL, sizeof(StatsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        perror("mmap");
+        return ERROR;
+    }
+
+    segment = mapped;
+    segment->version = STATS_VERSION;
+    segment->max_threads = STATS_MAX_THREADS;
+    segment->max_connections = STATS_MAX_CONNECTIONS;
+    segment->pid = (uint64_t) getpid();
+    segment->started_us = monotonic_us();
+    //Last, a reader that finds the magic finds everything else filled in
+    __atomic_store_n(&segment->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+    strcpy(segment_path, path);
+    stats_attach_thread(0);
+    return SUCCESS;
+}
+
+/*
+ * Unmap and remove the segment, a reader still holding it mapped keeps the last numbers.
+ */
+void stats_close() {
+    if (segment == NULL) {
+        return;
+    }
+    munmap(segment, sizeof(StatsSegment));
+    unlink(segment_path);
+    segment = NULL;
+    stats_thread = &stats_scratch;
+}
+
+uint8_t stats_enabled() {
+    return segment != NULL;
+}
+
+/*
+ * From now on this thread counts into block index. Every thread that handles packets should have a block of its own.
+ */
+void stats_attach_thread(uint16_t index) {
+    if (segment != NULL && index < STATS_MAX_THREADS) {
+        stats_thread = &segment->threads[index];
+    }
+}
+
+void stats_record_rtt(uint64_t sample_us) {
+    uint32_t bucket = 0;
+    while (bucket < STATS_RTT_BUCKETS - 1 && sample_us >= (1ULL << bucket)) {
+        bucket++;
+    }
+    STATS_ADD(rtt_samples[bucket], 1);
+}
+
+/*
+ * A free connection slot for the calling thread, or -1 if there is no segment or every slot is taken. Threads claim slots with a
+ * compare and swap, this only happens when a connection is set up.
+ */
+int32_t stats_claim_connection(uint32_t peer_ip, uint16_t peer_pid) {
+    if (segment == NULL) {
+        return -1;
+    }
+
+    for (uint32_t slot = 0; slot < STATS_MAX_CONNECTIONS; slot++) {
+        StatsConnection *connection = &segment->connections[slot];
+        uint32_t free_slot = 0;
+        if (__atomic_load_n(&connection->in_use, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&connection->in_use, &free_slot, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            StatsConnection values;
+            memset(&values, 0, sizeof(values));
+            values.peer_ip = peer_ip;
+            values.peer_pid = peer_pid;
+            stats_publish_connection((int32_t) slot, &values);
+            return (int32_t) slot;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Copy values into a slot we own. The sequence goes odd, the fields are written, the sequence goes even again.
+ */
+void stats_publish_connection(int32_t slot, const StatsConnection *values) {
+    if (segment == NULL || slot < 0) {
+        return;
+    }
+
+    StatsConnection *connection = &segment->connections[slot];
+    uint32_t sequence = connection->sequence;
+    __atomic_store_n(&connection->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    connection->peer_ip = values->peer_ip;
+    connection->peer_pid = values->peer_pid;
+    connection->thread = (uint16_t) (stats_thread - segment->threads);
+    connection->packets_sent = values->packets_sent;
+    connection->packets_retransmitted = values->packets_retransmitted;
+    connection->srtt_us = values->srtt_us;
+    connection->cwnd = values->cwnd;
+    connection->ssthresh = values->ssthresh;
+    connection->loss_events = values->loss_events;
+    connection->timeouts = values->timeouts;
+    connection->rto_ms = values->rto_ms;
+    memcpy(connection->congestion, values->congestion, sizeof(connection->congestion));
+
+    __atomic_store_n(&connection->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+void stats_release_connection(int32_t slot) {
+    if (segment == NULL || slot < 0) {
+        return;
+    }
+    __atomic_store_n(&segment->connections[slot].in_use, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * The reading side. Map somebody else's segment read only, or NULL if it isn't there or isn't one of ours.
+ */
+const StatsSegment *stats_map(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return NULL;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) < 0 || (size_t) status.st_size < sizeof(StatsSegment)) {
+        fprintf(stderr, "%s is not a stats segment\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *mapped = mmap(NULL, sizeof(StatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    const StatsSegment *mapped_segment = mapped;
+    if (__atomic_load_n(&mapped_segment->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC || mapped_segment->version != STATS_VERSION) {
+        fprintf(stderr, "%s is not a version %d stats segment\n", path, STATS_VERSION);
+        munmap(mapped, sizeof(StatsSegment));
+        return NULL;
+    }
+    return mapped_segment;
+}
+
+void stats_unmap(const StatsSegment *mapped_segment) {
+    munmap((void *) mapped_segment, sizeof(StatsSegment));
+}
+
+/*
+ * Every thread's counters added up. Each counter is read on its own, so the total is not one instant but close enough to one.
+ */
+void stats_sum(const StatsSegment *mapped_segment, StatsCounters *total) {
+    memset(total, 0, sizeof(StatsCounters));
+
+    for (uint32_t i = 0; i < mapped_segment->max_threads; i++) {
+        const StatsCounters *counters = &mapped_segment->threads[i];
+        total->packets_in += __atomic_load_n(&counters->packets_in, __ATOMIC_RELAXED);
+        total->bytes_in += __atomic_load_n(&counters->bytes_in, __ATOMIC_RELAXED);
+        total->packets_out += __atomic_load_n(&counters->packets_out, __ATOMIC_RELAXED);
+        total->bytes_out += __atomic_load_n(&counters->bytes_out, __ATOMIC_RELAXED);
+        total->retransmits += __atomic_load_n(&counters->retransmits, __ATOMIC_RELAXED);
+        total->checksum_failures += __atomic_load_n(&counters->checksum_failures, __ATOMIC_RELAXED);
+        total->ip_checksum_failures += __atomic_load_n(&counters->ip_checksum_failures, __ATOMIC_RELAXED);
+        total->duplicates += __atomic_load_n(&counters->duplicates, __ATOMIC_RELAXED);
+        total->timeouts += __atomic_load_n(&counters->timeouts, __ATOMIC_RELAXED);
+        for (uint32_t bucket = 0; bucket < STATS_RTT_BUCKETS; bucket++) {
+            total->rtt_samples[bucket] += __atomic_load_n(&counters->rtt_samples[bucket], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * A consistent copy of one connection slot. Returns 0 if the slot is free, or was being written every time we tried.
+ */
+uint8_t stats_read_connection(const StatsSegment *mapped_segment, uint32_t slot, StatsConnection *copy) {
+    const StatsConnection *connection = &mapped_segment->connections[slot];
+
+    for (int attempt = 0; attempt < 4; attempt++) {
+        if (!__atomic_load_n(&connection->in_use, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        uint32_t before = __atomic_load_n(&connection->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(copy, (const void *) connection, sizeof(StatsConnection));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&connection->sequence, __ATOMIC_RELAXED) == before) {
+            return 1;
+        }
+    }
+    return 0;
+}
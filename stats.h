@@ -0,0 +1,114 @@
+//
+// Created by dustyn on 7/29/24.
+//
+#include <stdint.h>
+#include "dustyns_transport_layer.h"
+#include "packet_pool.h"
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_STATS_H
+#define UNIXCUSTOMTRANSPORTLAYER_STATS_H
+
+#define STATS_MAGIC 0x53544C44U
+#define STATS_VERSION 1
+/*
+ * One counter block per thread, MAX_WORKERS workers and the main thread.
+ */
+#define STATS_MAX_THREADS 65
+#define STATS_MAX_CONNECTIONS 1024
+/*
+ * RTT samples are counted in power of 2 buckets of microseconds, bucket i holds samples under 2^i us (bucket 0 anything under 1us)
+ * and the last one everything from 2^(STATS_RTT_BUCKETS - 2) us up, about 33 seconds.
+ */
+#define STATS_RTT_BUCKETS 27
+/*
+ * How often the server copies every connection's numbers into the segment.
+ */
+#define STATS_PUBLISH_INTERVAL_MS 100
+
+/*
+ * Counters for one thread. Only that thread ever writes them, so there are no locked instructions anywhere, an increment is a plain
+ * load and a relaxed atomic store so a reader never sees a torn value. Each block starts on its own cache line so threads don't
+ * fight over lines.
+ */
+typedef struct StatsCounters {
+    uint64_t packets_in;
+    uint64_t bytes_in;
+    uint64_t packets_out;
+    uint64_t bytes_out;
+    uint64_t retransmits;
+    uint64_t checksum_failures;
+    uint64_t ip_checksum_failures;
+    uint64_t duplicates;
+    uint64_t timeouts;
+    uint64_t rtt_samples[STATS_RTT_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) StatsCounters;
+
+/*
+ * One connection's numbers, what connection_get_stats() gives us. The owning thread claims a slot when the connection is set up and
+ * gives it back when it is released. sequence is odd while the slot is being written, a reader copies the slot and keeps the copy only
+ * if sequence was even and the same before and after.
+ */
+typedef struct StatsConnection {
+    uint32_t sequence;
+    uint32_t in_use;
+    uint32_t peer_ip;
+    uint16_t peer_pid;
+    uint16_t thread;
+    uint64_t packets_sent;
+    uint64_t packets_retransmitted;
+    uint64_t srtt_us;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t loss_events;
+    uint32_t timeouts;
+    uint32_t rto_ms;
+    char congestion[12];
+} StatsConnection;
+
+/*
+ * The memory mapped file. Laid out so a reader only needs this header, the magic and version say it is ours and in this layout.
+ */
+typedef struct StatsSegment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_threads;
+    uint32_t max_connections;
+    uint64_t pid;
+    uint64_t started_us;
+    StatsCounters threads[STATS_MAX_THREADS];
+    StatsConnection connections[STATS_MAX_CONNECTIONS];
+} StatsSegment;
+
+extern __thread StatsCounters *stats_thread;
+
+/*
+ * Bump one of this thread's counters, for example STATS_ADD(packets_in, 1).
+ */
+#define STATS_ADD(counter, amount) \
+    __atomic_store_n(&stats_thread->counter, stats_thread->counter + (amount), __ATOMIC_RELAXED)
+
+uint16_t stats_open(const char *path);
+
+void stats_close();
+
+uint8_t stats_enabled();
+
+void stats_attach_thread(uint16_t index);
+
+void stats_record_rtt(uint64_t sample_us);
+
+int32_t stats_claim_connection(uint32_t peer_ip, uint16_t peer_pid);
+
+void stats_publish_connection(int32_t slot, const StatsConnection *values);
+
+void stats_release_connection(int32_t slot);
+
+const StatsSegment *stats_map(const char *path);
+
+void stats_unmap(const StatsSegment *segment);
+
+void stats_sum(const StatsSegment *segment, StatsCounters *total);
+
+uint8_t stats_read_connection(const StatsSegment *segment, uint32_t slot, StatsConnection *copy);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_STATS_H
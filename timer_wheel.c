@@ -0,0 +1,374 @@
+//
+// Created by dustyn on 6/23/24.
+//
+
+#include <time.h>
+#include <sys/timerfd.h>
+#include "timer_wheel.h"
+#include "stats.h"
+
+/*
+ * The old retransmission timer was alarm() and a SIGALRM handler. That gives us whole seconds at best, a 15 second first timeout,
+ * one timer for the entire process and a signal handler that could only exit() when things went wrong.
+ *
+ * This is a hierarchical timer wheel instead. Think of a clock face with TIMER_WHEEL_SLOTS slots where the hand moves one slot
+ * every millisecond, a timer due in 5ms goes in the slot 5 ahead of the hand and fires when the hand gets there. Timers too far
+ * out for the first wheel go in a coarser wheel whose slots are a whole turn of the first one, and so on up. Every time a finer
+ * wheel wraps around we empty the matching slot of the next wheel up back into the finer ones (cascading). Scheduling and
+ * cancelling are O(1), and 4 levels of 64 slots covers about 4.6 hours.
+ *
+ * The wheel owns a timerfd that is always armed for the earliest timer (or a cascade that comes before it), so the owner can just
+ * poll it alongside the socket.
+ */
+
+uint64_t monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000ULL + (uint64_t) now.tv_nsec / 1000ULL;
+}
+
+uint64_t monotonic_ms() {
+    return monotonic_us() / 1000ULL;
+}
+
+uint16_t timer_wheel_init(TimerWheel *wheel) {
+    memset(wheel, 0, sizeof(TimerWheel));
+    wheel->now_ms = monotonic_ms();
+    wheel->fd_expires_ms = UINT64_MAX;
+
+    wheel->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->timer_fd < 0) {
+        perror("timerfd_create");
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+void timer_wheel_destroy(TimerWheel *wheel) {
+    if (wheel->timer_fd >= 0) {
+        close(wheel->timer_fd);
+    }
+    wheel->timer_fd = -1;
+}
+
+void timer_init(Timer *timer, timer_callback callback, void *context) {
+    memset(timer, 0, sizeof(Timer));
+    timer->callback = callback;
+    timer->context = context;
+}
+
+static void timer_wheel_link(TimerWheel *wheel, Timer *timer) {
+
+    uint64_t delta = timer->expires_ms > wheel->now_ms ? timer->expires_ms - wheel->now_ms : 0;
+    int level = 0;
+
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    /*
+     * Already due goes in the slot for right now, which only happens while cascading and that slot is looked at straight after.
+     * Anything further out than the top level covers gets parked as far out as we can go, it is relinked when it comes around.
+     */
+    uint64_t when = delta == 0 ? wheel->now_ms : timer->expires_ms;
+    if (delta >= (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))) {
+        when = wheel->now_ms + (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    }
+
+    uint32_t slot = (when >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    Timer **head = &wheel->slots[level][slot];
+    timer->level = level;
+    timer->slot = slot;
+
+    timer->prev = NULL;
+    timer->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = timer;
+    }
+    *head = timer;
+}
+
+static void timer_wheel_unlink(TimerWheel *wheel, Timer *timer) {
+
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        wheel->slots[timer->level][timer->slot] = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/*
+ * Arm the timerfd for expires_ms, an absolute CLOCK_MONOTONIC time, or disarm it for UINT64_MAX.
+ * A time that has already gone by fires straight away.
+ */
+static void timer_wheel_set_fd(TimerWheel *wheel, uint64_t expires_ms) {
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+
+    wheel->fd_expires_ms = expires_ms;
+    if (expires_ms != UINT64_MAX) {
+        //0 would disarm it
+        uint64_t when = expires_ms > 0 ? expires_ms : 1;
+        spec.it_value.tv_sec = (time_t) (when / 1000);
+        spec.it_value.tv_nsec = (long) (when % 1000) * 1000000L;
+    }
+
+    if (wheel->timer_fd >= 0 && timerfd_settime(wheel->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        perror("timerfd_settime");
+    }
+}
+
+/*
+ * When the wheel next has something to do, without looking at a single timer. The first occupied level 0 slot ahead of the
+ * hand is exactly when its timers are due. For the levels above, the first occupied slot ahead is when it gets cascaded, which
+ * is no later than anything in it is due. Waking up for a cascade just means we cascade and look again.
+ * That is at most TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS pointers however many connections share the wheel.
+ */
+static uint64_t timer_wheel_next_expiry(TimerWheel *wheel) {
+
+    uint64_t earliest = UINT64_MAX;
+
+    if (wheel->armed == 0) {
+        return earliest;
+    }
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        int shift = TIMER_WHEEL_BITS * level;
+        uint64_t hand = wheel->now_ms >> shift;
+
+        for (uint64_t ahead = 1; ahead <= TIMER_WHEEL_SLOTS; ahead++) {
+            uint64_t when = (hand + ahead) << shift;
+            if (when >= earliest) {
+                break;
+            }
+            if (wheel->slots[level][(hand + ahead) & TIMER_WHEEL_MASK] != NULL) {
+                earliest = when;
+                break;
+            }
+        }
+    }
+    return earliest;
+}
+
+/*
+ * Set the timerfd for whatever is next on the wheel, if that isn't what it is already set for.
+ * While advancing we leave it alone, timer_wheel_advance() does this once it is done.
+ */
+static void timer_wheel_arm_fd(TimerWheel *wheel) {
+
+    if (wheel->advancing) {
+        return;
+    }
+
+    uint64_t earliest = timer_wheel_next_expiry(wheel);
+    if (earliest != wheel->fd_expires_ms) {
+        timer_wheel_set_fd(wheel, earliest);
+    }
+}
+
+void timer_wheel_schedule(TimerWheel *wheel, Timer *timer, uint32_t delay_ms) {
+
+    /*
+     * The wheel may not have been advanced for a while, catch it up first so the slot maths lines up with the real clock.
+     * This has to come before we look at armed, catching up can fire callbacks and one of them may well schedule this
+     * same timer (the pacing timer sends, sending rearms the retransmit timer). Unlink first and it would get linked twice.
+     */
+    if (!wheel->advancing) {
+        timer_wheel_advance(wheel, monotonic_ms());
+    }
+
+    //Moving the timer the fd is set for, it may not be the earliest any more
+    uint8_t was_earliest = 0;
+    if (timer->armed) {
+        was_earliest = timer->expires_ms <= wheel->fd_expires_ms;
+        timer_wheel_unlink(wheel, timer);
+        wheel->armed--;
+    }
+
+    //A slot is only looked at once per tick, so 0 means the next tick
+    timer->expires_ms = wheel->now_ms + (delay_ms > 0 ? delay_ms : 1);
+    timer->armed = 1;
+    timer_wheel_link(wheel, timer);
+    wheel->armed++;
+
+    /*
+     * Most of the time this is a retransmit or delayed ACK timer being pushed back and something else on the wheel is sooner,
+     * then the timerfd is already right and there is nothing to do.
+     */
+    if (was_earliest) {
+        timer_wheel_arm_fd(wheel);
+    } else if (timer->expires_ms < wheel->fd_expires_ms && !wheel->advancing) {
+        timer_wheel_set_fd(wheel, timer->expires_ms);
+    }
+}
+
+void timer_wheel_cancel(TimerWheel *wheel, Timer *timer) {
+    if (!timer->armed) {
+        return;
+    }
+    timer_wheel_unlink(wheel, timer);
+    timer->armed = 0;
+    wheel->armed--;
+    //Only the timer the fd is set for changes when it should go off
+    if (timer->expires_ms <= wheel->fd_expires_ms) {
+        timer_wheel_arm_fd(wheel);
+    }
+}
+
+/*
+ * Empty one slot of a coarser level back into the wheel, everything in it lands in a finer level now that it is closer.
+ */
+static void timer_wheel_cascade(TimerWheel *wheel, int level, uint32_t slot) {
+    Timer *timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        timer_wheel_link(wheel, timer);
+        timer = next;
+    }
+}
+
+/*
+ * Move the hand forward to now_ms one tick at a time, cascading and firing as we go.
+ * Callbacks are free to schedule or cancel timers, including the one that just fired.
+ * Returns how many timers fired.
+ */
+uint32_t timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms) {
+
+    uint32_t fired = 0;
+
+    if (wheel->armed == 0) {
+        if (now_ms > wheel->now_ms) {
+            wheel->now_ms = now_ms;
+        }
+        /*
+         * The fd can still be set for a cascade of a timer that has since been cancelled. Once that has gone off, fd_expires_ms
+         * is in the past and timer_wheel_schedule() would take it as something sooner already being armed.
+         */
+        timer_wheel_arm_fd(wheel);
+        return 0;
+    }
+
+    wheel->advancing = 1;
+
+    while (wheel->now_ms < now_ms) {
+        wheel->now_ms++;
+
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((wheel->now_ms & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            timer_wheel_cascade(wheel, level, (wheel->now_ms >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+        }
+
+        /*
+         * Take timers off the slot one at a time rather than detaching the whole list, that way a callback
+         * cancelling another timer in this same slot still finds it where it expects.
+         */
+        uint32_t slot = wheel->now_ms & TIMER_WHEEL_MASK;
+        Timer *timer;
+
+        while ((timer = wheel->slots[0][slot]) != NULL) {
+            timer_wheel_unlink(wheel, timer);
+
+            if (timer->expires_ms > wheel->now_ms) {
+                //Clamped in from further out than the wheel reaches, not actually due yet
+                timer_wheel_link(wheel, timer);
+                continue;
+            }
+
+            timer->armed = 0;
+            wheel->armed--;
+            fired++;
+            if (timer->callback != NULL) {
+                timer->callback(timer, timer->context);
+            }
+        }
+
+        if (wheel->armed == 0) {
+            wheel->now_ms = now_ms;
+            break;
+        }
+    }
+
+    wheel->advancing = 0;
+    timer_wheel_arm_fd(wheel);
+    return fired;
+}
+
+/*
+ * Call this when the timerfd polls readable.
+ */
+uint32_t timer_wheel_handle_fd(TimerWheel *wheel) {
+    uint64_t expirations;
+    if (read(wheel->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        perror("read timerfd");
+    }
+    return timer_wheel_advance(wheel, monotonic_ms());
+}
+
+void rtt_estimator_init(RttEstimator *rtt) {
+    memset(rtt, 0, sizeof(RttEstimator));
+    rtt->rto_ms = INITIAL_RTO_MS;
+}
+
+/*
+ * Jacobson/Karels, as laid out in RFC 6298. The first sample sets the smoothed RTT directly and the variance to half of it,
+ * after that the smoothed RTT moves 1/8 of the way towards each sample and the variance 1/4 of the way towards the
+ * difference. RTO is the smoothed RTT plus 4 times the variance, clamped.
+ *
+ * Only feed this samples from packets that were sent once (Karn's algorithm), otherwise we can't tell which send the ACK was for.
+ */
+void rtt_estimator_sample(RttEstimator *rtt, uint64_t sample_us) {
+
+    stats_record_rtt(sample_us);
+
+    if (!rtt->has_sample) {
+        rtt->srtt_us = sample_us;
+        rtt->rttvar_us = sample_us / 2;
+        rtt->has_sample = 1;
+    } else {
+        uint64_t difference = rtt->srtt_us > sample_us ? rtt->srtt_us - sample_us : sample_us - rtt->srtt_us;
+        rtt->rttvar_us = (3 * rtt->rttvar_us + difference) / 4;
+        rtt->srtt_us = (7 * rtt->srtt_us + sample_us) / 8;
+    }
+
+    uint64_t rto_ms = (rtt->srtt_us + 4 * rtt->rttvar_us + 999) / 1000;
+    if (rto_ms < MIN_RTO_MS) {
+        rto_ms = MIN_RTO_MS;
+    } else if (rto_ms > MAX_RTO_MS) {
+        rto_ms = MAX_RTO_MS;
+    }
+    rtt->rto_ms = (uint32_t) rto_ms;
+}
+
+void retransmit_timer_init(RetransmitTimer *timer, TimerWheel *wheel, timer_callback callback, void *context) {
+    memset(timer, 0, sizeof(RetransmitTimer));
+    timer_init(&timer->timer, callback, context);
+    timer->wheel = wheel;
+    rtt_estimator_init(&timer->rtt);
+}
+
+/*
+ * The timer went off. Exponential backoff, each timeout in a row doubles the RTO so we are not hammering a network that is already
+ * in trouble. Past MAX_RETRANSMITS we return ERROR and it is up to the owner to give up on the connection.
+ */
+uint16_t retransmit_timer_backoff(RetransmitTimer *timer) {
+    timer->num_timeouts++;
+    STATS_ADD(timeouts, 1);
+
+    if (timer->num_timeouts > MAX_RETRANSMITS) {
+        return ERROR;
+    }
+
+    uint32_t rto = timer->rtt.rto_ms * 2;
+    timer->rtt.rto_ms = rto > MAX_RTO_MS ? MAX_RTO_MS : rto;
+    return SUCCESS;
+}
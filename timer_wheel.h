@@ -0,0 +1,101 @@
+//
+// Created by dustyn on 6/23/24.
+//
+#include <stdint.h>
+#include "dustyns_transport_layer.h"
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_TIMER_WHEEL_H
+#define UNIXCUSTOMTRANSPORTLAYER_TIMER_WHEEL_H
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/*
+ * RTO limits in milliseconds. Before we have a single RTT sample we go with INITIAL_RTO_MS.
+ * After MAX_RETRANSMITS timeouts in a row with no ACK we give up on the connection.
+ */
+#define INITIAL_RTO_MS 200
+#define MIN_RTO_MS 5
+#define MAX_RTO_MS 60000
+#define MAX_RETRANSMITS 8
+
+typedef struct Timer Timer;
+
+typedef void (*timer_callback)(Timer *timer, void *context);
+
+struct Timer {
+    Timer *next;
+    Timer *prev;
+    uint64_t expires_ms;
+    timer_callback callback;
+    void *context;
+    uint8_t armed;
+    uint8_t level;
+    uint8_t slot;
+};
+
+/*
+ * Each level is a ring of slots, each slot a list of timers. Level 0 slots are 1ms apart, every level up is
+ * TIMER_WHEEL_SLOTS times coarser. The timerfd is armed for the earliest timer so whoever owns the wheel can poll it,
+ * fd_expires_ms is the time it is armed for (UINT64_MAX when it isn't).
+ */
+typedef struct TimerWheel {
+    Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t now_ms;
+    uint64_t fd_expires_ms;
+    uint32_t armed;
+    uint8_t advancing;
+    int timer_fd;
+} TimerWheel;
+
+/*
+ * Jacobson/Karels smoothed round trip time, kept in microseconds since loopback RTTs are well under a millisecond.
+ */
+typedef struct RttEstimator {
+    uint64_t srtt_us;
+    uint64_t rttvar_us;
+    uint32_t rto_ms;
+    uint8_t has_sample;
+} RttEstimator;
+
+/*
+ * A retransmit timer for one stream of packets, it carries the RTT estimate that decides how long to wait
+ * and counts how many times in a row it has gone off.
+ */
+typedef struct RetransmitTimer {
+    Timer timer;
+    TimerWheel *wheel;
+    RttEstimator rtt;
+    uint64_t sent_at_us;
+    uint16_t num_timeouts;
+} RetransmitTimer;
+
+uint64_t monotonic_ms();
+
+uint64_t monotonic_us();
+
+uint16_t timer_wheel_init(TimerWheel *wheel);
+
+void timer_wheel_destroy(TimerWheel *wheel);
+
+void timer_init(Timer *timer, timer_callback callback, void *context);
+
+void timer_wheel_schedule(TimerWheel *wheel, Timer *timer, uint32_t delay_ms);
+
+void timer_wheel_cancel(TimerWheel *wheel, Timer *timer);
+
+uint32_t timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms);
+
+uint32_t timer_wheel_handle_fd(TimerWheel *wheel);
+
+void rtt_estimator_init(RttEstimator *rtt);
+
+void rtt_estimator_sample(RttEstimator *rtt, uint64_t sample_us);
+
+void retransmit_timer_init(RetransmitTimer *timer, TimerWheel *wheel, timer_callback callback, void *context);
+
+uint16_t retransmit_timer_backoff(RetransmitTimer *timer);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_TIMER_WHEEL_H
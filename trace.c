@@ -0,0 +1,328 @@
+//
+// Created by dustyn on 7/31/24.
+//
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include "trace.h"
+#include "dustyns_transport_layer.h"
+#include "timer_wheel.h"
+#include "log.h"
+
+/*
+ * When a collection stalls, all we have to go on afterwards is a counter or two. This is a flight recorder for the wire instead,
+ * every datagram we send or take in goes into a fixed size ring in memory, our ip header, our Header, the start of the payload and when.
+ * Nothing is written anywhere until somebody asks, with SIGUSR1, or something goes wrong (trace_dump_on_error()), then whatever the
+ * ring still holds goes out as a pcapng file Wireshark opens as it is. Datagrams are IPv4 packets starting at our ip header, each one
+ * flagged inbound or outbound and with a comment naming the connection it belongs to, the peer's address and process id.
+ *
+ * Recording is a fetch and add to claim a slot, a clock read and a copy of snaplen bytes, there is no I/O and no lock. The ring just
+ * wraps over the oldest datagrams. Each slot has a sequence that is odd while it is being written, so a dump running alongside the
+ * threads recording skips anything it catches half written.
+ */
+
+typedef struct TraceRecord {
+    uint64_t sequence;
+    uint64_t time_us;
+    uint32_t length;
+    uint16_t captured;
+    uint8_t direction;
+    uint8_t data[];
+} TraceRecord;
+
+static uint8_t tracing;
+static uint8_t *ring;
+static uint32_t ring_slots;
+static uint32_t record_size;
+static uint16_t snap_length;
+static uint64_t position;
+static int64_t realtime_offset_us;
+static char dump_path[256];
+static uint64_t last_error_dump_ms;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t dumper;
+
+static TraceRecord *trace_slot(uint64_t index) {
+    return (TraceRecord *) (ring + (index & (ring_slots - 1)) * record_size);
+}
+
+/*
+ * Dumps on demand, SIGUSR1 from outside or trace_dump_on_error(). SIGUSR1 is blocked everywhere and this thread is the only one that
+ * waits for it.
+ */
+static void *trace_dumper_main(void *arg) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    while (true) {
+        int signal_number;
+        if (sigwait(&signals, &signal_number) == 0) {
+            trace_dump();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start recording into a ring of slots datagrams, keeping snaplen bytes of each, and dump to path when asked. slots is rounded up to a
+ * power of 2 and snaplen up to at least both headers, so every record knows whose it is.
+ *
+ * Has to be called before any other threads are started, SIGUSR1 gets blocked here and they need to inherit that or one of them
+ * will be killed by it.
+ */
+uint16_t trace_enable(const char *path, uint32_t slots, uint16_t snaplen) {
+    if (tracing) {
+        return SUCCESS;
+    }
+    if (strlen(path) + 5 > sizeof(dump_path)) {
+        fprintf(stderr, "Trace path too long\n");
+        return ERROR;
+    }
+
+    ring_slots = 1;
+    while (ring_slots < slots) {
+        ring_slots <<= 1;
+    }
+    snap_length = snaplen < PACKET_LENGTH(0) ? PACKET_LENGTH(0) : snaplen;
+    record_size = (sizeof(TraceRecord) + snap_length + 7) & ~7U;
+
+    ring = calloc(ring_slots, record_size);
+    if (ring == NULL) {
+        perror("calloc");
+        return ERROR;
+    }
+    strcpy(dump_path, path);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    realtime_offset_us = (int64_t) ((uint64_t) now.tv_sec * 1000000ULL + (uint64_t) now.tv_nsec / 1000ULL) - (int64_t) monotonic_us();
+
+    sigset_t signals;
+    sigset_t previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        perror("pthread_sigmask");
+        return ERROR;
+    }
+
+    //The dumper takes nothing but SIGUSR1, which it waits for with it blocked
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &previous);
+    int result = pthread_create(&dumper, NULL, trace_dumper_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (result != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        return ERROR;
+    }
+    pthread_detach(dumper);
+
+    __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+uint8_t trace_active() {
+    return __atomic_load_n(&tracing, __ATOMIC_RELAXED);
+}
+
+/*
+ * Remember one datagram, length bytes long starting at our ip header and spread over iov. Only the first snaplen bytes are kept.
+ */
+void trace_record(uint8_t direction, const struct iovec iov[], int iov_count, uint32_t length) {
+    if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    uint64_t index = __atomic_fetch_add(&position, 1, __ATOMIC_RELAXED);
+    TraceRecord *record = trace_slot(index);
+
+    __atomic_store_n(&record->sequence, 2 * index + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    record->time_us = monotonic_us();
+    record->length = length;
+    record->direction = direction;
+
+    uint32_t wanted = length < snap_length ? length : snap_length;
+    uint32_t copied = 0;
+    for (int i = 0; i < iov_count && copied < wanted; i++) {
+        uint32_t chunk = iov[i].iov_len < wanted - copied ? (uint32_t) iov[i].iov_len : wanted - copied;
+        memcpy(record->data + copied, iov[i].iov_base, chunk);
+        copied += chunk;
+    }
+    record->captured = (uint16_t) copied;
+
+    __atomic_store_n(&record->sequence, 2 * index + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * pcapng wants every block a multiple of 4 bytes, with its length at both ends
+ */
+static uint32_t pad4(uint32_t length) {
+    return (length + 3) & ~3U;
+}
+
+static void trace_write_option(FILE *file, uint16_t code, const void *value, uint16_t length) {
+    static const uint8_t zeros[4];
+    fwrite(&code, sizeof(code), 1, file);
+    fwrite(&length, sizeof(length), 1, file);
+    fwrite(value, 1, length, file);
+    fwrite(zeros, 1, pad4(length) - length, file);
+}
+
+static void trace_write_headers(FILE *file) {
+    static const char application[] = "UnixCustomTransportLayer";
+    static const uint16_t version[2] = {1, 0};
+    uint16_t link[2] = {LINKTYPE_IPV4, 0};
+    uint32_t block[7];
+
+    //Section header, host byte order throughout, the magic tells the reader which that is
+    uint32_t length = 24 + 4 + pad4(sizeof(application) - 1) + 4 + 4;
+    block[0] = PCAPNG_SECTION_HEADER;
+    block[1] = length;
+    block[2] = PCAPNG_BYTE_ORDER_MAGIC;
+    memcpy(&block[3], version, sizeof(version));
+    block[4] = 0xFFFFFFFF; //Section length, not given
+    block[5] = 0xFFFFFFFF;
+    fwrite(block, sizeof(uint32_t), 6, file);
+    trace_write_option(file, 4, application, sizeof(application) - 1); //shb_userappl
+    block[0] = 0; //opt_endofopt
+    block[1] = length;
+    fwrite(block, sizeof(uint32_t), 2, file);
+
+    //One interface, raw IPv4, microsecond timestamps which is the default
+    block[0] = PCAPNG_INTERFACE_DESCRIPTION;
+    block[1] = 20;
+    memcpy(&block[2], link, sizeof(link));
+    block[3] = snap_length;
+    block[4] = 20;
+    fwrite(block, sizeof(uint32_t), 5, file);
+}
+
+/*
+ * One enhanced packet block, the datagram, which way it went and whose it is
+ */
+static void trace_write_record(FILE *file, const TraceRecord *record) {
+    static const uint8_t zeros[4];
+    const struct iphdr *ip_header = (const struct iphdr *) record->data;
+    const Header *header = (const Header *) (record->data + sizeof(struct iphdr));
+
+    struct in_addr peer;
+    uint16_t peer_pid;
+    if (record->direction == TRACE_IN) {
+        peer.s_addr = ip_header->saddr;
+        peer_pid = header->source_process_id;
+    } else {
+        peer.s_addr = ip_header->daddr;
+        peer_pid = header->dest_process_id;
+    }
+    char comment[48];
+    int comment_length = snprintf(comment, sizeof(comment), "conn %s:%u", inet_ntoa(peer), peer_pid);
+
+    //epb_flags, the low 2 bits are the direction, 1 inbound and 2 outbound, same as ours
+    uint32_t flags = record->direction;
+    uint32_t length = 28 + pad4(record->captured) + 8 + 4 + pad4(comment_length) + 4 + 4;
+    uint64_t time_us = (uint64_t) ((int64_t) record->time_us + realtime_offset_us);
+
+    uint32_t block[7];
+    block[0] = PCAPNG_ENHANCED_PACKET;
+    block[1] = length;
+    block[2] = 0; //Interface
+    block[3] = (uint32_t) (time_us >> 32);
+    block[4] = (uint32_t) time_us;
+    block[5] = record->captured;
+    block[6] = record->length;
+    fwrite(block, sizeof(uint32_t), 7, file);
+    fwrite(record->data, 1, record->captured, file);
+    fwrite(zeros, 1, pad4(record->captured) - record->captured, file);
+    trace_write_option(file, 2, &flags, sizeof(flags)); //epb_flags
+    trace_write_option(file, 1, comment, (uint16_t) comment_length); //opt_comment
+    block[0] = 0; //opt_endofopt
+    block[1] = length;
+    fwrite(block, sizeof(uint32_t), 2, file);
+}
+
+/*
+ * Write everything the ring still holds to the dump path, oldest first. It goes to a temporary file that is renamed into place,
+ * so whoever opens the path only ever sees a complete dump.
+ */
+uint16_t trace_dump() {
+    if (!trace_active()) {
+        return ERROR;
+    }
+
+    pthread_mutex_lock(&dump_lock);
+
+    char temporary[sizeof(dump_path) + 4];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", dump_path);
+    FILE *file = fopen(temporary, "w");
+    if (file == NULL) {
+        perror("fopen");
+        pthread_mutex_unlock(&dump_lock);
+        return ERROR;
+    }
+    trace_write_headers(file);
+
+    TraceRecord *copy = malloc(record_size);
+    uint64_t end = __atomic_load_n(&position, __ATOMIC_ACQUIRE);
+    uint64_t start = end > ring_slots ? end - ring_slots : 0;
+    uint32_t written = 0;
+
+    for (uint64_t index = start; copy != NULL && index < end; index++) {
+        const TraceRecord *record = trace_slot(index);
+        uint64_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        if (sequence != 2 * index + 2) {
+            //Still being written, or already written over
+            continue;
+        }
+        memcpy(copy, record, record_size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&record->sequence, __ATOMIC_RELAXED) != sequence) {
+            continue;
+        }
+        trace_write_record(file, copy);
+        written++;
+    }
+    free(copy);
+
+    uint16_t result = SUCCESS;
+    if (fclose(file) != 0 || rename(temporary, dump_path) < 0) {
+        perror("trace dump");
+        result = ERROR;
+    } else {
+        LOG_INFO("Dumped %u datagrams to %s", written, dump_path);
+    }
+
+    pthread_mutex_unlock(&dump_lock);
+    return result;
+}
+
+/*
+ * Something went wrong, keep the wire's side of the story before it is written over. The first of a burst of errors gets the dump,
+ * the ring still has what led up to the rest.
+ *
+ * This gets called from timer callbacks on the event loop, and writing out a full ring with stdio there would stall every connection
+ * for as long as it takes. We just poke the dumper thread the same way a SIGUSR1 from outside would, it copies what the ring holds
+ * while we carry on recording.
+ */
+void trace_dump_on_error(const char *reason) {
+    if (!trace_active()) {
+        return;
+    }
+
+    uint64_t now_ms = monotonic_ms();
+    uint64_t last_ms = __atomic_load_n(&last_error_dump_ms, __ATOMIC_RELAXED);
+    if (last_ms != 0 && now_ms - last_ms < TRACE_ERROR_DUMP_INTERVAL_MS) {
+        return;
+    }
+    if (!__atomic_compare_exchange_n(&last_error_dump_ms, &last_ms, now_ms, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    LOG_WARN("%s, dumping trace", reason);
+    int result = pthread_kill(dumper, SIGUSR1);
+    if (result != 0) {
+        LOG_WARN("pthread_kill: %s", strerror(result));
+    }
+}
@@ -0,0 +1,43 @@
+//
+// Created by dustyn on 7/31/24.
+//
+#include <stdint.h>
+#include <sys/uio.h>
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_TRACE_H
+#define UNIXCUSTOMTRANSPORTLAYER_TRACE_H
+
+#define TRACE_IN 1
+#define TRACE_OUT 2
+
+/*
+ * How many datagrams the ring remembers, a power of 2, and how many bytes of each, counted from our ip header.
+ * 128 bytes is both headers and the first 72 bytes of payload.
+ */
+#define TRACE_DEFAULT_SLOTS 65536
+#define TRACE_DEFAULT_SNAPLEN 128
+/*
+ * Dumps on error are at least this far apart, when a lot of peers vanish at once they would all want one
+ */
+#define TRACE_ERROR_DUMP_INTERVAL_MS 1000
+
+/*
+ * pcapng block types and the one link type we write, every datagram starts with our ip header
+ */
+#define PCAPNG_SECTION_HEADER 0x0A0D0D0A
+#define PCAPNG_INTERFACE_DESCRIPTION 0x00000001
+#define PCAPNG_ENHANCED_PACKET 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define LINKTYPE_IPV4 228
+
+uint16_t trace_enable(const char *path, uint32_t slots, uint16_t snaplen);
+
+uint8_t trace_active();
+
+void trace_record(uint8_t direction, const struct iovec iov[], int iov_count, uint32_t length);
+
+uint16_t trace_dump();
+
+void trace_dump_on_error(const char *reason);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_TRACE_H
@@ -0,0 +1,192 @@
+//
+// Created by dustyn on 7/14/24.
+//
+
+#include <stddef.h>
+#include <sched.h>
+#include <linux/filter.h>
+#include "worker.h"
+#include "connection.h"
+#include "trace.h"
+
+/*
+ * A single Server is one thread, so one core, no matter how many peers it has. To use the rest of the box we run N workers, each one
+ * a thread with its own raw socket and its own Server. Every peer belongs to exactly one worker, picked by hashing its address and
+ * process id (connection_shard), so a connection never moves between cores and the workers share nothing, there are no locks anywhere
+ * on the receive or send path.
+ *
+ * Raw sockets don't load balance like SO_REUSEPORT does for UDP, every raw socket gets its own copy of every datagram. So each worker's
+ * socket gets a classic BPF filter attached that works out the shard in the kernel and only lets through the datagrams that belong to
+ * that worker. If the filter can't be attached the worker sees everything and drops what isn't its own in user space instead.
+ *
+ * SIGINT and SIGTERM are blocked in every thread and the main thread just waits for one of them, then stops the workers through their
+ * control eventfds. A worker that fails raises SIGTERM itself so the whole group comes down together.
+ */
+
+/*
+ * The filter sees the datagram starting at the kernel's ip header, our ip header and transport header come after it.
+ * This is connection_shard() instruction for instruction, the two have to agree or peers get lost.
+ */
+uint16_t worker_attach_shard_filter(int socket, uint16_t index, uint16_t num_workers) {
+
+    struct sock_filter code[] = {
+            //X = length of the kernel's ip header
+            BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+            //A = the sender's process id, M[0] = A
+            BPF_STMT(BPF_LD | BPF_H | BPF_IND, sizeof(struct iphdr) + offsetof(Header, source_process_id)),
+            BPF_STMT(BPF_ST, 0),
+            //A = the source address in our ip header, X = the process id
+            BPF_STMT(BPF_LD | BPF_W | BPF_IND, offsetof(struct iphdr, saddr)),
+            BPF_STMT(BPF_LDX | BPF_MEM, 0),
+            BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+            BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, CONNECTION_SHARD_MULTIPLIER),
+            BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+            BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num_workers),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, index, 0, 1),
+            BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+            BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+
+    struct sock_fprog program;
+    program.len = sizeof(code) / sizeof(code[0]);
+    program.filter = code;
+
+    if (setsockopt(socket, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0) {
+        perror("SO_ATTACH_FILTER");
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+/*
+ * The worker pins itself rather than being started pinned, that way a cpu that doesn't exist or that we aren't allowed on
+ * just costs us the pinning and not the worker.
+ */
+static void *worker_main(void *arg) {
+    Worker *worker = arg;
+
+    //The main thread has counter block 0
+    stats_attach_thread(worker->index + 1);
+
+    if (worker->cpu != NO_CPU) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            fprintf(stderr, "Could not pin worker %u to cpu %d\n", worker->index, worker->cpu);
+        }
+    }
+
+    worker->result = server_run(&worker->server);
+    if (worker->result != SUCCESS) {
+        fprintf(stderr, "Worker %u failed, shutting down\n", worker->index);
+        trace_dump_on_error("Worker failed");
+        kill(getpid(), SIGTERM);
+    }
+    return NULL;
+}
+
+static uint16_t worker_init(Worker *worker, uint16_t index, uint16_t num_workers, int cpu, uint32_t local_ip, uint16_t local_pid,
+                            uint16_t window_size, uint8_t echo) {
+    memset(worker, 0, sizeof(Worker));
+    worker->index = index;
+    worker->cpu = cpu;
+
+    worker->socket = socket(AF_INET, SOCK_RAW, IP_HDRINCL);
+    if (worker->socket < 0) {
+        perror("socket");
+        return ERROR;
+    }
+
+    if (server_init(&worker->server, worker->socket, local_ip, local_pid, window_size) != SUCCESS) {
+        close(worker->socket);
+        return ERROR;
+    }
+
+    worker->server.echo = echo;
+    worker->server.shard_index = index;
+    worker->server.num_shards = num_workers;
+    worker->server.shard_filtered = num_workers <= 1 || worker_attach_shard_filter(worker->socket, index, num_workers) == SUCCESS;
+    return SUCCESS;
+}
+
+static uint16_t worker_start(Worker *worker) {
+    int result = pthread_create(&worker->thread, NULL, worker_main, worker);
+    if (result != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        return ERROR;
+    }
+    worker->started = 1;
+    return SUCCESS;
+}
+
+/*
+ * Start num_workers workers and serve until SIGINT or SIGTERM. Worker i is pinned to cpus[i % num_cpus], pass no cpus to leave
+ * scheduling up to the kernel. Returns SUCCESS if every worker stopped cleanly.
+ */
+uint16_t run_workers(uint16_t num_workers, const int cpus[], uint16_t num_cpus, uint32_t local_ip, uint16_t local_pid,
+                     uint16_t window_size, uint8_t echo) {
+
+    if (num_workers == 0) {
+        num_workers = 1;
+    } else if (num_workers > MAX_WORKERS) {
+        num_workers = MAX_WORKERS;
+    }
+
+    //Block these before any thread starts so they all inherit it, only the sigwait() below ever sees them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        perror("pthread_sigmask");
+        return ERROR;
+    }
+
+    Worker *workers = calloc(num_workers, sizeof(Worker));
+    if (workers == NULL) {
+        perror("calloc");
+        return ERROR;
+    }
+
+    uint16_t result = SUCCESS;
+    uint16_t initialized = 0;
+
+    for (; initialized < num_workers; initialized++) {
+        int cpu = num_cpus > 0 ? cpus[initialized % num_cpus] : NO_CPU;
+        if (worker_init(&workers[initialized], initialized, num_workers, cpu, local_ip, local_pid, window_size, echo) != SUCCESS) {
+            result = ERROR;
+            break;
+        }
+    }
+
+    for (uint16_t i = 0; i < initialized && result == SUCCESS; i++) {
+        if (worker_start(&workers[i]) != SUCCESS) {
+            result = ERROR;
+        }
+    }
+
+    if (result == SUCCESS) {
+        int signal_number;
+        sigwait(&signals, &signal_number);
+    }
+
+    for (uint16_t i = 0; i < initialized; i++) {
+        if (workers[i].started) {
+            server_stop(&workers[i].server);
+        }
+    }
+    for (uint16_t i = 0; i < initialized; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+            if (workers[i].result != SUCCESS) {
+                result = ERROR;
+            }
+        }
+        server_destroy(&workers[i].server);
+        close(workers[i].socket);
+    }
+
+    free(workers);
+    return result;
+}
@@ -0,0 +1,33 @@
+//
+// Created by dustyn on 7/14/24.
+//
+#include <pthread.h>
+#include "dustyns_transport_layer.h"
+#include "server.h"
+
+#ifndef UNIXCUSTOMTRANSPORTLAYER_WORKER_H
+#define UNIXCUSTOMTRANSPORTLAYER_WORKER_H
+
+#define MAX_WORKERS 64
+#define NO_CPU (-1)
+
+/*
+ * One thread with its own raw socket and its own Server, so its own slice of the connection table, timer wheel and receive ring.
+ * Nothing in here is shared with any other worker.
+ */
+typedef struct Worker {
+    pthread_t thread;
+    Server server;
+    int socket;
+    int cpu;
+    uint16_t index;
+    uint16_t result;
+    uint8_t started;
+} Worker;
+
+uint16_t worker_attach_shard_filter(int socket, uint16_t index, uint16_t num_workers);
+
+uint16_t run_workers(uint16_t num_workers, const int cpus[], uint16_t num_cpus, uint32_t local_ip, uint16_t local_pid,
+                     uint16_t window_size, uint8_t echo);
+
+#endif //UNIXCUSTOMTRANSPORTLAYER_WORKER_H